@@ -0,0 +1,43 @@
+import json
+import sys
+import argparse
+
+# Compare two miniWeather_bench JSON reports, e.g. of a commit and its parent,
+# and fail if any kernel got slower by more than the tolerance
+if __name__ == "__main__":
+    parser = argparse.ArgumentParser(description="Compare two miniWeather_bench reports kernel by kernel")
+    parser.add_argument("baseline", help="JSON report to compare against")
+    parser.add_argument("current", help="JSON report of the build under test")
+    parser.add_argument("--tolerance", type=float, default=0.10, help="Allowed slowdown (default: 0.10 = 10%%)")
+    args = parser.parse_args()
+
+    def load(path):
+        with open(path) as f:
+            report = json.load(f)
+        return report, {(r["kernel"], r["nx"], r["nz"], r["threads"]): r for r in report["results"]}
+
+    base_report, base = load(args.baseline)
+    cur_report, cur = load(args.current)
+    print(f"baseline: {base_report.get('label') or args.baseline}, current: {cur_report.get('label') or args.current}")
+    print(f"{'kernel':<22} {'grid':>10} {'threads':>7} {'base usec':>11} {'usec':>11} {'change':>8}")
+
+    slower = []
+    for key in sorted(set(base) & set(cur)):
+        b, c = base[key]["sec_per_call"], cur[key]["sec_per_call"]
+        change = c / b - 1.
+        flag = " <-- slower" if change > args.tolerance else ""
+        print(f"{key[0]:<22} {f'{key[1]}x{key[2]}':>10} {key[3]:>7} {b * 1e6:>11.3f} {c * 1e6:>11.3f} {100 * change:>7.1f}%{flag}")
+        if flag:
+            slower.append(key)
+    missing = sorted(set(base) ^ set(cur))
+    if missing:
+        print(f"\n{len(missing)} measurements are in only one report and were skipped")
+
+    if not base.keys() & cur.keys():
+        print("\nResult: FAILURE (the reports have no measurements in common)")
+        sys.exit(1)
+    if slower:
+        print(f"\nResult: FAILURE ({len(slower)} kernels slower by more than {100 * args.tolerance:.0f}%)")
+        sys.exit(1)
+    print(f"\nResult: SUCCESS (no kernel slower by more than {100 * args.tolerance:.0f}%)")
+    sys.exit(0)
@@ -0,0 +1,45 @@
+import subprocess
+import re
+import sys
+import argparse
+
+def run(cmd):
+    print(f"Running: {' '.join(cmd)}")
+    result = subprocess.run(cmd, capture_output=True, text=True)
+    if result.returncode != 0:
+        print(f"Error: Simulation failed with return code {result.returncode}")
+        print(result.stdout)
+        print(result.stderr)
+        sys.exit(1)
+    found = dict(re.findall(r"^(d_mass|d_te):\s+(\S+)$", result.stdout, re.M))
+    if len(found) != 2:
+        print("Error: no d_mass / d_te in the output")
+        print(result.stdout)
+        sys.exit(1)
+    return found
+
+if __name__ == "__main__":
+    parser = argparse.ArgumentParser(description="Check that an alternative code path gives the same mass and energy change as the default one")
+    parser.add_argument("--exe", default="./miniWeather_mpi", help="Path to executable")
+    parser.add_argument("--np", type=int, default=2, help="MPI ranks")
+    parser.add_argument("--args", default="", help="Simulation options for both runs")
+    parser.add_argument("--variant", required=True, help="Extra options selecting the path under test")
+    parser.add_argument("--tol", type=float, default=0.0, help="Largest allowed difference in d_mass and d_te (default: exact match)")
+    args = parser.parse_args()
+
+    mpi = ["mpiexec", "-n", str(args.np), args.exe] + args.args.split()
+    ref = run(mpi)
+    new = run(mpi + args.variant.split())
+    for key in ["d_mass", "d_te"]:
+        print(f"{key}: default {ref[key]}, {args.variant} {new[key]}")
+    # A bitwise identical state prints the same values, so the default is an
+    # exact match. Paths that reorder the arithmetic get a tolerance instead
+    if args.tol == 0.0:
+        same = ref == new
+    else:
+        same = all(abs(float(new[key]) - float(ref[key])) <= args.tol for key in ref)
+    if same:
+        print(f"\nResult: SUCCESS ({args.variant} matches the default path)")
+        sys.exit(0)
+    print(f"\nResult: FAILURE ({args.variant} differs from the default path)")
+    sys.exit(1)
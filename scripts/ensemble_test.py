@@ -0,0 +1,43 @@
+import subprocess
+import os
+import re
+import sys
+import argparse
+
+def run(cmd):
+    print(f"Running: {' '.join(cmd)}")
+    result = subprocess.run(cmd, capture_output=True, text=True)
+    if result.returncode != 0:
+        print(f"Error: Simulation failed with return code {result.returncode}")
+        print(result.stdout)
+        print(result.stderr)
+        sys.exit(1)
+    return result.stdout
+
+if __name__ == "__main__":
+    parser = argparse.ArgumentParser(description="Check that ensemble members reproduce the standalone runs")
+    parser.add_argument("--exe", default="./miniWeather_mpi", help="Path to executable")
+    parser.add_argument("--np", type=int, default=2, help="MPI ranks per member")
+    parser.add_argument("--time", type=float, default=100.0)
+    args = parser.parse_args()
+
+    members = ["--data 2", "--data 3 --amp 0.5", "--data 2 --hv-beta 0.1 --amp 2"]
+    with open("ensemble_test.txt", "w") as f:
+        f.write("# One member per line\n" + "\n".join(members) + "\n")
+    out = run(["mpiexec", "-n", str(args.np * len(members)), args.exe,
+               "--ensemble", "ensemble_test.txt", "--time", str(args.time)])
+    os.remove("ensemble_test.txt")
+    rows = re.findall(r"^\s*(\d+)\s+\d+\s+\S+\s+\S+\s+(\S+)\s+(\S+)\s+\S+$", out, re.M)
+
+    ok = len(rows) == len(members)
+    for m, opts in enumerate(members):
+        alone = run(["mpiexec", "-n", str(args.np), args.exe, "--time", str(args.time)] + opts.split())
+        ref = (re.search(r"d_mass:\s*(\S+)", alone).group(1), re.search(r"d_te:\s*(\S+)", alone).group(1))
+        got = rows[m][1:] if m < len(rows) else None
+        print(f"member {m} ({opts}): ensemble {got}, standalone {ref}")
+        ok = ok and got == ref
+    if ok:
+        print("\nResult: SUCCESS (every member matches its standalone run)")
+        sys.exit(0)
+    print("\nResult: FAILURE (ensemble members differ from the standalone runs)")
+    sys.exit(1)
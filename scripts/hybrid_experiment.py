@@ -4,6 +4,7 @@ import re
 import matplotlib.pyplot as plt
 import numpy as np
 import os
+import sys
 
 # Configuration
 # Increase problem size to stress memory bandwidth
@@ -11,6 +12,8 @@ import os
 NX = 400
 NZ = 200
 TIME = 10.0 
+# Extra miniWeather_mpi options for every case, e.g. --shm-halo
+EXTRA = sys.argv[1:]
 
 def run_case(label, mpi_ranks, omp_threads):
     print(f"Running Case: {label} (MPI={mpi_ranks}, OMP={omp_threads})...")
@@ -20,7 +23,7 @@ def run_case(label, mpi_ranks, omp_threads):
     env["OMP_NUM_THREADS"] = str(omp_threads)
     
     cmd = ["mpirun", "-n", str(mpi_ranks), "./miniWeather_mpi", 
-           "--nx", str(NX), "--nz", str(NZ), "--time", str(TIME)]
+           "--nx", str(NX), "--nz", str(NZ), "--time", str(TIME)] + EXTRA
     
     result = subprocess.run(cmd, capture_output=True, text=True, env=env)
     
@@ -0,0 +1,45 @@
+import subprocess
+import os
+import sys
+import glob
+import shutil
+import argparse
+
+def run(cmd, cwd):
+    print(f"Running: {' '.join(cmd)}")
+    result = subprocess.run(cmd, capture_output=True, text=True, cwd=cwd)
+    if result.returncode != 0:
+        print(f"Error: Simulation failed with return code {result.returncode}")
+        print(result.stdout)
+        print(result.stderr)
+        sys.exit(1)
+
+if __name__ == "__main__":
+    parser = argparse.ArgumentParser(description="Check that the in-situ consumers give the same results on any process grid")
+    parser.add_argument("--exe", default="./miniWeather_mpi", help="Path to executable")
+    parser.add_argument("--time", type=float, default=100.0)
+    args = parser.parse_args()
+
+    exe = os.path.abspath(args.exe)
+    opts = ["--time", str(args.time), "--insitu", "stats,slice,image", "--insitu-every", "20"]
+    layouts = {"insitu_1": ["-n", "1", exe], "insitu_4": ["-n", "4", exe, "--pz", "2"]}
+    for d, launch in layouts.items():
+        shutil.rmtree(d, ignore_errors=True)
+        os.makedirs(d)
+        run(["mpiexec"] + launch + opts, d)
+
+    # Min/max, counts, copied cells and one-cell pixels do not depend on the
+    # order of the reductions, so the files must match byte for byte
+    names = sorted(os.path.basename(f) for f in glob.glob("insitu_1/*"))
+    ok = len(names) > 2 and names == sorted(os.path.basename(f) for f in glob.glob("insitu_4/*"))
+    for name in names:
+        same = open(f"insitu_1/{name}", "rb").read() == open(f"insitu_4/{name}", "rb").read()
+        print(f"{name}: {'same' if same else 'DIFFERENT'}")
+        ok = ok and same
+    for d in layouts:
+        shutil.rmtree(d)
+    if ok:
+        print("\nResult: SUCCESS (1 rank and a 2 x 2 process grid give identical in-situ results)")
+        sys.exit(0)
+    print("\nResult: FAILURE (in-situ results depend on the process grid)")
+    sys.exit(1)
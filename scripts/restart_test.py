@@ -0,0 +1,41 @@
+import subprocess
+import filecmp
+import os
+import sys
+import argparse
+
+def run(cmd):
+    print(f"Running: {' '.join(cmd)}")
+    result = subprocess.run(cmd, capture_output=True, text=True)
+    if result.returncode != 0:
+        print(f"Error: Simulation failed with return code {result.returncode}")
+        print(result.stdout)
+        print(result.stderr)
+        sys.exit(1)
+
+if __name__ == "__main__":
+    parser = argparse.ArgumentParser(description="Check that a restart from a checkpoint is bitwise reproducible")
+    parser.add_argument("--exe", default="./miniWeather_mpi", help="Path to executable")
+    parser.add_argument("--np", type=int, default=2, help="MPI ranks")
+    parser.add_argument("--time", type=float, default=110.0)
+    parser.add_argument("--every", type=float, default=50.0, help="Checkpoint interval (model seconds)")
+    parser.add_argument("--args", default="", help="Extra simulation options for every run")
+    args = parser.parse_args()
+
+    mpi = ["mpiexec", "-n", str(args.np), args.exe] + args.args.split()
+    every = ["--checkpoint-every", str(args.every)]
+    # Reference run straight through, checkpointing on the way
+    run(mpi + ["--time", str(args.time)] + every + ["--checkpoint-file", "restart_ref.chk"])
+    # Short run whose only checkpoint is the first one of the reference run
+    run(mpi + ["--time", str(args.every + 1)] + every + ["--checkpoint-file", "restart_mid.chk"])
+    # Resume from it and checkpoint at the same model time as the reference
+    run(mpi + ["--time", str(args.time), "--restart", "restart_mid.chk"] + every + ["--checkpoint-file", "restart_new.chk"])
+
+    same = filecmp.cmp("restart_ref.chk", "restart_new.chk", shallow=False)
+    for f in ["restart_ref.chk", "restart_mid.chk", "restart_new.chk"]:
+        os.remove(f)
+    if same:
+        print("\nResult: SUCCESS (restart is bitwise reproducible)")
+        sys.exit(0)
+    print("\nResult: FAILURE (restarted state differs from the reference run)")
+    sys.exit(1)
@@ -1,34 +1,51 @@
 import subprocess
+import json
+import os
 import re
 import sys
 
+# Phases reported by --timers, in table order
+PHASES = ["tendencies_x", "tendencies_z", "apply_tendencies", "halo_pack",
+          "halo_wait", "output", "reductions"]
+
 def run_experiment(ranks):
     print(f"Running with {ranks} MPI ranks...", file=sys.stderr)
-    cmd = ["mpiexec", "-n", str(ranks), "./miniWeather_mpi"]
+    timers = f"timers_{ranks}.json"
+    cmd = ["mpiexec", "-n", str(ranks), "./miniWeather_mpi", "--timers", timers]
     result = subprocess.run(cmd, capture_output=True, text=True, cwd=".")
     
     if result.returncode != 0:
         print(f"Error running with {ranks} ranks: {result.stderr}", file=sys.stderr)
-        return None
+        return None, None
+
+    # Per-phase max-over-ranks times from the timer report
+    phases = None
+    if os.path.exists(timers):
+        with open(timers) as f:
+            phases = json.load(f)["phases"]
+        os.remove(timers)
 
     # Parse CPU Time
     match = re.search(r"CPU Time:\s+([0-9.]+)\s+sec", result.stdout)
     if match:
-        return float(match.group(1))
+        return float(match.group(1)), phases
     else:
         print(f"Could not parse time from output: {result.stdout[:100]}...", file=sys.stderr)
-        return None
+        return None, None
 
 def main():
     print("| Ranks | Time (s) | Speedup | Efficiency |")
     print("|-------|----------|---------|------------|")
     
     base_time = None
+    breakdown = []
     
     for n in [1, 2, 3, 4]:
-        time = run_experiment(n)
+        time, phases = run_experiment(n)
         if time is None:
             continue
+        if phases is not None:
+            breakdown.append((n, phases))
             
         if n == 1:
             base_time = time
@@ -40,5 +57,18 @@ def main():
             
         print(f"| {n:5d} | {time:8.4f} | {speedup:7.2f} | {efficiency:9.1f}% |")
 
+    # Where the time goes: max over ranks of each phase, and its imbalance
+    if breakdown:
+        print()
+        print("| Ranks | " + " | ".join(PHASES) + " |")
+        print("|-------|" + "|".join("-" * (len(p) + 2) for p in PHASES) + "|")
+        for n, phases in breakdown:
+            cells = []
+            for p in PHASES:
+                t = phases[p]
+                imb = t["max"] / t["avg"] if t["avg"] > 0 else 1.0
+                cells.append(f"{t['max']:.3f} ({imb:.2f})".rjust(len(p)))
+            print(f"| {n:5d} | " + " | ".join(cells) + " |")
+
 if __name__ == "__main__":
     main()
@@ -3,10 +3,13 @@ import subprocess
 import re
 import sys
 import argparse
+import os
+import struct
+import math
 
-def run_simulation(exe_path, nx, nz, time):
+def run_simulation(exe_path, nx, nz, time, extra=[]):
     """Running simulation ensuring that physics is correct"""
-    cmd = [exe_path, "--nx", str(nx), "--nz", str(nz), "--time", str(time)]
+    cmd = [exe_path, "--nx", str(nx), "--nz", str(nz), "--time", str(time)] + extra
     print(f"Running: {' '.join(cmd)}")
     result = subprocess.run(cmd, capture_output=True, text=True)
     
@@ -30,6 +33,13 @@ def run_simulation(exe_path, nx, nz, time):
     
     return True, d_mass, d_te
 
+# (mass_tol, te_tol) for each storage precision. Float state rounds every
+# update, so mass is conserved only to float round-off accumulated over the run
+TOLERANCES = {
+    "fp64": (1e-13, 1e-4),
+    "fp32": (1e-9, 1e-4),
+}
+
 def validate(d_mass, d_te, mass_tol=1e-13, te_tol=1e-4):
     """Validation thresholds"""
     valid = True
@@ -51,18 +61,86 @@ def validate(d_mass, d_te, mass_tol=1e-13, te_tol=1e-4):
 
     return valid
 
+# Checkpoints are a 256-byte header followed by the doubles
+# [NUM_VARS][nz][nx] of the interior
+CHECKPOINT_HEADER = 256
+NUM_VARS = 4
+
+def read_state(path, nx, nz):
+    with open(path, "rb") as f:
+        f.seek(CHECKPOINT_HEADER)
+        data = f.read(8 * NUM_VARS * nz * nx)
+    os.remove(path)
+    n = nz * nx
+    values = struct.unpack(f"<{NUM_VARS * n}d", data)
+    return [values[v * n:(v + 1) * n] for v in range(NUM_VARS)]
+
+def compare_integrators(args, mass_tol, te_tol):
+    """Run --integrator and the reference one to the same model time on the
+    same time step and compare the final states, then run --integrator at its
+    own default Courant number. Every run must conserve mass and energy"""
+    # Only the last step reaches the interval, so the checkpoint is the final
+    # state of the run whatever the time step
+    every = ["--checkpoint-every", repr(args.time * (1 - 1e-9))]
+    runs = [(args.reference, ["--cfl", str(args.cfl)]),
+            (args.integrator, ["--cfl", str(args.cfl)]),
+            (args.integrator, [])]
+    states = []
+    valid = True
+    for name, cfl in runs:
+        chk = f"validate_{name}.chk"
+        success, d_mass, d_te = run_simulation(
+            args.exe, args.nx, args.nz, args.time,
+            ["--data", str(args.data), "--integrator", name] + cfl + every + ["--checkpoint-file", chk])
+        if not success or not os.path.exists(chk):
+            return False
+        valid = validate(d_mass, d_te, mass_tol, te_tol) and valid
+        states.append(read_state(chk, args.nx, args.nz))
+
+    # The relative L2 difference of each variable from the reference run. The
+    # splitting error is second order in dt whatever the scheme, so larger time
+    # steps differ by more: compare on a common short one
+    print(f"\nState difference from {args.reference} at --cfl {args.cfl}:")
+    for v, var in enumerate(["dens", "umom", "wmom", "rhot"]):
+        a, b = states[1][v], states[0][v]
+        norm = math.sqrt(sum(y * y for y in b))
+        diff = math.sqrt(sum((x - y) ** 2 for x, y in zip(a, b))) / max(norm, 1e-300)
+        ok = diff <= args.state_tol
+        print(f"{'✅ PASS' if ok else '❌ FAIL'}: {var} relative L2 difference {diff:.3e} (tolerance {args.state_tol})")
+        valid = valid and ok
+    return valid
+
 if __name__ == "__main__":
     parser = argparse.ArgumentParser(description="Validate miniWeather physics correctness")
     parser.add_argument("--exe", default="./miniWeather_serial", help="Path to executable")
     parser.add_argument("--nx", type=int, default=100)
     parser.add_argument("--nz", type=int, default=50)
     parser.add_argument("--time", type=float, default=10.0)
+    parser.add_argument("--precision", choices=sorted(TOLERANCES), default="fp64",
+                        help="Storage precision of the executable")
+    parser.add_argument("--integrator", help="Compare this --integrator of miniWeather_mpi with --reference")
+    parser.add_argument("--reference", default="rk3", help="Reference integrator (default: rk3)")
+    # The injection case (6) lets mass in through its inflow, so it cannot pass
+    # the conservation check
+    parser.add_argument("--data", type=int, choices=[1, 2, 3, 5], default=1,
+                        help="--data of the comparison runs (closed cases only)")
+    parser.add_argument("--cfl", type=float, default=0.5, help="Courant number of the state comparison")
+    parser.add_argument("--state-tol", type=float, default=2e-3,
+                        help="Relative L2 difference allowed from the reference state")
     args = parser.parse_args()
+    mass_tol, te_tol = TOLERANCES[args.precision]
+
+    if args.integrator:
+        if compare_integrators(args, mass_tol, te_tol):
+            print(f"\nResult: SUCCESS ({args.integrator} matches {args.reference})")
+            sys.exit(0)
+        print(f"\nResult: FAILURE ({args.integrator} departs from {args.reference})")
+        sys.exit(1)
 
     success, d_mass, d_te = run_simulation(args.exe, args.nx, args.nz, args.time)
     
     if success:
-        if validate(d_mass, d_te):
+        if validate(d_mass, d_te, mass_tol, te_tol):
             print("\nResult: SUCCESS (Physics Verified)")
             sys.exit(0)
         else:
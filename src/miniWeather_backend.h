@@ -0,0 +1,805 @@
+//////////////////////////////////////////////////////////////////////////////////////////
+// miniWeather backends
+// The loops of the time step, written once against a backend policy that
+// decides where and how they run:
+//   SerialBackend     plain loops on the calling thread
+//   ThreadsBackend    orphaned "omp for" loops, shared out over the team of the
+//                     enclosing parallel region (picked up from _OPENMP)
+//   AccBackend        OpenACC kernels on async queues (picked up from _OPENACC)
+//   OmpTargetBackend  OpenMP target kernels ordered by depend clauses, as
+//                     nowait target tasks (requested with -DMW_OMP_TARGET)
+// Dynamics<Backend, T> holds the flux, tendency, apply, halo and reduction
+// loops of the model on top of a policy; the driver picks one policy when it
+// is compiled (Backend, at the end of this file) and keeps the MPI calls.
+//
+// A policy provides
+//   for2(q, n0, n1, f)          f(i0, i1) over [0,n0) x [0,n1), then a barrier
+//   for2_nowait, for3(_nowait)  the same with no barrier, or over three loops.
+//                               The threads backend schedules all of them
+//                               statically, so a loop may skip the barrier
+//                               when the next one gives every thread the same
+//                               cells
+//   sum2(q, n0, n1, f, a, b)    f(i0, i1, a, b) adds to two sums
+//   max2(q, n0, n1, f)          f(i0, i1, m) raises a maximum
+//   enter, exit                 map an array onto the device and release it
+//   ptr(p)                      the device address of a mapped host array
+//   update_host, update_device  copy a mapped array between host and device
+//   wait(q), join(from, to)     the host, or queue to, waits for queue from
+//   wait_all()                  the host waits for every queue
+//   bind(rank, size, host)      pick this rank's device; -1 runs on the host
+// Queues order device work: the x halo runs on Q_HALO alongside the interior
+// fluxes on Q_MAIN. The host backends run everything in program order and
+// ignore them. sum2 and max2 give the calling thread's share of the result
+// (the whole of it except with ThreadsBackend); on a device they wait for q.
+// Pointers handed to Dynamics are device addresses (ptr) on a device backend
+//////////////////////////////////////////////////////////////////////////////////////////
+
+#ifndef MINIWEATHER_BACKEND_H
+#define MINIWEATHER_BACKEND_H
+
+#include <stddef.h>
+#ifdef _OPENACC
+#include <openacc.h>
+#endif
+#if defined(MW_OMP_TARGET)
+#include <omp.h>
+#endif
+
+#include "miniWeather_kernels.h"
+
+constexpr int Q_MAIN = 1; // Stencil, apply and z halo kernels
+constexpr int Q_HALO = 2; // x halo pack, transfers and unpack
+
+struct SerialBackend {
+  static constexpr bool device = false;
+  static constexpr const char *name = "serial";
+  template <class F> static void for2(int, int n0, int n1, F f) {
+    for (int i0 = 0; i0 < n0; i0++) {
+      for (int i1 = 0; i1 < n1; i1++) {
+        f(i0, i1);
+      }
+    }
+  }
+  template <class F> static void for2_nowait(int q, int n0, int n1, F f) {
+    for2(q, n0, n1, f);
+  }
+  template <class F> static void for3(int, int n0, int n1, int n2, F f) {
+    for (int i0 = 0; i0 < n0; i0++) {
+      for (int i1 = 0; i1 < n1; i1++) {
+        for (int i2 = 0; i2 < n2; i2++) {
+          f(i0, i1, i2);
+        }
+      }
+    }
+  }
+  template <class F>
+  static void for3_nowait(int q, int n0, int n1, int n2, F f) {
+    for3(q, n0, n1, n2, f);
+  }
+  template <class F>
+  static void sum2(int, int n0, int n1, F f, double &a, double &b) {
+    a = b = 0.;
+    for (int i0 = 0; i0 < n0; i0++) {
+      for (int i1 = 0; i1 < n1; i1++) {
+        f(i0, i1, a, b);
+      }
+    }
+  }
+  template <class F> static double max2(int, int n0, int n1, F f) {
+    double m = 0.;
+    for (int i0 = 0; i0 < n0; i0++) {
+      for (int i1 = 0; i1 < n1; i1++) {
+        f(i0, i1, m);
+      }
+    }
+    return m;
+  }
+  template <class T> static void enter(T *, size_t, bool) {}
+  template <class T> static void exit(T *, size_t) {}
+  template <class T> static T *ptr(T *p) { return p; }
+  template <class T> static void update_host(T *, size_t, int) {}
+  template <class T> static void update_device(T *, size_t, int) {}
+  static void wait(int) {}
+  static void join(int, int) {}
+  static void wait_all() {}
+  static int bind(int, int, int) { return -1; }
+};
+
+#ifdef _OPENMP
+// The host data hooks of SerialBackend, with the loops shared out over the
+// team. Outside a parallel region every loop runs on the calling thread
+struct ThreadsBackend : SerialBackend {
+  static constexpr const char *name = "omp-threads";
+  template <class F> static void for2(int, int n0, int n1, F f) {
+#pragma omp for collapse(2) schedule(static)
+    for (int i0 = 0; i0 < n0; i0++) {
+      for (int i1 = 0; i1 < n1; i1++) {
+        f(i0, i1);
+      }
+    }
+  }
+  template <class F> static void for2_nowait(int, int n0, int n1, F f) {
+#pragma omp for collapse(2) schedule(static) nowait
+    for (int i0 = 0; i0 < n0; i0++) {
+      for (int i1 = 0; i1 < n1; i1++) {
+        f(i0, i1);
+      }
+    }
+  }
+  template <class F> static void for3(int, int n0, int n1, int n2, F f) {
+#pragma omp for collapse(3) schedule(static)
+    for (int i0 = 0; i0 < n0; i0++) {
+      for (int i1 = 0; i1 < n1; i1++) {
+        for (int i2 = 0; i2 < n2; i2++) {
+          f(i0, i1, i2);
+        }
+      }
+    }
+  }
+  template <class F>
+  static void for3_nowait(int, int n0, int n1, int n2, F f) {
+#pragma omp for collapse(3) schedule(static) nowait
+    for (int i0 = 0; i0 < n0; i0++) {
+      for (int i1 = 0; i1 < n1; i1++) {
+        for (int i2 = 0; i2 < n2; i2++) {
+          f(i0, i1, i2);
+        }
+      }
+    }
+  }
+  // The sums of this thread's cells, in the order a single thread would add
+  // them, so the caller decides how the threads' shares are combined
+  template <class F>
+  static void sum2(int, int n0, int n1, F f, double &a, double &b) {
+    double sa = 0., sb = 0.;
+#pragma omp for collapse(2) schedule(static)
+    for (int i0 = 0; i0 < n0; i0++) {
+      for (int i1 = 0; i1 < n1; i1++) {
+        f(i0, i1, sa, sb);
+      }
+    }
+    a = sa;
+    b = sb;
+  }
+  template <class F> static double max2(int, int n0, int n1, F f) {
+    double m = 0.;
+#pragma omp for collapse(2) schedule(static)
+    for (int i0 = 0; i0 < n0; i0++) {
+      for (int i1 = 0; i1 < n1; i1++) {
+        f(i0, i1, m);
+      }
+    }
+    return m;
+  }
+};
+#endif
+
+#ifdef _OPENACC
+// Every kernel is queued on async(q); the lambda, which holds device
+// addresses only, travels as a firstprivate copy
+struct AccBackend {
+  static constexpr bool device = true;
+  static constexpr const char *name = "openacc";
+  template <class F> static void for2(int q, int n0, int n1, F f) {
+#pragma acc parallel loop gang vector collapse(2) firstprivate(f) async(q)
+    for (int i0 = 0; i0 < n0; i0++) {
+      for (int i1 = 0; i1 < n1; i1++) {
+        f(i0, i1);
+      }
+    }
+  }
+  template <class F> static void for2_nowait(int q, int n0, int n1, F f) {
+    for2(q, n0, n1, f);
+  }
+  template <class F> static void for3(int q, int n0, int n1, int n2, F f) {
+#pragma acc parallel loop gang vector collapse(3) firstprivate(f) async(q)
+    for (int i0 = 0; i0 < n0; i0++) {
+      for (int i1 = 0; i1 < n1; i1++) {
+        for (int i2 = 0; i2 < n2; i2++) {
+          f(i0, i1, i2);
+        }
+      }
+    }
+  }
+  template <class F>
+  static void for3_nowait(int q, int n0, int n1, int n2, F f) {
+    for3(q, n0, n1, n2, f);
+  }
+  template <class F>
+  static void sum2(int q, int n0, int n1, F f, double &a, double &b) {
+    double sa = 0., sb = 0.;
+#pragma acc parallel loop gang vector collapse(2) firstprivate(f) reduction(+ : sa, sb) async(q)
+    for (int i0 = 0; i0 < n0; i0++) {
+      for (int i1 = 0; i1 < n1; i1++) {
+        double ca = 0., cb = 0.;
+        f(i0, i1, ca, cb);
+        sa += ca;
+        sb += cb;
+      }
+    }
+#pragma acc wait(q)
+    a = sa;
+    b = sb;
+  }
+  template <class F> static double max2(int q, int n0, int n1, F f) {
+    double m = 0.;
+#pragma acc parallel loop gang vector collapse(2) firstprivate(f) reduction(max : m) async(q)
+    for (int i0 = 0; i0 < n0; i0++) {
+      for (int i1 = 0; i1 < n1; i1++) {
+        double c = 0.;
+        f(i0, i1, c);
+        m = fmax(m, c);
+      }
+    }
+#pragma acc wait(q)
+    return m;
+  }
+  template <class T> static void enter(T *p, size_t n, bool copy) {
+    if (copy) {
+#pragma acc enter data copyin(p[0:n])
+    } else {
+#pragma acc enter data create(p[0:n])
+    }
+  }
+  template <class T> static void exit(T *p, size_t n) {
+#pragma acc exit data delete(p[0:n])
+  }
+  template <class T> static T *ptr(T *p) {
+    return p ? static_cast<T *>(acc_deviceptr((void *)p)) : p;
+  }
+  template <class T> static void update_host(T *p, size_t n, int q) {
+#pragma acc update self(p[0:n]) async(q)
+  }
+  template <class T> static void update_device(T *p, size_t n, int q) {
+#pragma acc update device(p[0:n]) async(q)
+  }
+  static void wait(int q) {
+#pragma acc wait(q)
+  }
+  static void join(int from, int to) {
+#pragma acc wait(from) async(to)
+  }
+  static void wait_all() {
+#pragma acc wait
+  }
+  // acc_device_host needs a binary that also holds host versions of the
+  // compute regions
+  static int bind(int local_rank, int local_size, int host_ranks) {
+    const int ndev = acc_get_num_devices(acc_device_not_host);
+    if (ndev == 0 || local_rank >= local_size - host_ranks) {
+      acc_set_device_type(acc_device_host);
+      return -1;
+    }
+    acc_set_device_num(local_rank % ndev, acc_device_not_host);
+    return local_rank % ndev;
+  }
+};
+#endif
+
+#if defined(MW_OMP_TARGET)
+// Each queue is a dependence object: kernels are nowait target tasks that
+// depend(inout) on theirs, so those on one queue run in order and the two
+// queues overlap until joined
+static int omp_queue[3];
+// GCC (as of 12) fails with an internal error on any data clause naming a
+// lambda, so there a kernel leaves f implicitly mapped and, since a deferred
+// task could outlive it, runs synchronously after the earlier work of q
+#if defined(__GNUC__) && !defined(__clang__) && !defined(__NVCOMPILER)
+#define MW_OMP_LAMBDA_CLAUSES 0
+#else
+#define MW_OMP_LAMBDA_CLAUSES 1
+#endif
+struct OmpTargetBackend {
+  static constexpr bool device = true;
+  static constexpr const char *name = "omp-target";
+  template <class F> static void for2(int q, int n0, int n1, F f) {
+#if MW_OMP_LAMBDA_CLAUSES
+#pragma omp target teams distribute parallel for collapse(2) firstprivate(f) depend(inout : omp_queue[q]) nowait
+#else
+#pragma omp target teams distribute parallel for collapse(2) depend(inout : omp_queue[q])
+#endif
+    for (int i0 = 0; i0 < n0; i0++) {
+      for (int i1 = 0; i1 < n1; i1++) {
+        f(i0, i1);
+      }
+    }
+  }
+  template <class F> static void for2_nowait(int q, int n0, int n1, F f) {
+    for2(q, n0, n1, f);
+  }
+  template <class F> static void for3(int q, int n0, int n1, int n2, F f) {
+#if MW_OMP_LAMBDA_CLAUSES
+#pragma omp target teams distribute parallel for collapse(3) firstprivate(f) depend(inout : omp_queue[q]) nowait
+#else
+#pragma omp target teams distribute parallel for collapse(3) depend(inout : omp_queue[q])
+#endif
+    for (int i0 = 0; i0 < n0; i0++) {
+      for (int i1 = 0; i1 < n1; i1++) {
+        for (int i2 = 0; i2 < n2; i2++) {
+          f(i0, i1, i2);
+        }
+      }
+    }
+  }
+  template <class F>
+  static void for3_nowait(int q, int n0, int n1, int n2, F f) {
+    for3(q, n0, n1, n2, f);
+  }
+  // Without nowait the host waits for the reduction, and through its
+  // dependence for the earlier kernels of q
+  template <class F>
+  static void sum2(int q, int n0, int n1, F f, double &a, double &b) {
+    double sa = 0., sb = 0.;
+#if MW_OMP_LAMBDA_CLAUSES
+#pragma omp target teams distribute parallel for collapse(2) firstprivate(f) reduction(+ : sa, sb) map(tofrom : sa, sb) depend(inout : omp_queue[q])
+#else
+#pragma omp target teams distribute parallel for collapse(2) reduction(+ : sa, sb) map(tofrom : sa, sb) depend(inout : omp_queue[q])
+#endif
+    for (int i0 = 0; i0 < n0; i0++) {
+      for (int i1 = 0; i1 < n1; i1++) {
+        double ca = 0., cb = 0.;
+        f(i0, i1, ca, cb);
+        sa += ca;
+        sb += cb;
+      }
+    }
+    a = sa;
+    b = sb;
+  }
+  template <class F> static double max2(int q, int n0, int n1, F f) {
+    double m = 0.;
+#if MW_OMP_LAMBDA_CLAUSES
+#pragma omp target teams distribute parallel for collapse(2) firstprivate(f) reduction(max : m) map(tofrom : m) depend(inout : omp_queue[q])
+#else
+#pragma omp target teams distribute parallel for collapse(2) reduction(max : m) map(tofrom : m) depend(inout : omp_queue[q])
+#endif
+    for (int i0 = 0; i0 < n0; i0++) {
+      for (int i1 = 0; i1 < n1; i1++) {
+        double c = 0.;
+        f(i0, i1, c);
+        m = fmax(m, c);
+      }
+    }
+    return m;
+  }
+  template <class T> static void enter(T *p, size_t n, bool copy) {
+    if (copy) {
+#pragma omp target enter data map(to : p[0:n])
+    } else {
+#pragma omp target enter data map(alloc : p[0:n])
+    }
+  }
+  template <class T> static void exit(T *p, size_t n) {
+#pragma omp target exit data map(delete : p[0:n])
+  }
+  template <class T> static T *ptr(T *p) {
+    T *d = p;
+#pragma omp target data use_device_ptr(d) if (p != nullptr)
+    { p = d; }
+    return p;
+  }
+  template <class T> static void update_host(T *p, size_t n, int q) {
+#pragma omp target update from(p[0:n]) depend(inout : omp_queue[q]) nowait
+  }
+  template <class T> static void update_device(T *p, size_t n, int q) {
+#pragma omp target update to(p[0:n]) depend(inout : omp_queue[q]) nowait
+  }
+  // An undeferred task waits for its dependences, so this blocks on q only
+  static void wait(int q) {
+#pragma omp task depend(inout : omp_queue[q]) if (0)
+    {
+    }
+  }
+  static void join(int from, int to) {
+#pragma omp task depend(in : omp_queue[from]) depend(inout : omp_queue[to])
+    {
+    }
+  }
+  static void wait_all() {
+#pragma omp taskwait
+  }
+  // The target regions of a host rank execute on the initial device
+  static int bind(int local_rank, int local_size, int host_ranks) {
+    const int ndev = omp_get_num_devices();
+    if (ndev == 0 || local_rank >= local_size - host_ranks) {
+      omp_set_default_device(omp_get_initial_device());
+      return -1;
+    }
+    omp_set_default_device(local_rank % ndev);
+    return local_rank % ndev;
+  }
+};
+#endif
+
+// Member functions called inside the kernels. nvc++ takes "acc routine" on
+// them; GCC allows it at file scope only, and compiles the functions an
+// offloaded region calls for the device on its own
+#if defined(_OPENACC) && defined(__NVCOMPILER)
+#define MW_METHOD _Pragma("acc routine seq")
+#else
+#define MW_METHOD
+#endif
+
+#if defined(MW_OMP_TARGET)
+#pragma omp declare target
+#endif
+
+// Shape of one rank's block. The state is [NUM_VARS][nz + 2 * hs][pitch] with
+// hx halo columns on each side of the nx interior ones; flux and tend are
+// [NUM_VARS][nz + 1][nx + 1] and [NUM_VARS][nz][nx]. k and i count interior
+// cells from 0, so halo cells have negative indices or ones past nz and nx
+struct Grid {
+  int nx, nz, hx, pitch, plane;
+  double dx, dz;
+  MW_METHOD int s(int ll, int k, int i) const {
+    return ll * plane + (k + hs) * pitch + i + hx;
+  }
+  MW_METHOD int f(int ll, int k, int i) const {
+    return ll * (nz + 1) * (nx + 1) + k * (nx + 1) + i;
+  }
+  MW_METHOD int t(int ll, int k, int i) const {
+    return ll * nz * nx + k * nx + i;
+  }
+};
+
+// Where the x halo columns of one side come from: column s of row k of
+// variable ll is p[ll * plane + k * pitch + off + s]. A receive buffer is
+// {buf, nz * hx, hx, 0}; null p leaves that side alone
+template <class T> struct HaloColumns {
+  const T *p;
+  int plane, pitch, off;
+};
+
+template <class Backend, class T> struct Dynamics {
+  // x-direction flux vector f (including hyperviscosity) at interface i of
+  // interior row k, from a fourth-order interpolation of the four cell
+  // averages straddling it
+  MW_METHOD static void interface_flux_x(const Grid &g, const T *state,
+                                          const double *hy_r,
+                                          const double *hy_t, int k, int i,
+                                          double hv_coef, double *f,
+                                          double *speed) {
+    double d3_vals[NUM_VARS], vals[NUM_VARS];
+    for (int ll = 0; ll < NUM_VARS; ll++) {
+      reconstruct(&state[g.s(ll, k, i - hs)], 1, vals[ll], d3_vals[ll]);
+    }
+    flux_x(vals, d3_vals, hy_r[k + hs], hy_t[k + hs], hv_coef, f, speed);
+  }
+
+  // z-direction flux vector f at interface k of interior column i; wall marks
+  // the interfaces on the physical top and bottom
+  MW_METHOD static void interface_flux_z(const Grid &g, const T *state,
+                                          const double *hy_r,
+                                          const double *hy_t,
+                                          const double *hy_p, int k, int i,
+                                          double hv_coef, bool wall,
+                                          double *f, double *speed) {
+    double d3_vals[NUM_VARS], vals[NUM_VARS];
+    for (int ll = 0; ll < NUM_VARS; ll++) {
+      reconstruct(&state[g.s(ll, k - hs, i)], g.pitch, vals[ll],
+                  d3_vals[ll]);
+    }
+    flux_z(vals, d3_vals, hy_r[k], hy_t[k], hy_p[k], hv_coef, wall, f, speed);
+  }
+
+  // Add the mass and total energy of interior cell (k, i) to mass and te,
+  // with the temperature from a single pow: T = theta (p / p0)^(rd / cp) =
+  // t_coef (rho theta)^(rd / cv) / rho, t_coef = (C0 / p0)^(rd / cp)
+  MW_METHOD static void cell_mass_energy(const Grid &g, const T *state,
+                                          const double *hy_r,
+                                          const double *hy_t, double t_coef,
+                                          int k, int i, double &mass,
+                                          double &te) {
+    double r = state[g.s(ID_DENS, k, i)] + hy_r[hs + k];
+    double u = state[g.s(ID_UMOM, k, i)] / r;
+    double w = state[g.s(ID_WMOM, k, i)] / r;
+    double rt = state[g.s(ID_RHOT, k, i)] + hy_t[hs + k];
+    double t = rt / r * t_coef * pow(rt, rd / cv);
+    mass += r * g.dx * g.dz;
+    te += (r * (u * u + w * w) + r * cv * t) * g.dx * g.dz;
+  }
+
+  // x fluxes at interfaces i_lo..i_hi (inclusive) of every row. With track,
+  // returns the fastest signal speed |u| + c seen, else 0
+  static double fluxes_x(const Grid &g, int q, const T *state, T *flux,
+                         const double *hy_r, const double *hy_t,
+                         double hv_coef, int i_lo, int i_hi, bool track) {
+    const int ni = i_hi - i_lo + 1;
+    if (ni <= 0) {
+      return 0.;
+    }
+    if (track) {
+      return Backend::max2(q, g.nz, ni, [=](int k, int c, double &speed) {
+        double f[NUM_VARS];
+        interface_flux_x(g, state, hy_r, hy_t, k, i_lo + c, hv_coef, f,
+                         &speed);
+        for (int ll = 0; ll < NUM_VARS; ll++) {
+          flux[g.f(ll, k, i_lo + c)] = f[ll];
+        }
+      });
+    }
+    Backend::for2(q, g.nz, ni, [=](int k, int c) {
+      double f[NUM_VARS];
+      interface_flux_x(g, state, hy_r, hy_t, k, i_lo + c, hv_coef, f,
+                       nullptr);
+      for (int ll = 0; ll < NUM_VARS; ll++) {
+        flux[g.f(ll, k, i_lo + c)] = f[ll];
+      }
+    });
+    return 0.;
+  }
+
+  // x tendencies of every cell from its two interface fluxes. No barrier: the
+  // apply loop that follows gives each thread the same cells
+  static void tendencies_x(const Grid &g, int q, const T *flux, T *tend) {
+    Backend::for2_nowait(q, g.nz, g.nx, [=](int k, int i) {
+      for (int ll = 0; ll < NUM_VARS; ll++) {
+        tend[g.t(ll, k, i)] =
+            -(flux[g.f(ll, k, i + 1)] - flux[g.f(ll, k, i)]) / g.dx;
+      }
+    });
+  }
+
+  // z fluxes at all nz + 1 interfaces of every column; wall_bottom and
+  // wall_top tell whether interfaces 0 and nz are the model bottom and top
+  static double fluxes_z(const Grid &g, int q, const T *state, T *flux,
+                         const double *hy_r, const double *hy_t,
+                         const double *hy_p, double hv_coef, bool wall_bottom,
+                         bool wall_top, bool track) {
+    auto wall = [=](int k) {
+      return (k == 0 && wall_bottom) || (k == g.nz && wall_top);
+    };
+    if (track) {
+      return Backend::max2(q, g.nz + 1, g.nx, [=](int k, int i,
+                                                  double &speed) {
+        double f[NUM_VARS];
+        interface_flux_z(g, state, hy_r, hy_t, hy_p, k, i, hv_coef, wall(k),
+                         f, &speed);
+        for (int ll = 0; ll < NUM_VARS; ll++) {
+          flux[g.f(ll, k, i)] = f[ll];
+        }
+      });
+    }
+    Backend::for2(q, g.nz + 1, g.nx, [=](int k, int i) {
+      double f[NUM_VARS];
+      interface_flux_z(g, state, hy_r, hy_t, hy_p, k, i, hv_coef, wall(k), f,
+                       nullptr);
+      for (int ll = 0; ll < NUM_VARS; ll++) {
+        flux[g.f(ll, k, i)] = f[ll];
+      }
+    });
+    return 0.;
+  }
+
+  // z tendencies of every cell, with gravity acting on the vertical momentum
+  static void tendencies_z(const Grid &g, int q, const T *state,
+                           const T *flux, T *tend) {
+    Backend::for2_nowait(q, g.nz, g.nx, [=](int k, int i) {
+      for (int ll = 0; ll < NUM_VARS; ll++) {
+        tend[g.t(ll, k, i)] =
+            -(flux[g.f(ll, k + 1, i)] - flux[g.f(ll, k, i)]) / g.dz;
+        if (ll == ID_WMOM) {
+          tend[g.t(ll, k, i)] =
+              tend[g.t(ll, k, i)] - state[g.s(ID_DENS, k, i)] * grav;
+        }
+      }
+    });
+  }
+
+  // out = init + dt * (tend + src) on every cell (without src if null)
+  static void apply(const Grid &g, int q, const T *init, const T *tend,
+                    const T *src, T *out, double dt) {
+    if (src) {
+      Backend::for2(q, g.nz, g.nx, [=](int k, int i) {
+        for (int ll = 0; ll < NUM_VARS; ll++) {
+          out[g.s(ll, k, i)] = init[g.s(ll, k, i)] +
+                               dt * (tend[g.t(ll, k, i)] + src[g.t(ll, k, i)]);
+        }
+      });
+    } else {
+      Backend::for2(q, g.nz, g.nx, [=](int k, int i) {
+        for (int ll = 0; ll < NUM_VARS; ll++) {
+          out[g.s(ll, k, i)] = init[g.s(ll, k, i)] + dt * tend[g.t(ll, k, i)];
+        }
+      });
+    }
+  }
+
+  // apply, also summing the mass and energy of the updated cells
+  static void apply_diagnosed(const Grid &g, int q, const T *init,
+                              const T *tend, const T *src, T *out, double dt,
+                              const double *hy_r, const double *hy_t,
+                              double &mass, double &te) {
+    const double t_coef = pow(C0 / p0, rd / cp);
+    Backend::sum2(
+        q, g.nz, g.nx,
+        [=](int k, int i, double &m, double &e) {
+          for (int ll = 0; ll < NUM_VARS; ll++) {
+            out[g.s(ll, k, i)] =
+                src ? init[g.s(ll, k, i)] +
+                          dt * (tend[g.t(ll, k, i)] + src[g.t(ll, k, i)])
+                    : init[g.s(ll, k, i)] + dt * tend[g.t(ll, k, i)];
+          }
+          cell_mass_energy(g, out, hy_r, hy_t, t_coef, k, i, m, e);
+        },
+        mass, te);
+  }
+
+  // Mass and total energy of the interior cells, as the reference formula
+  // with the pressure and temperature spelt out
+  static void mass_energy(const Grid &g, int q, const T *state,
+                          const double *hy_r, const double *hy_t,
+                          double &mass, double &te) {
+    Backend::sum2(
+        q, g.nz, g.nx,
+        [=](int k, int i, double &m, double &e) {
+          double r = state[g.s(ID_DENS, k, i)] + hy_r[hs + k]; // Density
+          double u = state[g.s(ID_UMOM, k, i)] / r;            // U-wind
+          double w = state[g.s(ID_WMOM, k, i)] / r;            // W-wind
+          double th = (state[g.s(ID_RHOT, k, i)] + hy_t[hs + k]) /
+                      r;                        // Potential Temperature
+          double p = C0 * pow(r * th, gamm);    // Pressure
+          double t = th / pow(p0 / p, rd / cp); // Temperature
+          double ke = r * (u * u + w * w);      // Kinetic Energy
+          double ie = r * cv * t;               // Internal Energy
+          m += r * g.dx * g.dz;                 // Accumulate domain mass
+          e += (ke + ie) * g.dx * g.dz; // Accumulate domain total energy
+        },
+        mass, te);
+  }
+
+  // The cheaper cell_mass_energy sums of a diagnosed step, over state
+  static void diagnose(const Grid &g, int q, const T *state,
+                       const double *hy_r, const double *hy_t, double &mass,
+                       double &te) {
+    const double t_coef = pow(C0 / p0, rd / cp);
+    Backend::sum2(
+        q, g.nz, g.nx,
+        [=](int k, int i, double &m, double &e) {
+          cell_mass_energy(g, state, hy_r, hy_t, t_coef, k, i, m, e);
+        },
+        mass, te);
+  }
+
+  // Periodic x halos of a single process column, copied from the opposite
+  // edge of the block
+  static void periodic_x(const Grid &g, int q, T *state) {
+    Backend::for3(q, NUM_VARS, g.nz, g.hx, [=](int ll, int k, int s) {
+      state[g.s(ll, k, s - g.hx)] = state[g.s(ll, k, g.nx - g.hx + s)];
+      state[g.s(ll, k, g.nx + s)] = state[g.s(ll, k, s)];
+    });
+  }
+
+  // Pack the hx edge columns into the [NUM_VARS][nz][hx] send buffers of the
+  // left and right neighbours (null: not messaged)
+  static void pack_x(const Grid &g, int q, const T *state, T *send_l,
+                     T *send_r) {
+    Backend::for3(q, NUM_VARS, g.nz, g.hx, [=](int ll, int k, int s) {
+      const int b = ll * g.nz * g.hx + k * g.hx + s;
+      if (send_l) {
+        send_l[b] = state[g.s(ll, k, s)];
+      }
+      if (send_r) {
+        send_r[b] = state[g.s(ll, k, g.nx - g.hx + s)];
+      }
+    });
+  }
+
+  // Fill the left and right x halos from a receive buffer or, through a
+  // shared window, straight from a neighbour's edge columns
+  static void unpack_x(const Grid &g, int q, T *state, HaloColumns<T> l,
+                       HaloColumns<T> r) {
+    Backend::for3(q, NUM_VARS, g.nz, g.hx, [=](int ll, int k, int s) {
+      if (l.p) {
+        state[g.s(ll, k, s - g.hx)] =
+            l.p[ll * l.plane + k * l.pitch + l.off + s];
+      }
+      if (r.p) {
+        state[g.s(ll, k, g.nx + s)] =
+            r.p[ll * r.plane + k * r.pitch + r.off + s];
+      }
+    });
+  }
+
+  // The injection inflow in the hs left halo columns of the first process
+  // column: a jet over the rows within zlen / 16 of 3 / 4 of the height
+  static void inflow_x(const Grid &g, int q, T *state, const double *hy_r,
+                       const double *hy_t, int k_beg) {
+    Backend::for2(q, g.nz, hs, [=](int k, int c) {
+      const double z = (k_beg + k + 0.5) * g.dz;
+      if (fabs(z - 3 * zlen / 4) <= zlen / 16) {
+        const int i = c - g.hx;
+        state[g.s(ID_UMOM, k, i)] =
+            (state[g.s(ID_DENS, k, i)] + hy_r[k + hs]) * 50.;
+        state[g.s(ID_RHOT, k, i)] =
+            (state[g.s(ID_DENS, k, i)] + hy_r[k + hs]) * 298. - hy_t[k + hs];
+      }
+    });
+  }
+
+  // Pack the bottom and top hs interior rows (interior columns only, the
+  // z-direction stencil never reads the x halos) into [NUM_VARS][hs][nx]
+  static void pack_z(const Grid &g, int q, const T *state, T *send_b,
+                     T *send_t) {
+    Backend::for3(q, NUM_VARS, hs, g.nx, [=](int ll, int k, int i) {
+      send_b[ll * hs * g.nx + k * g.nx + i] = state[g.s(ll, k, i)];
+      send_t[ll * hs * g.nx + k * g.nx + i] =
+          state[g.s(ll, g.nz - hs + k, i)];
+    });
+  }
+
+  // Unpack the rows received from below and above (null: a physical
+  // boundary). walls_z only writes the halo rows of the edge ranks, which are
+  // never unpacked, and reads interior rows, so it can follow without a
+  // barrier
+  static void unpack_z(const Grid &g, int q, T *state, const T *recv_b,
+                       const T *recv_t) {
+    Backend::for3_nowait(q, NUM_VARS, hs, g.nx, [=](int ll, int k, int i) {
+      if (recv_b) {
+        state[g.s(ll, k - hs, i)] = recv_b[ll * hs * g.nx + k * g.nx + i];
+      }
+      if (recv_t) {
+        state[g.s(ll, g.nz + k, i)] = recv_t[ll * hs * g.nx + k * g.nx + i];
+      }
+    });
+  }
+
+  // Wall conditions in the z halos at the model bottom and top, on all
+  // columns including the x halos
+  static void walls_z(const Grid &g, int q, T *state, const double *hy_r,
+                      bool bottom, bool top) {
+    Backend::for2(q, NUM_VARS, g.nx + 2 * g.hx, [=](int ll, int c) {
+      const int i = c - g.hx;
+      const int nz = g.nz;
+      if (ll == ID_WMOM) {
+        if (bottom) {
+          state[g.s(ll, -2, i)] = 0.;
+          state[g.s(ll, -1, i)] = 0.;
+        }
+        if (top) {
+          state[g.s(ll, nz, i)] = 0.;
+          state[g.s(ll, nz + 1, i)] = 0.;
+        }
+      } else if (ll == ID_UMOM) {
+        if (bottom) {
+          state[g.s(ll, -2, i)] =
+              state[g.s(ll, 0, i)] / hy_r[hs] * hy_r[0];
+          state[g.s(ll, -1, i)] =
+              state[g.s(ll, 0, i)] / hy_r[hs] * hy_r[1];
+        }
+        if (top) {
+          state[g.s(ll, nz, i)] = state[g.s(ll, nz - 1, i)] /
+                                  hy_r[nz + hs - 1] * hy_r[nz + hs];
+          state[g.s(ll, nz + 1, i)] = state[g.s(ll, nz - 1, i)] /
+                                      hy_r[nz + hs - 1] * hy_r[nz + hs + 1];
+        }
+      } else {
+        if (bottom) {
+          state[g.s(ll, -2, i)] = state[g.s(ll, 0, i)];
+          state[g.s(ll, -1, i)] = state[g.s(ll, 0, i)];
+        }
+        if (top) {
+          state[g.s(ll, nz, i)] = state[g.s(ll, nz - 1, i)];
+          state[g.s(ll, nz + 1, i)] = state[g.s(ll, nz - 1, i)];
+        }
+      }
+    });
+  }
+};
+
+#if defined(MW_OMP_TARGET)
+#pragma omp end declare target
+#endif
+
+// The backend of this build
+#if defined(_OPENACC)
+typedef AccBackend Backend;
+#elif defined(MW_OMP_TARGET)
+typedef OmpTargetBackend Backend;
+#elif defined(_OPENMP)
+typedef ThreadsBackend Backend;
+#else
+typedef SerialBackend Backend;
+#endif
+
+#endif
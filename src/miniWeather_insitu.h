@@ -0,0 +1,354 @@
+//////////////////////////////////////////////////////////////////////////////////////////
+// miniWeather in-situ analysis
+// Consumers that look at the model state while it runs, in place of writing
+// frames to output.nc and post-processing them. Every insitu_every-th step
+// MiniWeatherSimulation::Run() hands each registered consumer an InSituView: a
+// read-only view of the rank's own state array and hydrostatic background, with
+// no copy made. Consumers are called by every rank of the run (or ensemble
+// member) outside the time step's parallel region, so they may use OpenMP and
+// collectives on view.comm.
+//
+// Built in (--insitu stats,slice,image):
+//   InSituStats  min/max of dens, uwnd, wwnd, theta and a histogram of one
+//   InSituSlice  one global row (z=K) or column (x=I) of a field
+//   InSituImage  a PNG of a field, gathered on the root at reduced resolution
+// Other consumers derive from InSituConsumer and are registered with
+// MiniWeatherSimulation::add_insitu().
+//
+// Included by miniWeather_mpi.cpp once the storage type real is defined
+//////////////////////////////////////////////////////////////////////////////////////////
+
+#ifndef MINIWEATHER_INSITU_H
+#define MINIWEATHER_INSITU_H
+
+#include <algorithm>
+#include <cstdint>
+#include <math.h>
+#include <mpi.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+#include <vector>
+
+#include "miniWeather_kernels.h"
+
+// Derived fields a consumer can ask an InSituView for, as in output.nc
+constexpr int NUM_INSITU_FIELDS = 4;
+constexpr const char *insitu_field_names[NUM_INSITU_FIELDS] = {
+    "dens", "uwnd", "wwnd", "theta"};
+
+// This rank's part of the model at one step. k and i index the interior cells
+// (0 <= k < nz, 0 <= i < nx); the halos of state are not current
+struct InSituView {
+  const real *state; // [NUM_VARS][nz + 2 * hs][pitch], halos included
+  const double *hy_dens_cell, *hy_dens_theta_cell; // nz + 2 * hs, with halos
+  int nx, nz, pitch, plane;
+  int hx; // Width of the x halos: hs, or hs per RK stage with --deep-halo
+  int i_beg, k_beg, nx_glob, nz_glob;
+  double dx, dz, etime;
+  long step;
+  MPI_Comm comm; // The ranks of this run or ensemble member
+  int rank;      // In comm; rank 0 writes the results
+
+  real q(int ll, int k, int i) const {
+    return state[ll * plane + (k + hs) * pitch + i + hx];
+  }
+  // Density perturbation, winds and potential temperature perturbation
+  double field(int v, int k, int i) const {
+    double r = q(ID_DENS, k, i), hr = hy_dens_cell[k + hs];
+    double ht = hy_dens_theta_cell[k + hs];
+    switch (v) {
+    case 0:
+      return r;
+    case 1:
+      return q(ID_UMOM, k, i) / (hr + r);
+    case 2:
+      return q(ID_WMOM, k, i) / (hr + r);
+    default:
+      return (q(ID_RHOT, k, i) + ht) / (hr + r) - ht / hr;
+    }
+  }
+};
+
+class InSituConsumer {
+public:
+  virtual ~InSituConsumer() {}
+  virtual void process(const InSituView &view) = 0;
+};
+
+// Opens a consumer's CSV log on rank 0, appending when a restart continues a
+// run, and writes the header line to a new one
+inline FILE *insitu_open_log(const std::string &path, bool append,
+                             const std::string &header) {
+  FILE *f = fopen(path.c_str(), append ? "a" : "w");
+  if (!f) {
+    printf("Error: cannot write %s\n", path.c_str());
+    MPI_Abort(MPI_COMM_WORLD, -1);
+  }
+  if (!append) {
+    fprintf(f, "%s\n", header.c_str());
+  }
+  return f;
+}
+
+// One line per call: step, time, the global min and max of every field, and
+// the counts of bins equal-width bins of field var between its min and max
+class InSituStats : public InSituConsumer {
+public:
+  InSituStats(const std::string &path, bool append, int var, int bins)
+      : path(path), append(append), var(var), bins(bins) {}
+  ~InSituStats() {
+    if (log) {
+      fclose(log);
+    }
+  }
+
+  void process(const InSituView &v) override {
+    // Minima and negated maxima, so one MPI_MIN reduction finds both
+    double ext[2 * NUM_INSITU_FIELDS], glob[2 * NUM_INSITU_FIELDS];
+    std::fill(ext, ext + 2 * NUM_INSITU_FIELDS, HUGE_VAL);
+#pragma omp parallel for collapse(2) reduction(min : ext[:2 * NUM_INSITU_FIELDS])
+    for (int k = 0; k < v.nz; k++) {
+      for (int i = 0; i < v.nx; i++) {
+        for (int f = 0; f < NUM_INSITU_FIELDS; f++) {
+          double x = v.field(f, k, i);
+          ext[2 * f] = std::min(ext[2 * f], x);
+          ext[2 * f + 1] = std::min(ext[2 * f + 1], -x);
+        }
+      }
+    }
+    MPI_Allreduce(ext, glob, 2 * NUM_INSITU_FIELDS, MPI_DOUBLE, MPI_MIN,
+                  v.comm);
+
+    double lo = glob[2 * var], hi = -glob[2 * var + 1];
+    double scale = hi > lo ? bins / (hi - lo) : 0.;
+    std::vector<long> count(bins, 0), total(bins, 0);
+    long *c = count.data();
+    int nb = bins;
+#pragma omp parallel for collapse(2) reduction(+ : c[:nb])
+    for (int k = 0; k < v.nz; k++) {
+      for (int i = 0; i < v.nx; i++) {
+        int b = (int)((v.field(var, k, i) - lo) * scale);
+        c[std::min(std::max(b, 0), nb - 1)]++;
+      }
+    }
+    MPI_Reduce(c, total.data(), bins, MPI_LONG, MPI_SUM, 0, v.comm);
+
+    if (v.rank == 0) {
+      if (!log) {
+        std::string header = "step,t";
+        for (int f = 0; f < NUM_INSITU_FIELDS; f++) {
+          header += std::string(",") + insitu_field_names[f] + "_min," +
+                    insitu_field_names[f] + "_max";
+        }
+        for (int b = 0; b < bins; b++) {
+          header += "," + std::string(insitu_field_names[var]) + "_bin" +
+                    std::to_string(b);
+        }
+        log = insitu_open_log(path, append, header);
+      }
+      fprintf(log, "%ld,%.6lf", v.step, v.etime);
+      for (int f = 0; f < NUM_INSITU_FIELDS; f++) {
+        fprintf(log, ",%.10le,%.10le", glob[2 * f], -glob[2 * f + 1]);
+      }
+      for (int b = 0; b < bins; b++) {
+        fprintf(log, ",%ld", total[b]);
+      }
+      fprintf(log, "\n");
+      fflush(log);
+    }
+  }
+
+private:
+  std::string path;
+  bool append;
+  int var, bins;
+  FILE *log = nullptr;
+};
+
+// One line per call: step, time and field var along global row z=at (dir
+// 'z') or column x=at (dir 'x'). Each rank fills the cells it owns of an
+// otherwise zero line and the lines are summed on rank 0
+class InSituSlice : public InSituConsumer {
+public:
+  InSituSlice(const std::string &path, bool append, int var, char dir, int at)
+      : path(path), append(append), var(var), dir(dir), at(at) {}
+  ~InSituSlice() {
+    if (log) {
+      fclose(log);
+    }
+  }
+
+  void process(const InSituView &v) override {
+    int n = dir == 'z' ? v.nx_glob : v.nz_glob;
+    std::vector<double> line(n, 0.), glob(n);
+    if (dir == 'z' && at >= v.k_beg && at < v.k_beg + v.nz) {
+      for (int i = 0; i < v.nx; i++) {
+        line[v.i_beg + i] = v.field(var, at - v.k_beg, i);
+      }
+    } else if (dir == 'x' && at >= v.i_beg && at < v.i_beg + v.nx) {
+      for (int k = 0; k < v.nz; k++) {
+        line[v.k_beg + k] = v.field(var, k, at - v.i_beg);
+      }
+    }
+    MPI_Reduce(line.data(), glob.data(), n, MPI_DOUBLE, MPI_SUM, 0, v.comm);
+
+    if (v.rank == 0) {
+      if (!log) {
+        // theta_x0, theta_x1, ... along row z=at; theta_z0, ... up column x=at
+        std::string header = "step,t";
+        for (int j = 0; j < n; j++) {
+          header += std::string(",") + insitu_field_names[var] + "_" +
+                    (dir == 'z' ? 'x' : 'z') + std::to_string(j);
+        }
+        log = insitu_open_log(path, append, header);
+      }
+      fprintf(log, "%ld,%.6lf", v.step, v.etime);
+      for (int j = 0; j < n; j++) {
+        fprintf(log, ",%.10le", glob[j]);
+      }
+      fprintf(log, "\n");
+      fflush(log);
+    }
+  }
+
+private:
+  std::string path;
+  bool append;
+  int var;
+  char dir;
+  int at;
+  FILE *log = nullptr;
+};
+
+// Writes an 8-bit RGB image as a PNG whose zlib stream uses stored (not
+// deflated) blocks, so no compression library is needed
+inline bool write_png(const std::string &path, int w, int h,
+                      const std::vector<unsigned char> &rgb) {
+  static uint32_t crc_table[256];
+  if (!crc_table[1]) {
+    for (uint32_t n = 0; n < 256; n++) {
+      uint32_t c = n;
+      for (int k = 0; k < 8; k++) {
+        c = (c & 1) ? 0xedb88320u ^ (c >> 1) : c >> 1;
+      }
+      crc_table[n] = c;
+    }
+  }
+  std::vector<unsigned char> out = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n'};
+  auto put32 = [](std::vector<unsigned char> &b, uint32_t x) {
+    for (int s = 24; s >= 0; s -= 8) {
+      b.push_back((x >> s) & 0xff);
+    }
+  };
+  auto chunk = [&](const char *type, const std::vector<unsigned char> &data) {
+    put32(out, data.size());
+    size_t start = out.size();
+    out.insert(out.end(), type, type + 4);
+    out.insert(out.end(), data.begin(), data.end());
+    uint32_t c = 0xffffffffu;
+    for (size_t j = start; j < out.size(); j++) {
+      c = crc_table[(c ^ out[j]) & 0xff] ^ (c >> 8);
+    }
+    put32(out, c ^ 0xffffffffu);
+  };
+
+  std::vector<unsigned char> ihdr;
+  put32(ihdr, w);
+  put32(ihdr, h);
+  ihdr.insert(ihdr.end(), {8, 2, 0, 0, 0}); // 8-bit RGB, no interlace
+  chunk("IHDR", ihdr);
+
+  // Scanlines with filter type 0, in stored blocks of at most 65535 bytes
+  std::vector<unsigned char> raw;
+  for (int y = 0; y < h; y++) {
+    raw.push_back(0);
+    raw.insert(raw.end(), rgb.begin() + 3L * w * y,
+               rgb.begin() + 3L * w * (y + 1));
+  }
+  std::vector<unsigned char> z = {0x78, 0x01};
+  for (size_t pos = 0; pos == 0 || pos < raw.size(); pos += 65535) {
+    size_t len = std::min<size_t>(65535, raw.size() - pos);
+    z.push_back(pos + len == raw.size());
+    z.push_back(len & 0xff);
+    z.push_back(len >> 8);
+    z.push_back(~len & 0xff);
+    z.push_back((~len >> 8) & 0xff);
+    z.insert(z.end(), raw.begin() + pos, raw.begin() + pos + len);
+  }
+  uint32_t a = 1, b = 0;
+  for (unsigned char byte : raw) {
+    a = (a + byte) % 65521;
+    b = (b + a) % 65521;
+  }
+  put32(z, (b << 16) | a);
+  chunk("IDAT", z);
+  chunk("IEND", {});
+
+  FILE *f = fopen(path.c_str(), "wb");
+  if (!f) {
+    return false;
+  }
+  bool ok = fwrite(out.data(), 1, out.size(), f) == out.size();
+  return fclose(f) == 0 && ok;
+}
+
+// <prefix>_<step><suffix>: field var as a PNG with z upwards, coarsened so it
+// is at most max_width pixels wide. Every rank adds the means of its cells
+// over each pixel's block into an otherwise zero image, and only this reduced
+// image is summed on rank 0. Colours run from blue through white to red over
+// +-max|value| (dens, uwnd, wwnd, theta are all perturbations or winds)
+class InSituImage : public InSituConsumer {
+public:
+  InSituImage(const std::string &prefix, const std::string &suffix, int var,
+              int max_width)
+      : prefix(prefix), suffix(suffix), var(var), max_width(max_width) {}
+
+  void process(const InSituView &v) override {
+    int f = (v.nx_glob + max_width - 1) / max_width;
+    int w = (v.nx_glob + f - 1) / f, h = (v.nz_glob + f - 1) / f;
+    std::vector<double> img(w * h, 0.), glob(w * h);
+    for (int k = 0; k < v.nz; k++) {
+      int kg = v.k_beg + k, y = kg / f;
+      int cells_z = std::min(f, v.nz_glob - y * f);
+      for (int i = 0; i < v.nx; i++) {
+        int ig = v.i_beg + i, x = ig / f;
+        int cells = cells_z * std::min(f, v.nx_glob - x * f);
+        img[y * w + x] += v.field(var, k, i) / cells;
+      }
+    }
+    MPI_Reduce(img.data(), glob.data(), w * h, MPI_DOUBLE, MPI_SUM, 0, v.comm);
+    if (v.rank != 0) {
+      return;
+    }
+
+    double range = 0.;
+    for (double x : glob) {
+      range = std::max(range, fabs(x));
+    }
+    std::vector<unsigned char> rgb(3L * w * h);
+    for (int y = 0; y < h; y++) {
+      for (int x = 0; x < w; x++) {
+        double s = range > 0. ? glob[y * w + x] / range : 0.; // In [-1, 1]
+        unsigned char fade = (unsigned char)lround(255. * (1. - fabs(s)));
+        unsigned char *p = &rgb[3L * ((h - 1 - y) * w + x)];
+        p[0] = s > 0. ? 255 : fade;
+        p[1] = fade;
+        p[2] = s < 0. ? 255 : fade;
+      }
+    }
+    char step[32];
+    snprintf(step, sizeof(step), "_%06ld", v.step);
+    std::string path = prefix + step + suffix;
+    if (!write_png(path, w, h, rgb)) {
+      printf("Error: cannot write %s\n", path.c_str());
+      MPI_Abort(MPI_COMM_WORLD, -1);
+    }
+  }
+
+private:
+  std::string prefix, suffix;
+  int var, max_width;
+};
+
+#endif
@@ -0,0 +1,334 @@
+//////////////////////////////////////////////////////////////////////////////////////////
+// miniWeather shared numerical core
+// The physical constants, the initial and hydrostatic background profiles and
+// the per-interface flux kernels used by every variant of the model. The loops
+// that call them are in miniWeather_backend.h, written once for the serial,
+// OpenMP-thread, OpenACC and OpenMP-target builds, so a change to the
+// numerics is made once here.
+//
+// Backends that run the kernels on a device mark them through MW_ROUTINE:
+//   OpenACC       "acc routine seq", picked up from _OPENACC
+//   OpenMP target "declare target", requested with -DMW_OMP_TARGET
+//////////////////////////////////////////////////////////////////////////////////////////
+
+#ifndef MINIWEATHER_KERNELS_H
+#define MINIWEATHER_KERNELS_H
+
+#include <math.h>
+
+#if defined(_OPENACC)
+#define MW_ROUTINE _Pragma("acc routine seq")
+#else
+#define MW_ROUTINE
+#endif
+
+constexpr double pi = 3.14159265358979323846264338327; // Pi
+constexpr double grav = 9.8; // Gravitational acceleration (m / s^2)
+constexpr double cp = 1004.; // Specific heat of dry air at constant pressure
+constexpr double cv = 717.;  // Specific heat of dry air at constant volume
+constexpr double rd =
+    287.; // Dry air constant for equation of state (P=rho*rd*T)
+constexpr double p0 = 1.e5; // Standard pressure at the surface in Pascals
+constexpr double C0 =
+    27.5629410929725921310572974482; // Constant to translate potential
+                                     // temperature into pressure
+                                     // (P=C0*(rho*theta)**gamma)
+constexpr double gamm =
+    1.40027894002789400278940027894; // gamma=cp/Rd , have to call this gamm
+                                     // because "gamma" is taken (I hate C so
+                                     // much)
+// Define domain and stability-related constants
+constexpr double xlen = 2.e4; // Length of the domain in the x-direction
+                              // (meters)
+constexpr double zlen = 1.e4; // Length of the domain in the z-direction
+                              // (meters)
+constexpr double hv_beta =
+    0.05; // How strong to diffuse the solution: hv_beta \in [0:1]
+constexpr double cfl =
+    1.50; //"Courant, Friedrichs, Lewy" number (for numerical stability)
+constexpr double max_speed =
+    450; // Assumed maximum wave speed during the simulation (speed of sound +
+         // speed of wind) (meter / sec)
+constexpr int hs =
+    2; //"Halo" size: number of cells beyond the MPI tasks's domain needed for a
+       // full "stencil" of information for reconstruction
+constexpr int sten_size = 4; // Size of the stencil used for interpolation
+
+// Parameters for indexing and flags
+constexpr int NUM_VARS = 4; // Number of fluid state variables
+constexpr int ID_DENS = 0;  // index for density ("rho")
+constexpr int ID_UMOM = 1;  // index for momentum in the x-direction ("rho * u")
+constexpr int ID_WMOM = 2;  // index for momentum in the z-direction ("rho * w")
+constexpr int ID_RHOT =
+    3; // index for density * potential temperature ("rho * theta")
+constexpr int DIR_X =
+    1; // Integer constant to express that this operation is in the x-direction
+constexpr int DIR_Z =
+    2; // Integer constant to express that this operation is in the z-direction
+constexpr int DATA_SPEC_COLLISION = 1;
+constexpr int DATA_SPEC_THERMAL = 2;
+constexpr int DATA_SPEC_GRAVITY_WAVES = 3;
+constexpr int DATA_SPEC_DENSITY_CURRENT = 5;
+constexpr int DATA_SPEC_INJECTION = 6;
+
+// Gauss-Legendre quadrature used to initialise the cell averages
+constexpr int nqpoints = 3;
+constexpr double qpoints[] = {0.112701665379258311482073460022E0,
+                              0.500000000000000000000000000000E0,
+                              0.887298334620741688517926539980E0};
+constexpr double qweights[] = {0.277777777777777777777777777779E0,
+                               0.444444444444444444444444444444E0,
+                               0.277777777777777777777777777779E0};
+
+#if defined(MW_OMP_TARGET)
+#pragma omp declare target
+#endif
+
+// Fourth-order interpolation of the four cell averages q[0], q[stride],
+// q[2*stride] and q[3*stride] to the interface between the middle two (val),
+// and the first-order third derivative there for the hyperviscosity (d3)
+MW_ROUTINE
+template <class T>
+inline void reconstruct(const T *q, int stride, double &val, double &d3) {
+  double stencil[sten_size];
+  for (int s = 0; s < sten_size; s++) {
+    stencil[s] = q[s * stride];
+  }
+  // Fourth-order-accurate interpolation of the state
+  val = -stencil[0] / 12 + 7 * stencil[1] / 12 + 7 * stencil[2] / 12 -
+        stencil[3] / 12;
+  // First-order-accurate interpolation of the third spatial derivative of
+  // the state (for artificial viscosity)
+  d3 = -stencil[0] + 3 * stencil[1] - 3 * stencil[2] + stencil[3];
+}
+
+// x-direction flux vector f (including hyperviscosity) from the interpolated
+// perturbation state vals and third derivatives d3 at an interface whose
+// hydrostatic background density and rho*theta are hr and ht. If speed is
+// given, it is raised to the interface's fastest signal speed |u| + c
+MW_ROUTINE
+inline void flux_x(const double *vals, const double *d3, double hr, double ht,
+                   double hv_coef, double *f, double *speed = nullptr) {
+  // Compute density, u-wind, w-wind, potential temperature, and pressure
+  // (r,u,w,t,p respectively)
+  const double r = vals[ID_DENS] + hr;
+  const double u = vals[ID_UMOM] / r;
+  const double w = vals[ID_WMOM] / r;
+  const double t = (vals[ID_RHOT] + ht) / r;
+  const double p = C0 * pow((r * t), gamm);
+
+  // Compute the flux vector
+  f[ID_DENS] = r * u - hv_coef * d3[ID_DENS];
+  f[ID_UMOM] = r * u * u + p - hv_coef * d3[ID_UMOM];
+  f[ID_WMOM] = r * u * w - hv_coef * d3[ID_WMOM];
+  f[ID_RHOT] = r * u * t - hv_coef * d3[ID_RHOT];
+  if (speed) {
+    *speed = fmax(*speed, fabs(u) + sqrt(gamm * p / r));
+  }
+}
+
+// z-direction flux vector f (including hyperviscosity) at an interface with
+// hydrostatic background density hr, rho*theta ht and pressure hp. wall marks
+// the model top and bottom, where w and the mass hyperviscosity vanish so
+// that mass is conserved exactly. If speed is given, it is raised to the
+// interface's fastest signal speed |w| + c
+MW_ROUTINE
+inline void flux_z(const double *vals, const double *d3, double hr, double ht,
+                   double hp, double hv_coef, bool wall, double *f,
+                   double *speed = nullptr) {
+  // Compute density, u-wind, w-wind, potential temperature, and pressure
+  // (r,u,w,t,p respectively)
+  const double r = vals[ID_DENS] + hr;
+  const double u = vals[ID_UMOM] / r;
+  const double w = wall ? 0. : vals[ID_WMOM] / r;
+  const double t = (vals[ID_RHOT] + ht) / r;
+  const double p = C0 * pow((r * t), gamm) - hp;
+  const double d3_dens = wall ? 0. : d3[ID_DENS];
+
+  // Compute the flux vector with hyperviscosity
+  f[ID_DENS] = r * w - hv_coef * d3_dens;
+  f[ID_UMOM] = r * w * u - hv_coef * d3[ID_UMOM];
+  f[ID_WMOM] = r * w * w + p - hv_coef * d3[ID_WMOM];
+  f[ID_RHOT] = r * w * t - hv_coef * d3[ID_RHOT];
+  if (speed) {
+    *speed = fmax(*speed, fabs(w) + sqrt(gamm * (p + hp) / r));
+  }
+}
+
+#if defined(MW_OMP_TARGET)
+#pragma omp end declare target
+#endif
+
+// Establish hydrostatic balance using constant potential temperature (thermally
+// neutral atmosphere) z is the input coordinate r and t are the output
+// background hydrostatic density and potential temperature
+inline void hydro_const_theta(double z, double &r, double &t) {
+  const double theta0 = 300.; // Background potential temperature
+  const double exner0 = 1.;   // Surface-level Exner pressure
+  double p, exner, rt;
+  // Establish hydrostatic balance first using Exner pressure
+  t = theta0;                                // Potential Temperature at z
+  exner = exner0 - grav * z / (cp * theta0); // Exner pressure at z
+  p = p0 * pow(exner, (cp / rd));            // Pressure at z
+  rt = pow((p / C0), (1. / gamm));           // rho*theta at z
+  r = rt / t;                                // Density at z
+}
+
+// Establish hydrostatic balance using constant Brunt-Vaisala frequency
+// z is the input coordinate
+// bv_freq0 is the constant Brunt-Vaisala frequency
+// r and t are the output background hydrostatic density and potential
+// temperature
+inline void hydro_const_bvfreq(double z, double bv_freq0, double &r,
+                               double &t) {
+  const double theta0 = 300.; // Background potential temperature
+  const double exner0 = 1.;   // Surface-level Exner pressure
+  double p, exner, rt;
+  t = theta0 * exp(bv_freq0 * bv_freq0 / grav * z); // Pot temp at z
+  exner = exner0 - grav * grav / (cp * bv_freq0 * bv_freq0) * (t - theta0) /
+                       (t * theta0); // Exner pressure at z
+  p = p0 * pow(exner, (cp / rd));    // Pressure at z
+  rt = pow((p / C0), (1. / gamm));   // rho*theta at z
+  r = rt / t;                        // Density at z
+}
+
+// Sample from an ellipse of a specified center, radius, and amplitude at a
+// specified location x and z are input coordinates amp,x0,z0,xrad,zrad are
+// input amplitude, center, and radius of the ellipse
+inline double sample_ellipse_cosine(double x, double z, double amp, double x0,
+                                    double z0, double xrad, double zrad) {
+  double dist;
+  // Compute distance from bubble center
+  dist = sqrt(((x - x0) / xrad) * ((x - x0) / xrad) +
+              ((z - z0) / zrad) * ((z - z0) / zrad)) *
+         pi / 2.;
+  // If the distance from bubble center is less than the radius, create a cos**2
+  // profile
+  if (dist <= pi / 2.) {
+    return amp * pow(cos(dist), 2.);
+  } else {
+    return 0.;
+  }
+}
+
+// The test cases. Each one is split into its hydrostatic background, which
+// depends on z only, and the perturbation on top of it, so drivers can
+// evaluate the background once per row and pick the case once, as a template
+// parameter:
+//   background(z, hr, ht)         background density and potential temperature
+//   perturbation(x, z, r, u, w, t) density, u-wind, w-wind and potential
+//                                  temperature perturbations at (x,z)
+
+// This test case is initially balanced but injects fast, cold air from the
+// left boundary near the model top
+struct InjectionCase {
+  static void background(double z, double &hr, double &ht) {
+    hydro_const_theta(z, hr, ht);
+  }
+  static void perturbation(double x, double z, double &r, double &u,
+                           double &w, double &t) {
+    r = 0.;
+    t = 0.;
+    u = 0.;
+    w = 0.;
+  }
+};
+
+// Initialize a density current (falling cold thermal that propagates along the
+// model bottom)
+struct DensityCurrentCase {
+  static void background(double z, double &hr, double &ht) {
+    hydro_const_theta(z, hr, ht);
+  }
+  static void perturbation(double x, double z, double &r, double &u,
+                           double &w, double &t) {
+    r = 0.;
+    t = 0.;
+    u = 0.;
+    w = 0.;
+    t = t + sample_ellipse_cosine(x, z, -20., xlen / 2, 5000., 4000., 2000.);
+  }
+};
+
+// Gravity waves in a stable background with a constant wind
+struct GravityWavesCase {
+  static void background(double z, double &hr, double &ht) {
+    hydro_const_bvfreq(z, 0.02, hr, ht);
+  }
+  static void perturbation(double x, double z, double &r, double &u,
+                           double &w, double &t) {
+    r = 0.;
+    t = 0.;
+    u = 15.;
+    w = 0.;
+  }
+};
+
+// Rising thermal
+struct ThermalCase {
+  static void background(double z, double &hr, double &ht) {
+    hydro_const_theta(z, hr, ht);
+  }
+  static void perturbation(double x, double z, double &r, double &u,
+                           double &w, double &t) {
+    r = 0.;
+    t = 0.;
+    u = 0.;
+    w = 0.;
+    t = t + sample_ellipse_cosine(x, z, 3., xlen / 2, 2000., 2000., 2000.);
+  }
+};
+
+// Colliding thermals
+struct CollisionCase {
+  static void background(double z, double &hr, double &ht) {
+    hydro_const_theta(z, hr, ht);
+  }
+  static void perturbation(double x, double z, double &r, double &u,
+                           double &w, double &t) {
+    r = 0.;
+    t = 0.;
+    u = 0.;
+    w = 0.;
+    t = t + sample_ellipse_cosine(x, z, 20., xlen / 2, 2000., 2000., 2000.);
+    t = t + sample_ellipse_cosine(x, z, -20., xlen / 2, 8000., 2000., 2000.);
+  }
+};
+
+// The initial conditions as single calls. x and z are input coordinates at
+// which to sample; r,u,w,t are the output density, u-wind, w-wind, and
+// potential temperature perturbations at that location, and hr and ht the
+// background hydrostatic density and potential temperature there
+template <class Case>
+inline void sample_case(double x, double z, double &r, double &u, double &w,
+                        double &t, double &hr, double &ht) {
+  Case::background(z, hr, ht);
+  Case::perturbation(x, z, r, u, w, t);
+}
+
+inline void injection(double x, double z, double &r, double &u, double &w,
+                      double &t, double &hr, double &ht) {
+  sample_case<InjectionCase>(x, z, r, u, w, t, hr, ht);
+}
+
+inline void density_current(double x, double z, double &r, double &u,
+                            double &w, double &t, double &hr, double &ht) {
+  sample_case<DensityCurrentCase>(x, z, r, u, w, t, hr, ht);
+}
+
+inline void gravity_waves(double x, double z, double &r, double &u, double &w,
+                          double &t, double &hr, double &ht) {
+  sample_case<GravityWavesCase>(x, z, r, u, w, t, hr, ht);
+}
+
+inline void thermal(double x, double z, double &r, double &u, double &w,
+                    double &t, double &hr, double &ht) {
+  sample_case<ThermalCase>(x, z, r, u, w, t, hr, ht);
+}
+
+inline void collision(double x, double z, double &r, double &u, double &w,
+                      double &t, double &hr, double &ht) {
+  sample_case<CollisionCase>(x, z, r, u, w, t, hr, ht);
+}
+
+#endif
@@ -8,75 +8,384 @@
 //
 //////////////////////////////////////////////////////////////////////////////////////////
 
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
 #include <ctime>
+#include <fstream>
 #include <iostream>
 #include <math.h>
+#include <memory>
 #include <mpi.h>
+#if __has_include(<mpi-ext.h>)
+#include <mpi-ext.h> // Open MPI extensions (MPIX_Query_cuda_support)
+#endif
+#include <new>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 #include <stdio.h>
+#include <sstream>
 #include <stdlib.h>
 #include <string>
+#include <type_traits>
+#include <unistd.h>
+#include <utility>
 #include <vector>
+#ifdef __linux__
+#include <sched.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#endif
 #ifdef _PNETCDF
 #include "pnetcdf.h"
 #endif
+#include "miniWeather_backend.h"
+#include "miniWeather_kernels.h"
 #include <chrono>
+#include <cmath>
+#ifdef _PNETCDF
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#endif
+
+// Storage type of the model arrays: state, flux, tend and the halo buffers.
+// -D_SINGLE_PREC keeps them in float, halving memory traffic and halo message
+// volume; the flux arithmetic, the hydrostatic background and the reductions
+// stay in double
+#ifdef _SINGLE_PREC
+typedef float real;
+#define MPI_TYPE MPI_FLOAT
+#else
+typedef double real;
+#define MPI_TYPE MPI_DOUBLE
+#endif
+
+// Allocator of the state, flux and tend arrays: 64-byte aligned storage whose
+// elements are default- rather than value-initialised, so resize() writes
+// nothing and each page is placed on a NUMA node only when first written.
+// Constructed on a fixed block of capacity elements (--shm-halo: this rank's
+// part of an MPI shared window), it hands that block out instead, throws
+// std::bad_alloc for a larger request and never frees it; copies of such an
+// array are ordinary heap arrays
+template <class T> struct FieldAllocator {
+  typedef T value_type;
+  typedef std::true_type propagate_on_container_move_assignment;
+  T *fixed = nullptr;
+  size_t capacity = 0;
+  FieldAllocator() = default;
+  FieldAllocator(T *fixed, size_t capacity)
+      : fixed(fixed), capacity(capacity) {}
+  template <class U> FieldAllocator(const FieldAllocator<U> &) {}
+  FieldAllocator select_on_container_copy_construction() const {
+    return FieldAllocator();
+  }
+  T *allocate(size_t n) {
+    if (fixed) {
+      if (n > capacity) {
+        throw std::bad_alloc();
+      }
+      return fixed;
+    }
+    void *p = nullptr;
+    if (posix_memalign(&p, 64, n * sizeof(T)) != 0) {
+      throw std::bad_alloc();
+    }
+    return static_cast<T *>(p);
+  }
+  void deallocate(T *p, size_t) {
+    if (p != fixed) {
+      free(p);
+    }
+  }
+  template <class U> void construct(U *p) { ::new ((void *)p) U; }
+  template <class U, class... Args> void construct(U *p, Args &&...args) {
+    ::new ((void *)p) U(std::forward<Args>(args)...);
+  }
+};
+template <class T, class U>
+bool operator==(const FieldAllocator<T> &a, const FieldAllocator<U> &b) {
+  return (void *)a.fixed == (void *)b.fixed;
+}
+template <class T, class U>
+bool operator!=(const FieldAllocator<T> &a, const FieldAllocator<U> &b) {
+  return !(a == b);
+}
+typedef std::vector<real, FieldAllocator<real>> field_vector;
+// The flux, tendency, halo and reduction loops on this build's backend
+typedef Dynamics<Backend, real> Dyn;
+
+#include "miniWeather_insitu.h"
+
+// Leading block of a checkpoint file. The interior state follows at
+// checkpoint_data_offset as [NUM_VARS][nz_glob][nx_glob] values of type real,
+// so a run can be restarted on any process grid
+struct CheckpointHeader {
+  char magic[8]; // "MWCHKPT1"
+  int nx_glob, nz_glob, data_spec_int, real_size;
+  int num_out, direction_switch;
+  double etime, output_counter, checkpoint_counter, mass0, te0;
+  // Next time step and the signal speeds pending for the one after it
+  // (--adaptive-dt; zero in checkpoints that predate it)
+  double dt, wave_speed[2];
+};
+// Courant number of --adaptive-dt, relative to the measured rather than an
+// assumed maximum signal speed
+constexpr double default_adaptive_cfl = 1.3;
+// Columns per strip of fused_step_z, whose flux and update rows for the strip
+// are the per-thread scratch of the fused z stage
+constexpr int fused_blk = 64;
+// Device memory the startup memory table of the GPU builds sizes its largest
+// one-rank grid for (GiB), the HBM of one data-centre GPU. The host figure
+// defaults to this node's physical memory
+constexpr double default_device_mem_gb = 80.;
+
+constexpr char checkpoint_magic[8] = {'M', 'W', 'C', 'H', 'K', 'P', 'T', '1'};
+constexpr int checkpoint_data_offset = 256;
+static_assert(sizeof(CheckpointHeader) <= checkpoint_data_offset,
+              "checkpoint header overlaps the state");
+
+// Explicit Runge-Kutta schemes for each direction of the split step
+// (--integrator). A stage is one semi_discrete_step on the two state buffers,
+// buffer 0 holding q[n] at the start of a sweep and the result at its end:
+//   buf[out] = buf[init] + dt / div * rhs(buf[forcing])
+// Every scheme fits in the two buffers, so none allocates storage. The
+// hyperviscosity coefficient scales with 1 / (dt / div), so a stage damps by
+// the same amount whatever its length. Only the last stage of these schemes
+// reaches q[n+1] with its whole increment, so each damps a step as rk3 does.
+// SSP schemes such as SSPRK(4,3) and SSPRK(9,3) were left out: their
+// intervals on the imaginary axis, where the centred advection of this model
+// puts its eigenvalues, give 7% and 26% more stages per model second than rk3,
+// and their increments reach q[n+1] 8/3 and 33/5 times over
+struct RKStage {
+  int init, forcing, out;
+  double div;
+};
+struct Integrator {
+  const char *name;
+  int num_stages;
+  RKStage stages[4];
+  double cfl_scale; // Stable Courant number relative to rk3's
+};
+constexpr int NUM_INTEGRATORS = 2;
+constexpr Integrator integrators[NUM_INTEGRATORS] = {
+    // Low-storage three-stage RK, third order for linear problems:
+    //  q*     = q[n] + dt/3 * rhs(q[n])
+    //  q**    = q[n] + dt/2 * rhs(q*  )
+    //  q[n+1] = q[n] + dt/1 * rhs(q** )
+    {"rk3",
+     3,
+     {{0, 0, 1, 3.}, {0, 1, 1, 2.}, {0, 1, 0, 1.}},
+     1.},
+    // The four-stage member of the same family, fourth order for linear
+    // problems. Its stability interval on the imaginary axis, where the
+    // centred advection of this model puts its eigenvalues, is 2.83 against
+    // rk3's 1.73, so it runs at 1.6 times the Courant number: 17% fewer
+    // stages per model second
+    {"rk4",
+     4,
+     {{0, 0, 1, 4.}, {0, 1, 1, 3.}, {0, 1, 1, 2.}, {0, 1, 0, 1.}},
+     1.6},
+};
+
+// Phases timed with --timers. Each timer counts exclusive time: a phase that
+// starts inside another pauses the outer one
+constexpr int TIMER_TEND_X = 0;    // x fluxes and tendencies (or the fused step)
+constexpr int TIMER_TEND_Z = 1;    // z fluxes and tendencies (or the fused step)
+constexpr int TIMER_APPLY = 2;     // Tendency application in semi_discrete_step
+constexpr int TIMER_HALO_PACK = 3; // Halo pack/unpack, posting and boundaries
+constexpr int TIMER_HALO_WAIT = 4; // MPI_Waitall on the halo messages
+constexpr int TIMER_OUTPUT = 5;    // output()
+constexpr int TIMER_REDUCE = 6;    // MPI_Allreduce in reductions()
+constexpr int TIMER_LOOP = 7;      // The whole time step loop in Run()
+constexpr int NUM_TIMERS = 8;
+constexpr const char *timer_names[NUM_TIMERS] = {
+    "tendencies_x", "tendencies_z", "apply_tendencies", "halo_pack",
+    "halo_wait",    "output",       "reductions",       "time_loop"};
+
+// Phases of init() in the start-up time breakdown
+constexpr int STARTUP_MPI = 0;        // MPI, process grid and decomposition
+constexpr int STARTUP_ALLOC = 1;      // Allocating and zeroing the arrays
+constexpr int STARTUP_STATE = 2;      // Initial state (quadrature or restart)
+constexpr int STARTUP_BACKGROUND = 3; // Hydrostatic background, source terms
+constexpr int STARTUP_SETUP = 4;      // Halo requests, output, tile search
+constexpr int NUM_STARTUP_PHASES = 5;
+constexpr const char *startup_names[NUM_STARTUP_PHASES] = {
+    "mpi_setup", "allocation", "initial_state", "background", "other_setup"};
+
+// Accumulated wall time and call count of each phase, plus the phase that is
+// running now and when it was last resumed
+struct TimerRegistry {
+  bool enabled = false;
+  double total[NUM_TIMERS] = {};
+  long calls[NUM_TIMERS] = {};
+  int current = -1;
+  double mark = 0.;
+};
+
+// Number of the calling thread in the time step's parallel region (0 outside
+// it, or without OpenMP)
+inline int thread_num() {
+#ifdef _OPENMP
+  return omp_get_thread_num();
+#else
+  return 0;
+#endif
+}
+
+inline int max_threads() {
+#ifdef _OPENMP
+  return omp_get_max_threads();
+#else
+  return 1;
+#endif
+}
+
+// Charges the wall time of the enclosing scope to one phase of a
+// TimerRegistry. When the registry is disabled it never reads the clock. Inside
+// the time step's parallel region only the master thread keeps time, so a
+// phase includes the wait for the slowest thread at its closing barrier
+class ScopedTimer {
+public:
+  ScopedTimer(TimerRegistry &reg, int id)
+      : reg(reg), id(id), active(reg.enabled && thread_num() == 0) {
+    if (active) {
+      double now = MPI_Wtime();
+      if (reg.current >= 0) {
+        reg.total[reg.current] += now - reg.mark;
+      }
+      parent = reg.current;
+      reg.current = id;
+      reg.mark = now;
+    }
+  }
+  ~ScopedTimer() {
+    if (active) {
+      double now = MPI_Wtime();
+      reg.total[id] += now - reg.mark;
+      reg.calls[id]++;
+      reg.current = parent;
+      reg.mark = now;
+    }
+  }
+
+private:
+  TimerRegistry &reg;
+  int id;
+  bool active;
+  int parent = -1;
+};
+
+#ifdef _BENCH
+// One measurement of miniWeather_bench: seconds per call of a kernel on an
+// nx_glob x nz_glob grid with threads threads per rank, and the minimum memory
+// traffic and floating-point work of one call, summed over the ranks
+struct BenchRecord {
+  std::string kernel;
+  int nx_glob, nz_glob, threads;
+  double sec, bytes, flops;
+};
+#endif
+
+// Vector ISA of the SIMD flux kernels (--simd). The AVX variants are the same
+// omp simd loops compiled for a wider target and picked at run time from the
+// CPU feature bits, so the binary itself only assumes the baseline ISA
+constexpr int SIMD_NONE = 0;   // Scalar flux loops
+constexpr int SIMD_BASE = 1;   // omp simd loops at the baseline ISA
+constexpr int SIMD_AVX2 = 2;   // AVX2 + FMA, 4 interfaces per vector
+constexpr int SIMD_AVX512 = 3; // AVX-512, 8 interfaces per vector
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__)) &&       \
+    !defined(_OPENACC) && !defined(MW_OMP_TARGET)
+#define SIMD_X86
+#define SIMD_TARGET(isa) __attribute__((target(isa)))
+#endif
+#if defined(__GNUC__)
+#define SIMD_INLINE inline __attribute__((always_inline))
+#else
+#define SIMD_INLINE inline
+#endif
+
+SIMD_INLINE double simd_from_bits(uint64_t b) {
+  double d;
+  memcpy(&d, &b, sizeof(d));
+  return d;
+}
+
+SIMD_INLINE uint64_t simd_to_bits(double d) {
+  uint64_t b;
+  memcpy(&b, &d, sizeof(b));
+  return b;
+}
+
+// pow(x,y) for positive, normal x, computed as exp(y*log(x)) with nothing but
+// arithmetic, integer bit operations and selects so that it vectorises inside
+// omp simd loops. log uses the atanh series on a mantissa in [sqrt(1/2),
+// sqrt(2)) and exp a degree-13 Taylor polynomial after a Cody-Waite reduction;
+// the relative error against pow is below 4e-15 for x in [1e-3, 1e6]
+SIMD_INLINE double simd_pow(double x, double y) {
+  const double ln2_hi = 6.93147180369123816490e-01;
+  const double ln2_lo = 1.90821492927058770002e-10;
+  const double log2e = 1.44269504088896338700e+00;
+  const double two52 = 4503599627370496.0;          // 2^52
+  const double round_magic = 6755399441055744.0;    // 1.5 * 2^52
+  double e, m, s, s2, lx, t, n, r, p;
+  uint64_t b = simd_to_bits(x), u;
+  // x = m * 2^e with m in [sqrt(1/2), sqrt(2)), found without branches by
+  // offsetting the bits so that the exponent field rolls over at sqrt(2). The
+  // biased exponent is read back through the mantissa of 2^52 + e to avoid an
+  // integer to double conversion
+  u = b + (0x3FF0000000000000ULL - 0x3FE6A09E667F3BCDULL);
+  e = simd_from_bits((u >> 52) | 0x4330000000000000ULL) - two52 - 1023.;
+  m = simd_from_bits(b - ((u & 0xFFF0000000000000ULL) - 0x3FF0000000000000ULL));
+  // log(m) = 2 atanh(s), s = (m-1)/(m+1), |s| < 0.172
+  s = (m - 1.) / (m + 1.);
+  s2 = s * s;
+  lx = 1. / 21.;
+  lx = lx * s2 + 1. / 19.;
+  lx = lx * s2 + 1. / 17.;
+  lx = lx * s2 + 1. / 15.;
+  lx = lx * s2 + 1. / 13.;
+  lx = lx * s2 + 1. / 11.;
+  lx = lx * s2 + 1. / 9.;
+  lx = lx * s2 + 1. / 7.;
+  lx = lx * s2 + 1. / 5.;
+  lx = lx * s2 + 1. / 3.;
+  lx = e * ln2_hi + (e * ln2_lo + 2. * s * (1. + s2 * lx));
+  // exp(t) = 2^n exp(r), |r| <= ln(2)/2
+  t = y * lx;
+  n = (t * log2e + round_magic) - round_magic;
+  r = (t - n * ln2_hi) - n * ln2_lo;
+  p = 1. / 6227020800.;
+  p = p * r + 1. / 479001600.;
+  p = p * r + 1. / 39916800.;
+  p = p * r + 1. / 3628800.;
+  p = p * r + 1. / 362880.;
+  p = p * r + 1. / 40320.;
+  p = p * r + 1. / 5040.;
+  p = p * r + 1. / 720.;
+  p = p * r + 1. / 120.;
+  p = p * r + 1. / 24.;
+  p = p * r + 1. / 6.;
+  p = p * r + 0.5;
+  p = p * r + 1.;
+  p = p * r + 1.;
+  // 2^n, taking the integer n from the low mantissa bits of n + 1.5 * 2^52
+  b = simd_to_bits(n + round_magic) - simd_to_bits(round_magic) + 1023;
+  return p * simd_from_bits(b << 52);
+}
 
-constexpr double pi = 3.14159265358979323846264338327; // Pi
-constexpr double grav = 9.8; // Gravitational acceleration (m / s^2)
-constexpr double cp = 1004.; // Specific heat of dry air at constant pressure
-constexpr double cv = 717.;  // Specific heat of dry air at constant volume
-constexpr double rd =
-    287.; // Dry air constant for equation of state (P=rho*rd*T)
-constexpr double p0 = 1.e5; // Standard pressure at the surface in Pascals
-constexpr double C0 =
-    27.5629410929725921310572974482; // Constant to translate potential
-                                     // temperature into pressure
-                                     // (P=C0*(rho*theta)**gamma)
-constexpr double gamm =
-    1.40027894002789400278940027894; // gamma=cp/Rd , have to call this gamm
-                                     // because "gamma" is taken (I hate C so
-                                     // much)
-// Define domain and stability-related constants
-constexpr double xlen = 2.e4; // Length of the domain in the x-direction
-                              // (meters)
-constexpr double zlen = 1.e4; // Length of the domain in the z-direction
-                              // (meters)
-constexpr double hv_beta =
-    0.05; // How strong to diffuse the solution: hv_beta \in [0:1]
-constexpr double cfl =
-    1.50; //"Courant, Friedrichs, Lewy" number (for numerical stability)
-constexpr double max_speed =
-    450; // Assumed maximum wave speed during the simulation (speed of sound +
-         // speed of wind) (meter / sec)
-constexpr int hs =
-    2; //"Halo" size: number of cells beyond the MPI tasks's domain needed for a
-       // full "stencil" of information for reconstruction
-constexpr int sten_size = 4; // Size of the stencil used for interpolation
-
-// Parameters for indexing and flags
-constexpr int NUM_VARS = 4; // Number of fluid state variables
-constexpr int ID_DENS = 0;  // index for density ("rho")
-constexpr int ID_UMOM = 1;  // index for momentum in the x-direction ("rho * u")
-constexpr int ID_WMOM = 2;  // index for momentum in the z-direction ("rho * w")
-constexpr int ID_RHOT =
-    3; // index for density * potential temperature ("rho * theta")
-constexpr int DIR_X =
-    1; // Integer constant to express that this operation is in the x-direction
-constexpr int DIR_Z =
-    2; // Integer constant to express that this operation is in the z-direction
-constexpr int DATA_SPEC_COLLISION = 1;
-constexpr int DATA_SPEC_THERMAL = 2;
-constexpr int DATA_SPEC_GRAVITY_WAVES = 3;
-constexpr int DATA_SPEC_DENSITY_CURRENT = 5;
-constexpr int DATA_SPEC_INJECTION = 6;
-
-constexpr int nqpoints = 3;
-constexpr double qpoints[] = {0.112701665379258311482073460022E0,
-                              0.500000000000000000000000000000E0,
-                              0.887298334620741688517926539980E0};
-constexpr double qweights[] = {0.277777777777777777777777777779E0,
-                               0.444444444444444444444444444444E0,
-                               0.277777777777777777777777777779E0};
+// Fourth-order interpolation and third derivative of four cell averages spaced
+// stride apart, in double and in the same operation order as the scalar kernels
+SIMD_INLINE double simd_interp4(const real *q, int stride) {
+  double q0 = q[0], q1 = q[stride], q2 = q[2 * stride], q3 = q[3 * stride];
+  return -q0 / 12 + 7 * q1 / 12 + 7 * q2 / 12 - q3 / 12;
+}
+
+SIMD_INLINE double simd_d3(const real *q, int stride) {
+  double q0 = q[0], q1 = q[stride], q2 = q[2 * stride], q3 = q[3 * stride];
+  return -q0 + 3 * q1 - 3 * q2 + q3;
+}
 
 ///////////////////////////////////////////////////////////////////////////////////////
 // BEGIN USER-CONFIGURABLE PARAMETERS
@@ -109,85 +418,382 @@ public:
   ~MiniWeatherSimulation();
   void Run();
   void Finalize();
+  // Call consumer with a view of the state every insitu_every-th step
+  void add_insitu(std::unique_ptr<InSituConsumer> consumer) {
+    insitu.push_back(std::move(consumer));
+  }
+#ifdef _BENCH
+  void benchmark_kernels(const std::vector<int> &threads, double min_time,
+                         std::vector<BenchRecord> &records);
+#endif
 
 private:
   // MPI State
   int nranks, myrank;
+  bool owns_mpi = true; // init() started MPI, so Finalize() ends it
   int left_rank, right_rank;
+  int bottom_rank, top_rank; // MPI_PROC_NULL at the physical z boundaries
+  int px, pz;                // Cartesian process grid (x ranks, z ranks)
+  int x_coord;               // This rank's process column
+  int pz_req = 0;            // Requested z ranks (0 = choose automatically)
+  MPI_Comm cart_comm;        // 2D Cartesian communicator for halo exchanges
   int mainproc;
+  // Ensemble mode (--ensemble): the ranks of MPI_COMM_WORLD are split into
+  // n_members contiguous groups, each running one member on comm. Without it
+  // comm is MPI_COMM_WORLD and n_members is 0
+  MPI_Comm comm = MPI_COMM_WORLD;
+  int member = 0, n_members = 0;
+  bool world_main = false; // Rank 0 of MPI_COMM_WORLD
+  std::string ensemble_file;
 
-  // Domain Constants
-  const double pi = 3.14159265358979323846264338327;
-  const double grav = 9.8;
-  const double cp = 1004.;
-  const double cv = 717.;
-  const double rd = 287.;
-  const double p0 = 1.e5;
-  const double C0 = 27.5629410929725921310572974482;
-  const double gamm = 1.40027894002789400278940027894;
-
-  // Configuration
-  double xlen = 2.e4;
-  double zlen = 1.e4;
-  double hv_beta = 0.05;
-  double cfl = 1.50;
-  double max_speed = 450;
-  int hs = 2;
-  int sten_size = 4;
+  // Configuration. The physical constants, hv_beta, cfl, hs and sten_size are
+  // the compile-time constants of miniWeather_kernels.h
   int nx_glob, nz_glob;
   double sim_time, output_freq;
   int data_spec_int;
+  double amp = 1.;                 // Scales the initial perturbation (--amp)
+  double hyperviscosity = hv_beta; // hv_beta of this run (--hv-beta)
   double dx, dz;
   double dt;
+  // Overlap the x halo exchange with interior fluxes (always on a device,
+  // where the halo has its own queue)
+  bool overlap = Backend::device;
+  bool persistent_halo = false; // Persistent requests on a subarray datatype
+  bool shm_halo = false; // Read the x halos of on-node neighbours in place
+  int halo_bench_iters = 0;     // > 0: benchmark the x halo paths and exit
+  // --deep-halo: x halos of hx = hs columns per RK stage, exchanged once per
+  // x sweep instead of once per stage
+  bool deep_halo = false;
+  int hx = hs;
+  bool fused = false; // Single-pass flux + tendency + update kernels
+  bool fused_z = false; // ... in z too (_FUSED_Z builds, or --low-mem)
+  // --low-mem: both directions fused, so flux and tend are never allocated,
+  // and no halo message buffers for directions with a single rank
+  bool low_mem = false;
+  bool mem_report = false; // Print the memory table at startup
+  double mem_gb = 0.; // Its host budget in GiB (--mem-gb; 0: this node's)
+  double device_mem_gb = default_device_mem_gb; // (--device-mem-gb)
+  bool pad_pitch = false; // Pad rows to dodge 4K aliasing between planes
+  int tile_k = 0, tile_i = 0; // compute_tendencies_z tile (0: untiled)
+  bool tile_auto = false;      // Pick the tile by timing candidates at init
+  int simd_isa = SIMD_NONE;    // Vector ISA of the flux kernels
+  bool async_output = false;   // Stage output frames and write them behind
+  bool first_touch = false;    // Zero the model arrays from the compute threads
+  bool adaptive_dt = false;    // Set dt from the measured signal speeds
+  double adaptive_cfl = 0.; // Its Courant number (0: default_adaptive_cfl *
+                            // cfl_scale of the integrator)
+  const Integrator *integrator = &integrators[0]; // --integrator
+  double fixed_cfl = 0.; // Courant number of max_speed (0: cfl * cfl_scale)
+#ifdef _SPECIALIZE
+  // Compile-time specialised stage picked at init (null: generic code)
+  typedef void (MiniWeatherSimulation::*StageFn)(real *, real *, real *,
+                                                 double, int, real *, real *);
+  StageFn stage_fn = nullptr;
+  bool generic_kernels = false; // --generic-kernels
+#endif
+  bool numa_report = false;    // Print thread binding and page placement
+  // Load balancing of the x split (--balance: measured, --balance-weights:
+  // given) and the max/mean busy time over the process columns it measured
+  bool balance = false;
+  int balance_steps = 10;
+  std::vector<double> balance_weights;
+  double balance_before = 0.;
+  double checkpoint_every = -1; // Model seconds between checkpoints (< 0: off)
+  std::string checkpoint_file = "checkpoint.bin";
+  std::string restart_file; // Checkpoint to resume from (empty: cold start)
 
   // Grid Dimensions
   int nx, nz;
   int i_beg, k_beg;
+  // Strides of the state arrays in doubles: pitch between rows, plane between
+  // variables. pitch is nx + 2 * hx unless --pad-pitch is given
+  int pitch, plane;
 
   // Data Arrays
-  std::vector<double> state, state_tmp;
-  std::vector<double> flux, tend;
+  field_vector state, state_tmp;
+  field_vector flux, tend;
+  // Time-invariant source terms, laid out as tend and added to it by every
+  // stage of the apply loop (or the fused kernels). Empty when no forcing is
+  // active
+  field_vector source;
+  // With --deep-halo, the same terms on the nx + 2 * (hx - hs) columns of the
+  // first stage of the deep x sweep
+  field_vector source_x;
+  // With --deep-halo on the injection case, the fluxes at the global
+  // interfaces 0..hs-1 of the inflow rows as seen by the cells right of them,
+  // on the first rank (side 0) and right of the last rank (side 1), laid out
+  // [2][NUM_VARS][nz][hs]. flux keeps the periodic values there for the cells
+  // left of them
+  std::vector<real> inflow_flux;
   std::vector<double> hy_dens_cell, hy_dens_theta_cell;
   std::vector<double> hy_dens_int, hy_dens_theta_int, hy_pressure_int;
-  std::vector<double> sendbuf_l, sendbuf_r, recvbuf_l, recvbuf_r;
+  std::vector<real> sendbuf_l, sendbuf_r, recvbuf_l, recvbuf_r;
+  std::vector<real> sendbuf_b, sendbuf_t, recvbuf_b, recvbuf_t;
+  MPI_Request halo_req[4]; // In-flight x halo exchange (split-phase mode)
+  MPI_Request *halo_req_active = halo_req; // Requests halo_exchange_x_end waits
+  // Persistent x halo requests, one set for each of state and state_tmp. They
+  // send from and receive into the halo columns of the state array directly
+  // through halo_x_type, so no pack/unpack is needed
+  MPI_Datatype halo_x_type = MPI_DATATYPE_NULL;
+  MPI_Request halo_persist_req[2][4];
+  // --shm-halo: state and state_tmp live in an MPI-3 shared window of the
+  // ranks of this node, and the x halos facing an on-node neighbour are copied
+  // straight from its edge columns. Zero-byte messages with that neighbour
+  // order the copy after its last write and before its next one. The halos
+  // are messaged to msg_left_rank and msg_right_rank, which are MPI_PROC_NULL
+  // on the sides read through the window
+  struct ShmNeighbour {
+    real *buf[2] = {nullptr, nullptr}; // Its state and state_tmp (null: off
+                                       // the node)
+    int nx, pitch, plane;
+  };
+  MPI_Comm node_comm = MPI_COMM_NULL;
+  MPI_Win shm_win = MPI_WIN_NULL;
+  ShmNeighbour shm_nbr[2]; // Left and right
+  int msg_left_rank, msg_right_rank;
+  MPI_Request shm_req[4];
+  // Device backends: the device this rank drives (-1: the host cores, with
+  // MINIWEATHER_HOST_RANKS), its share of the x columns relative to a device
+  // rank, and whether MPI is handed device buffers instead of host copies
+  int device = -1;
+  double col_weight = 1.;
+  int gpu_aware_mpi = 0;
+  bool fields_mapped = false; // map_fields() has put them on the device
 
   // Simulation State
   double etime;
   double output_counter;
+  double checkpoint_counter = 0.;
   int num_out = 0;
   int direction_switch = 1;
   double mass0, te0, mass, te;
+  // Adaptive time step. The first RK stage of each direction raises this
+  // thread's fastest x (|u| + c) and z (|w| + c) signal speeds in its own
+  // cache line of wave_speed; after the step they are combined in one
+  // non-blocking MPI_Iallreduce that completes behind the next step and sets
+  // the time step after that
+  std::vector<double> wave_speed;
+  double wave_speed_loc[2], wave_speed_glob[2] = {0., 0.};
+  MPI_Request wave_speed_req = MPI_REQUEST_NULL;
+  long num_steps = 0;
+  double dt_fixed, dt_lo, dt_hi; // The max_speed time step, dt range used
+  double halo_wait_time = 0.; // Time blocked in the halo MPI_Waitall calls
+  // --overlap: exposed wait of one blocking x halo exchange, timed at start-up,
+  // and the wait hidden behind the interior fluxes. Each exchange hides the
+  // lesser of its interior flux time and that blocking wait
+  double blocking_wait_x = 0.;
+  double overlap_time = 0.;
+  double output_time = 0.;    // Time the run loop spent inside output()
+  TimerRegistry timers;       // Phase timers (--timers)
+  double startup_time[NUM_STARTUP_PHASES] = {}; // init() breakdown (sec)
+  std::chrono::steady_clock::time_point startup_mark;
+  std::string timers_file;    // JSON or CSV timer report (by extension)
+  // In-run conservation diagnostics (--diag-every). On every diag_every-th
+  // step the apply loop of the step's last RK stage also sums each thread's
+  // mass and energy into its cache line of diag_sums. The sums are combined
+  // with an MPI_Iallreduce that completes behind the next step, and logged
+  int diag_every = 0;
+  std::string diag_file = "diagnostics.csv";
+  FILE *diag_log = nullptr;
+  int diag_dir = 0; // Direction of the last stage of a diagnosed step, else 0
+  std::vector<double> diag_sums;
+  double diag_loc[2], diag_glob[2], diag_etime;
+  long diag_step;
+  MPI_Request diag_req = MPI_REQUEST_NULL;
+  // Reduced output. out_var picks which of dens, uwnd, wwnd and theta are
+  // written (--out-vars); the fields are coarsened by out_factor in x and z,
+  // either to every out_factor-th cell (--out-stride) or to the mean of each
+  // out_factor x out_factor block (--out-block), and stored as float with
+  // --out-float. out_i0, out_nx, out_k0 and out_nz are this rank's part of
+  // the out_nx_glob x out_nz_glob output grid
+  bool out_var[4] = {true, true, true, true};
+  int out_nvars = 4;
+  int out_factor = 1;
+  bool out_mean = false;
+  bool out_float = false;
+  int out_nx_glob, out_nz_glob, out_i0, out_nx, out_k0, out_nz;
+  // In-situ analysis. Every insitu_every-th step (and the initial state) each
+  // consumer gets a read-only view of the state; --insitu registers the
+  // built-in ones, which look at field insitu_var
+  std::vector<std::unique_ptr<InSituConsumer>> insitu;
+  std::string insitu_list;
+  int insitu_every = 100;
+  int insitu_var = 3;  // theta
+  int insitu_bins = 16;
+  char insitu_slice_dir = 'z';
+  int insitu_slice_at = -1; // -1: the middle row or column
+  int insitu_width = 512;   // Widest image in pixels
+  std::string insitu_stats_file = "insitu_stats.csv";
+  std::string insitu_slice_file = "insitu_slice.csv";
+  std::string insitu_image_suffix = ".png";
+#ifdef _PNETCDF
+  // Asynchronous output (--async-output). output.nc stays open on io_comm for
+  // the whole run. Each frame's derived fields are copied into one of two
+  // staging buffers and written from there, by a per-rank I/O thread when MPI
+  // provides MPI_THREAD_MULTIPLE, or else as PnetCDF non-blocking puts that
+  // are completed at the next output
+  MPI_Comm io_comm = MPI_COMM_NULL;
+  int out_ncid = -1;
+  int out_varids[5];              // dens, uwnd, wwnd, theta, t
+  std::vector<double> out_stage[2]; // selected planes of out_nz*out_nx
+  double out_etime[2];
+  int out_frame[2];
+  bool out_full[2] = {false, false}; // Staged and not yet written
+  int out_next = 0;                   // Staging buffer for the next frame
+  bool out_threaded = false, out_stop = false;
+  std::thread out_thread;
+  std::mutex out_mtx;
+  std::condition_variable out_cv;
+  int out_req[5], out_nreq = 0; // Non-blocking puts of the unthreaded mode
+#endif
 
   // Member Functions (formerly standalone)
   void init(int *argc, char ***argv);
-  void injection(double x, double z, double &r, double &u, double &w, double &t,
-                 double &hr, double &ht);
-  void density_current(double x, double z, double &r, double &u, double &w,
-                       double &t, double &hr, double &ht);
-  void gravity_waves(double x, double z, double &r, double &u, double &w,
-                     double &t, double &hr, double &ht);
-  void thermal(double x, double z, double &r, double &u, double &w, double &t,
-               double &hr, double &ht);
-  void collision(double x, double z, double &r, double &u, double &w, double &t,
-                 double &hr, double &ht);
-  void hydro_const_theta(double z, double &r, double &t);
-  void hydro_const_bvfreq(double z, double bv_freq0, double &r, double &t);
-  double sample_ellipse_cosine(double x, double z, double amp, double x0,
-                               double z0, double xrad, double zrad);
-  void output(double *state, double etime);
+  void parse_options(int local_argc, char **local_argv);
+  void split_ensemble();
+  template <class Case> void init_case();
+  template <class Case> void init_state();
+  template <class Case> void init_background();
+  void startup_lap(int phase);
+  void report_startup();
+  void report_memory();
+  void zero_fields();
+  void report_numa_placement();
+  void output(real *state, double etime);
+  void setup_insitu();
+  void run_insitu();
+#ifdef _PNETCDF
+  void setup_output_grid();
+  void output_fields(const real *state, double *buf);
+  void output_define(int ncid, int *varids);
+  void output_inq_varids(int ncid, int *varids);
+  void output_block(int frame, MPI_Offset *st, MPI_Offset *ct);
+  void output_async_open();
+  void output_async(real *state, double etime);
+  void output_async_post(int b);
+  void output_async_worker();
+  void output_async_close();
+#endif
   void ncwrap(int ierr, int line);
-  void perform_timestep(double *state, double *state_tmp, double *flux,
-                        double *tend, double dt);
-  void semi_discrete_step(double *state_init, double *state_forcing,
-                          double *state_out, double dt, int dir, double *flux,
-                          double *tend);
-  void compute_tendencies_x(double *state, double *flux, double *tend,
+  void perform_timestep(real *state, real *state_tmp, real *flux,
+                        real *tend, double dt);
+  void split_step(real *state, real *state_tmp, real *flux, real *tend,
+                  double dt);
+  void semi_discrete_step(real *state_init, real *state_forcing,
+                          real *state_out, double dt, int dir, real *flux,
+                          real *tend);
+  void sweep(real *state, real *state_tmp, real *flux, real *tend, double dt,
+             int dir);
+  void deep_sweep_x(real *state, real *state_tmp, real *flux, real *tend,
+                    double dt);
+  void deep_stage_x(real *state_init, real *state_forcing, real *state_out,
+                    double dt, int ext, real *flux, real *tend);
+  bool inflow_row(int k) const;
+  void compute_tendencies_x(real *state, real *flux, real *tend,
                             double dt);
-  void compute_tendencies_z(double *state, double *flux, double *tend,
+  void compute_fluxes_x(real *state, real *flux, double dt, int i_lo,
+                        int i_hi);
+  void fluxes_to_tendencies_x(real *flux, real *tend);
+  void interface_flux_x(const real *state, int k, int i, double hv_coef,
+                        double *f, double *speed = nullptr);
+  void interface_flux_z(const real *state, int k, int i, double hv_coef,
+                        double *f, double *speed = nullptr);
+  // True in the first RK stage of each direction, the one whose forcing is
+  // the state at the start of the direction's sweep
+  bool sample_speed(const real *forcing) const {
+    return adaptive_dt && forcing == state.data();
+  }
+  void record_wave_speed(int dir, double speed);
+  void adapt_dt();
+  SIMD_INLINE void simd_fluxes_x_row(const real *state, real *flux,
+                                     double hv_coef, int k, int i_lo,
+                                     int i_hi);
+  SIMD_INLINE void simd_fluxes_z_row(const real *state, real *flux,
+                                     double hv_coef, int k, int i_lo,
+                                     int i_hi);
+  void fluxes_x_row(const real *state, real *flux, double hv_coef, int k,
+                    int i_lo, int i_hi);
+  void fluxes_z_row(const real *state, real *flux, double hv_coef, int k,
+                    int i_lo, int i_hi);
+#ifdef SIMD_X86
+  void fluxes_x_row_avx2(const real *state, real *flux, double hv_coef,
+                         int k, int i_lo, int i_hi);
+  void fluxes_z_row_avx2(const real *state, real *flux, double hv_coef,
+                         int k, int i_lo, int i_hi);
+  void fluxes_x_row_avx512(const real *state, real *flux, double hv_coef,
+                           int k, int i_lo, int i_hi);
+  void fluxes_z_row_avx512(const real *state, real *flux, double hv_coef,
+                           int k, int i_lo, int i_hi);
+#endif
+  int best_simd_isa();
+  double gravity_wave_forcing(int i, int k);
+  template <class Rate> void add_source(int ll, Rate rate);
+#ifdef _SPECIALIZE
+  template <int DS, int NX, int NZ>
+  void stage_specialized(real *state_init, real *state_forcing,
+                         real *state_out, double dt, int dir, real *flux,
+                         real *tend);
+  template <int DS> StageFn stage_for(bool fixed_grid);
+  void choose_stage();
+#endif
+  void fused_step_x(real *state_init, real *state_forcing,
+                    real *state_out, double dt);
+  void fused_step_z(real *state_init, real *state_forcing,
+                    real *state_out, double dt);
+  void compute_tendencies_z(real *state, real *flux, real *tend,
                             double dt);
-  void set_halo_values_x(double *state);
-  void set_halo_values_z(double *state);
+  void compute_tendencies_z_tiled(real *state, real *flux, real *tend,
+                                  double dt);
+  double time_tendencies_z(int tk, int ti, int reps);
+  double z_state_bytes_per_cell(int tk, int width);
+  void tune_tiles_z();
+  void set_halo_values_x(real *state);
+  void halo_exchange_x_begin(real *state);
+  void post_halo_sends_x();
+  void halo_exchange_x_end(real *state);
+  void set_halo_values_z(real *state);
   void reductions(double &mass, double &te);
+  void cell_mass_energy(const real *state, int k, int i, double &mass,
+                        double &te);
+  void record_diagnostics(double mass, double te);
+  void diagnose_state(const real *state);
+  void post_diagnostics();
+  void log_diagnostics();
+  void time_blocking_halo_x();
+  void report_halo_timing();
+  void report_ensemble(double loop_time);
+  void report_timers();
+  void choose_process_grid();
+  void split_x(const std::vector<double> &weights);
+  void allocate_fields();
+  void init_fields();
+  void balance_x();
+  void report_balance(double loop_time);
+  void init_persistent_halo_x();
+  void allocate_shared_state();
+  void free_shared_state();
+  void benchmark_halo_x();
+  void checkpoint_datatypes(MPI_Datatype &filetype, MPI_Datatype &memtype);
+  void write_checkpoint();
+  void read_checkpoint_header(CheckpointHeader &hdr);
+  void read_checkpoint_state();
+  void bind_device();
+  int query_gpu_aware_mpi();
+  void map_fields();
+  void unmap_fields();
+  void fetch_state(const real *state);
+  void compare_halo_paths();
+  void report_devices(double loop_time);
+  // This rank's block for the Dynamics loops, and the addresses they and MPI
+  // take for a model array: the device copy on a device backend (MPI only
+  // with GPU-aware MPI), else the array itself
+  Grid grid() const { return Grid{nx, nz, hx, pitch, plane, dx, dz}; }
+  template <class T> T *dev(T *p) const {
+    return Backend::ptr(p);
+  }
+  template <class T> T *mpi_buf(T *p) const {
+    return gpu_aware_mpi ? Backend::ptr(p) : p;
+  }
   double dmin(double a, double b) { return (a < b) ? a : b; }
 };
 
@@ -198,64 +804,435 @@ MiniWeatherSimulation::MiniWeatherSimulation(int argc, char **argv) {
 MiniWeatherSimulation::~MiniWeatherSimulation() { Finalize(); }
 
 void MiniWeatherSimulation::Run() {
-  // Initial reductions for mass, kinetic energy, and total energy
-  reductions(mass0, te0);
+  if (halo_bench_iters > 0) {
+    benchmark_halo_x();
+    return;
+  }
+
+  // Time only the run itself, not the set-up (e.g. the --tile auto search)
+  bool timing = timers.enabled;
+  timers = TimerRegistry();
+  timers.enabled = timing;
+  // Nor the signal speeds the set-up kernels measured
+  std::fill(wave_speed.begin(), wave_speed.end(), 0.);
+  double etime0 = etime;
+  dt_lo = dt_hi = dt;
+  if (diag_every > 0 && mainproc) {
+    // A restart appends to the log of the run it continues
+    diag_log = fopen(diag_file.c_str(), restart_file.empty() ? "w" : "a");
+    if (!diag_log) {
+      printf("Error: cannot write %s\n", diag_file.c_str());
+      MPI_Abort(MPI_COMM_WORLD, -1);
+    }
+    if (restart_file.empty()) {
+      fprintf(diag_log, "step,t,mass,te,d_mass,d_te\n");
+    }
+  }
+
+  // Initial reductions for mass, kinetic energy, and total energy. A restart
+  // carries these over from the checkpoint and has already written the
+  // initial frame
+  if (restart_file.empty()) {
+    reductions(mass0, te0);
+  }
 
   // Output the initial state
-  if (output_freq >= 0)
+  if (output_freq >= 0 && restart_file.empty()) {
+    double t0 = MPI_Wtime();
     output(state.data(), etime);
+    output_time += MPI_Wtime() - t0;
+  }
+  if (restart_file.empty()) {
+    run_insitu();
+  }
 
   ////////////////////////////////////////////////////
   // MAIN TIME STEP LOOP
   ////////////////////////////////////////////////////
+  Backend::wait_all();
   auto t1 = std::chrono::steady_clock::now();
   while (etime < sim_time) {
+    dt_lo = dmin(dt_lo, dt);
+    dt_hi = std::max(dt_hi, dt);
     // If the time step leads to exceeding the simulation time, shorten it for
     // the last step
     if (etime + dt > sim_time) {
       dt = sim_time - etime;
     }
+    // Every diag_every-th step is diagnosed in its last RK stage, which runs
+    // in the direction that goes second
+    diag_dir = 0;
+    if (diag_every > 0 && (num_steps + 1) % diag_every == 0) {
+      diag_dir = direction_switch ? DIR_Z : DIR_X;
+    }
     // Perform a single time step
     perform_timestep(state.data(), state_tmp.data(), flux.data(), tend.data(),
                      dt);
     // Inform the user
 #ifndef NO_INFORM
-    if (mainproc) {
+    if (world_main) {
       printf("Elapsed Time: %lf / %lf\n", etime, sim_time);
     }
 #endif
     // Update the elapsed time and output counter
     etime = etime + dt;
     output_counter = output_counter + dt;
+    num_steps++;
+    // Log the diagnostics reduced behind this step, and post this step's
+    log_diagnostics();
+    if (diag_dir) {
+      post_diagnostics();
+    }
     // If it's time for output, reset the counter, and do output
     if (output_freq >= 0 && output_counter >= output_freq) {
       output_counter = output_counter - output_freq;
+      double t0 = MPI_Wtime();
       output(state.data(), etime);
+      output_time += MPI_Wtime() - t0;
+    }
+    if (insitu_every > 0 && num_steps % insitu_every == 0) {
+      run_insitu();
+    }
+    checkpoint_counter = checkpoint_counter + dt;
+    if (adaptive_dt) {
+      adapt_dt();
+    }
+    if (checkpoint_every > 0 && checkpoint_counter >= checkpoint_every) {
+      checkpoint_counter = checkpoint_counter - checkpoint_every;
+      write_checkpoint();
     }
   }
+  Backend::wait_all();
   auto t2 = std::chrono::steady_clock::now();
-  if (mainproc) {
-    std::cout << "CPU Time: " << std::chrono::duration<double>(t2 - t1).count()
-              << " sec\n";
+  log_diagnostics();
+  if (diag_log) {
+    fclose(diag_log);
+    diag_log = nullptr;
+  }
+  double loop_time = std::chrono::duration<double>(t2 - t1).count();
+  if (timers.enabled) {
+    timers.total[TIMER_LOOP] = loop_time;
+    timers.calls[TIMER_LOOP] = 1;
+  }
+  MPI_Wait(&wave_speed_req, MPI_STATUS_IGNORE);
+  if (adaptive_dt && world_main) {
+    // Steps the max_speed time step takes over the same model time
+    long fixed_steps = 0;
+    for (double t = etime0; t < sim_time; t += dmin(dt_fixed, sim_time - t)) {
+      fixed_steps++;
+    }
+    printf("Adaptive dt: %ld steps of %lf to %lf sec; the fixed dt of %lf "
+           "takes %ld, %ld saved\n",
+           num_steps, dt_lo, dt_hi, dt_fixed, fixed_steps,
+           fixed_steps - num_steps);
+  }
+  double run_time = loop_time;
+  if (n_members > 0) {
+    // An ensemble takes as long as its slowest member
+    MPI_Reduce(&loop_time, &run_time, 1, MPI_DOUBLE, MPI_MAX, 0,
+               MPI_COMM_WORLD);
+  }
+  if (world_main) {
+    std::cout << "CPU Time: " << run_time << " sec\n";
+#ifdef _PNETCDF
+    if (output_freq >= 0) {
+      printf("Output time in run loop: %lf sec\n", output_time);
+    }
+#endif
   }
 
   // Final reductions for mass, kinetic energy, and total energy
   reductions(mass, te);
 
-  if (mainproc) {
+  if (n_members > 0) {
+    report_ensemble(loop_time);
+  } else if (mainproc) {
     printf("d_mass: %le\n", (mass - mass0) / mass0);
     printf("d_te:   %le\n", (te - te0) / te0);
   }
+
+  report_halo_timing();
+  report_devices(loop_time);
+  report_balance(loop_time);
+  report_timers();
 }
 
 ///////////////////////////////////////////////////////////////////////////////////////
 // THE MAIN PROGRAM STARTS HERE
 ///////////////////////////////////////////////////////////////////////////////////////
+#ifndef _BENCH
 int main(int argc, char **argv) {
   MiniWeatherSimulation mw(argc, argv);
   mw.Run();
   return 0;
 }
+#else
+// miniWeather_bench: times each kernel of the time step on its own over a
+// range of grids and thread counts, and compares it with a roofline whose
+// ceilings are measured on the spot (or given with --peak-gbs/--peak-gflops).
+// Options not listed below are passed to every MiniWeatherSimulation, so e.g.
+// --pad-pitch or --simd avx2 benchmark those variants
+
+// Sustained memory bandwidth in GB/s, summed over the ranks, of a STREAM triad
+// on three arrays of n doubles per rank, far larger than the caches
+static double bench_stream_gbs(long n, double min_time) {
+  std::vector<double> a(n), b(n), c(n);
+  int nranks;
+  MPI_Comm_size(MPI_COMM_WORLD, &nranks);
+#pragma omp parallel for schedule(static)
+  for (long i = 0; i < n; i++) {
+    a[i] = 0.;
+    b[i] = 1.;
+    c[i] = 2.;
+  }
+  double best = HUGE_VAL;
+  for (double elapsed = 0.; elapsed < min_time;) {
+    MPI_Barrier(MPI_COMM_WORLD);
+    double t0 = MPI_Wtime();
+#pragma omp parallel for schedule(static)
+    for (long i = 0; i < n; i++) {
+      a[i] = b[i] + 3. * c[i];
+    }
+    double t = MPI_Wtime() - t0, tmax;
+    MPI_Allreduce(&t, &tmax, 1, MPI_DOUBLE, MPI_MAX, MPI_COMM_WORLD);
+    best = std::min(best, tmax);
+    elapsed += tmax;
+  }
+  return 3. * sizeof(double) * n * nranks / best * 1e-9;
+}
+
+// Peak arithmetic throughput in GFLOP/s, summed over the ranks, of independent
+// multiply-add chains that the compiler can keep in vector registers: the
+// compute ceiling of code built with this target's flags
+static double bench_peak_gflops(double min_time) {
+  const int lanes = 32, reps = 1 << 20;
+  int nranks;
+  MPI_Comm_size(MPI_COMM_WORLD, &nranks);
+  double best = HUGE_VAL, sink = 0.;
+  for (double elapsed = 0.; elapsed < min_time;) {
+    MPI_Barrier(MPI_COMM_WORLD);
+    double t0 = MPI_Wtime();
+#pragma omp parallel reduction(+ : sink)
+    {
+      double x[lanes];
+      for (int j = 0; j < lanes; j++) {
+        x[j] = j;
+      }
+      for (int r = 0; r < reps; r++) {
+#pragma omp simd
+        for (int j = 0; j < lanes; j++) {
+          x[j] = x[j] * 0.999999 + 1.e-7;
+        }
+      }
+      for (int j = 0; j < lanes; j++) {
+        sink += x[j];
+      }
+    }
+    double t = MPI_Wtime() - t0, tmax;
+    MPI_Allreduce(&t, &tmax, 1, MPI_DOUBLE, MPI_MAX, MPI_COMM_WORLD);
+    best = std::min(best, tmax);
+    elapsed += tmax;
+  }
+  if (sink == 42.) {
+    printf("\n"); // Keeps the chains from being optimised away
+  }
+  return 2. * lanes * reps * max_threads() * nranks / best * 1e-9;
+}
+
+// Comma-separated list of ints, or of NXxNZ pairs
+static std::vector<int> bench_ints(const char *text) {
+  std::vector<int> v;
+  std::stringstream list(text);
+  std::string item;
+  while (std::getline(list, item, ',')) {
+    v.push_back(atoi(item.c_str()));
+  }
+  return v;
+}
+
+// text as the body of a JSON string: quotes, backslashes and control
+// characters escaped
+static std::string json_escape(const std::string &text) {
+  std::string out;
+  for (unsigned char c : text) {
+    if (c == '"' || c == '\\') {
+      out += '\\';
+      out += (char)c;
+    } else if (c < 0x20) {
+      char code[8];
+      snprintf(code, sizeof(code), "\\u%04x", c);
+      out += code;
+    } else {
+      out += (char)c;
+    }
+  }
+  return out;
+}
+
+int main(int argc, char **argv) {
+  std::vector<std::pair<int, int>> sizes = {
+      {100, 50}, {200, 100}, {400, 200}, {800, 400}};
+  std::vector<int> threads = {max_threads()};
+  double min_time = 0.2, peak_gbs = 0., peak_gflops = 0.;
+  long stream_n = 1L << 23;
+  std::string json_file = "bench.json", label;
+  int myrank, nranks, provided;
+
+  for (int i = 1; i < argc; i++) {
+    std::string arg = argv[i];
+    if (arg == "--sizes" && i + 1 < argc) {
+      sizes.clear();
+      std::stringstream list(argv[++i]);
+      std::string item;
+      int nx, nz;
+      while (std::getline(list, item, ',')) {
+        if (sscanf(item.c_str(), "%dx%d", &nx, &nz) != 2 || nx <= 0 ||
+            nz <= 0) {
+          printf("Error: --sizes expects NXxNZ,..., got %s\n", item.c_str());
+          exit(-1);
+        }
+        sizes.push_back({nx, nz});
+      }
+    } else if (arg == "--threads" && i + 1 < argc) {
+      threads = bench_ints(argv[++i]);
+    } else if (arg == "--min-time" && i + 1 < argc) {
+      min_time = atof(argv[++i]);
+    } else if (arg == "--json" && i + 1 < argc) {
+      json_file = argv[++i];
+    } else if (arg == "--label" && i + 1 < argc) {
+      label = argv[++i];
+    } else if (arg == "--peak-gbs" && i + 1 < argc) {
+      peak_gbs = atof(argv[++i]);
+    } else if (arg == "--peak-gflops" && i + 1 < argc) {
+      peak_gflops = atof(argv[++i]);
+    } else if (arg == "--stream-mb" && i + 1 < argc) {
+      stream_n = atol(argv[++i]) * (1L << 20) / (3 * sizeof(double));
+    } else if (arg == "--help" || arg == "-h") {
+      printf("Usage: ./miniWeather_bench [options] [miniWeather_mpi "
+             "options]\n");
+      printf("Options:\n");
+      printf("  --sizes <NXxNZ,...>  Global grids (default: "
+             "100x50,200x100,400x200,800x400)\n");
+      printf("  --threads <int,...>  OpenMP threads per rank (default: "
+             "%d)\n",
+             max_threads());
+      printf("  --min-time <float>   Seconds each measurement runs for "
+             "(default: 0.2)\n");
+      printf("  --json <path>        Results file (default: bench.json)\n");
+      printf("  --label <text>       Stored in the results, e.g. the "
+             "commit\n");
+      printf("  --peak-gbs <float>   Memory ceiling of the roofline "
+             "(default: measured)\n");
+      printf("  --peak-gflops <float>  Compute ceiling (default: "
+             "measured)\n");
+      printf("  --stream-mb <int>    Triad arrays per rank (default: 192)\n");
+      exit(0);
+    }
+  }
+  for (int t : threads) {
+    if (t < 1) {
+      printf("Error: --threads expects positive counts\n");
+      exit(-1);
+    }
+  }
+
+  MPI_Init_thread(&argc, &argv, MPI_THREAD_FUNNELED, &provided);
+  MPI_Comm_rank(MPI_COMM_WORLD, &myrank);
+  MPI_Comm_size(MPI_COMM_WORLD, &nranks);
+#ifdef _OPENMP
+  // The simulations size their per-thread slots for the largest team
+  omp_set_num_threads(*std::max_element(threads.begin(), threads.end()));
+#endif
+
+  // Roofline ceilings for each thread count
+  std::vector<double> gbs(threads.size()), gflops(threads.size());
+  for (size_t t = 0; t < threads.size(); t++) {
+#ifdef _OPENMP
+    omp_set_num_threads(threads[t]);
+#endif
+    gbs[t] = peak_gbs > 0. ? peak_gbs : bench_stream_gbs(stream_n, min_time);
+    gflops[t] = peak_gflops > 0. ? peak_gflops : bench_peak_gflops(min_time);
+  }
+#ifdef _OPENMP
+  omp_set_num_threads(*std::max_element(threads.begin(), threads.end()));
+#endif
+
+  std::vector<BenchRecord> records;
+  for (auto &size : sizes) {
+    std::vector<std::string> args(argv, argv + argc);
+    args.insert(args.end(), {"--nx", std::to_string(size.first), "--nz",
+                             std::to_string(size.second)});
+    std::vector<char *> args_c;
+    for (auto &a : args) {
+      args_c.push_back(&a[0]);
+    }
+    args_c.push_back(nullptr);
+    MiniWeatherSimulation mw(args.size(), args_c.data());
+    mw.benchmark_kernels(threads, min_time, records);
+  }
+
+  if (myrank == 0) {
+    printf("Kernel benchmarks over %d ranks (GB/s and GFLOP/s summed over "
+           "ranks)\n",
+           nranks);
+    for (size_t t = 0; t < threads.size(); t++) {
+      printf("  %d threads: roofline ceilings %.2lf GB/s, %.2lf GFLOP/s\n",
+             threads[t], gbs[t], gflops[t]);
+    }
+    printf("  %-22s %10s %7s %12s %9s %9s %9s %8s\n", "kernel", "grid",
+           "threads", "usec/call", "GB/s", "GFLOP/s", "roofline", "bound");
+    FILE *fp = fopen(json_file.c_str(), "w");
+    if (fp == NULL) {
+      printf("Error: cannot write %s\n", json_file.c_str());
+    } else {
+      fprintf(fp, "{\n  \"label\": \"%s\", \"nranks\": %d, "
+                  "\"real_bytes\": %d,\n",
+              json_escape(label).c_str(), nranks, (int)sizeof(real));
+      fprintf(fp, "  \"ceilings\": [\n");
+      for (size_t t = 0; t < threads.size(); t++) {
+        fprintf(fp,
+                "    {\"threads\": %d, \"gbs\": %.6e, \"gflops\": %.6e}%s\n",
+                threads[t], gbs[t], gflops[t],
+                t + 1 < threads.size() ? "," : "");
+      }
+      fprintf(fp, "  ],\n  \"results\": [\n");
+    }
+    for (size_t r = 0; r < records.size(); r++) {
+      const BenchRecord &b = records[r];
+      size_t t = std::find(threads.begin(), threads.end(), b.threads) -
+                 threads.begin();
+      // The roofline time is the longer of moving the bytes at the memory
+      // ceiling and doing the flops at the compute ceiling
+      double t_mem = b.bytes / (gbs[t] * 1e9);
+      double t_fp = b.flops / (gflops[t] * 1e9);
+      double fraction = std::max(t_mem, t_fp) / b.sec;
+      const char *bound = t_mem >= t_fp ? "memory" : "compute";
+      char grid[32];
+      snprintf(grid, sizeof(grid), "%dx%d", b.nx_glob, b.nz_glob);
+      printf("  %-22s %10s %7d %12.3lf %9.2lf %9.2lf %8.1lf%% %8s\n",
+             b.kernel.c_str(), grid, b.threads, b.sec * 1e6,
+             b.bytes / b.sec * 1e-9, b.flops / b.sec * 1e-9, 100. * fraction,
+             bound);
+      if (fp) {
+        fprintf(fp,
+                "    {\"kernel\": \"%s\", \"nx\": %d, \"nz\": %d, "
+                "\"threads\": %d, \"sec_per_call\": %.6e, \"gbs\": %.6e, "
+                "\"gflops\": %.6e, \"roofline_fraction\": %.6e, "
+                "\"bound\": \"%s\"}%s\n",
+                b.kernel.c_str(), b.nx_glob, b.nz_glob, b.threads, b.sec,
+                b.bytes / b.sec * 1e-9, b.flops / b.sec * 1e-9, fraction,
+                bound, r + 1 < records.size() ? "," : "");
+      }
+    }
+    if (fp) {
+      fprintf(fp, "  ]\n}\n");
+      fclose(fp);
+    }
+  }
+  MPI_Finalize();
+  return 0;
+}
+#endif
 
 // 主函数入口保持不变
 ///////////////////////////////////////////////////////////////////////////////////////
@@ -264,40 +1241,63 @@ int main(int argc, char **argv) {
 
 // x 方向 和 z 方向交替进行，每个方向进行三次 Runge-Kutta 迭代
 
-// Performs a single dimensionally split time step using a simple low-storage
-// three-stage Runge-Kutta time integrator The dimensional splitting is a
+// Performs a single dimensionally split time step using the explicit
+// Runge-Kutta integrator chosen with --integrator (see integrators; the default
+// is a simple low-storage three-stage scheme). The dimensional splitting is a
 // second-order-accurate alternating Strang splitting in which the order of
-// directions is alternated each time step. The Runge-Kutta method used here is
-// defined as follows:
-//  q*     = q[n] + dt/3 * rhs(q[n])
-//  q**    = q[n] + dt/2 * rhs(q*  )
-//  q[n+1] = q[n] + dt/1 * rhs(q** )
-void MiniWeatherSimulation::perform_timestep(double *state, double *state_tmp,
-                                             double *flux, double *tend,
+// directions is alternated each time step.
+// All the stages run inside a single OpenMP parallel region. Every routine
+// reached from semi_discrete_step is called by the whole team: its loops are
+// shared out with orphaned omp for constructs, and its MPI calls are made by
+// the master thread alone (MPI_THREAD_FUNNELED) between barriers. Called
+// outside a parallel region, the same routines run on the calling thread.
+// A device backend queues its kernels from the host thread alone, with no
+// region whose closing barrier would wait for them
+void MiniWeatherSimulation::perform_timestep(real *state, real *state_tmp,
+                                             real *flux, real *tend,
                                              double dt) {
+  if (Backend::device) {
+    split_step(state, state_tmp, flux, tend, dt);
+  } else {
+#pragma omp parallel default(shared)
+    split_step(state, state_tmp, flux, tend, dt);
+  }
+  if (direction_switch) {
+    direction_switch = 0;
+  } else {
+    direction_switch = 1;
+  }
+}
+
+// The two directions of a step, in the order of direction_switch
+void MiniWeatherSimulation::split_step(real *state, real *state_tmp,
+                                       real *flux, real *tend, double dt) {
   if (direction_switch) {
     // x-direction first
-    semi_discrete_step(state, state, state_tmp, dt / 3, DIR_X, flux, tend);
-    semi_discrete_step(state, state_tmp, state_tmp, dt / 2, DIR_X, flux, tend);
-    semi_discrete_step(state, state_tmp, state, dt / 1, DIR_X, flux, tend);
+    sweep(state, state_tmp, flux, tend, dt, DIR_X);
     // z-direction second
-    semi_discrete_step(state, state, state_tmp, dt / 3, DIR_Z, flux, tend);
-    semi_discrete_step(state, state_tmp, state_tmp, dt / 2, DIR_Z, flux, tend);
-    semi_discrete_step(state, state_tmp, state, dt / 1, DIR_Z, flux, tend);
+    sweep(state, state_tmp, flux, tend, dt, DIR_Z);
   } else {
     // z-direction second
-    semi_discrete_step(state, state, state_tmp, dt / 3, DIR_Z, flux, tend);
-    semi_discrete_step(state, state_tmp, state_tmp, dt / 2, DIR_Z, flux, tend);
-    semi_discrete_step(state, state_tmp, state, dt / 1, DIR_Z, flux, tend);
+    sweep(state, state_tmp, flux, tend, dt, DIR_Z);
     // x-direction first
-    semi_discrete_step(state, state, state_tmp, dt / 3, DIR_X, flux, tend);
-    semi_discrete_step(state, state_tmp, state_tmp, dt / 2, DIR_X, flux, tend);
-    semi_discrete_step(state, state_tmp, state, dt / 1, DIR_X, flux, tend);
+    sweep(state, state_tmp, flux, tend, dt, DIR_X);
   }
-  if (direction_switch) {
-    direction_switch = 0;
-  } else {
-    direction_switch = 1;
+}
+
+// One direction of the split step: the stages of the integrator, each with its
+// own halo exchange, or with --deep-halo in x all after a single one
+void MiniWeatherSimulation::sweep(real *state, real *state_tmp, real *flux,
+                                  real *tend, double dt, int dir) {
+  if (dir == DIR_X && hx > hs) {
+    deep_sweep_x(state, state_tmp, flux, tend, dt);
+    return;
+  }
+  real *buf[2] = {state, state_tmp};
+  for (int s = 0; s < integrator->num_stages; s++) {
+    const RKStage &st = integrator->stages[s];
+    semi_discrete_step(buf[st.init], buf[st.forcing], buf[st.out],
+                       dt / st.div, dir, flux, tend);
   }
 }
 
@@ -305,14 +1305,56 @@ void MiniWeatherSimulation::perform_timestep(double *state, double *state_tmp,
 // state_out = state_init + dt * rhs(state_forcing)
 // Meaning the step starts from state_init, computes the rhs using
 // state_forcing, and stores the result in state_out
-void MiniWeatherSimulation::semi_discrete_step(double *state_init,
-                                               double *state_forcing,
-                                               double *state_out, double dt,
-                                               int dir, double *flux,
-                                               double *tend) {
-  int i, k, ll, inds, indt, indw;
-  double x, z, wpert, dist, x0, z0, xrad, zrad, amp;
-  if (dir == DIR_X) {
+void MiniWeatherSimulation::semi_discrete_step(real *state_init,
+                                               real *state_forcing,
+                                               real *state_out, double dt,
+                                               int dir, real *flux,
+                                               real *tend) {
+  // The last stage of a diagnosed step also sums the mass and energy
+  const bool diag = (dir == diag_dir && state_out == state.data());
+  if (dir == DIR_X && fused) {
+    set_halo_values_x(state_forcing);
+    fused_step_x(state_init, state_forcing, state_out, dt);
+    if (diag) {
+      diagnose_state(state_out);
+    }
+    return;
+  }
+  if (dir == DIR_Z && fused_z) {
+    set_halo_values_z(state_forcing);
+    fused_step_z(state_init, state_forcing, state_out, dt);
+    if (diag) {
+      diagnose_state(state_out);
+    }
+    return;
+  }
+#ifdef _SPECIALIZE
+  // The generic stage is bitwise identical, and its apply loop diagnoses
+  if (stage_fn && !diag) {
+    if (dir == DIR_X) {
+      set_halo_values_x(state_forcing);
+    } else {
+      set_halo_values_z(state_forcing);
+    }
+    (this->*stage_fn)(state_init, state_forcing, state_out, dt, dir, flux,
+                      tend);
+    return;
+  }
+#endif
+  if (dir == DIR_X && overlap) {
+    // Split-phase: post the halo exchange, compute the interfaces whose
+    // stencils lie entirely inside this rank while the messages are in flight,
+    // then finish only the hs interfaces on each side that read halo cells
+    halo_exchange_x_begin(state_forcing);
+    double t0 = MPI_Wtime();
+    compute_fluxes_x(state_forcing, flux, dt, hs, nx - hs);
+#pragma omp master
+    overlap_time += std::min(MPI_Wtime() - t0, blocking_wait_x);
+    halo_exchange_x_end(state_forcing);
+    compute_fluxes_x(state_forcing, flux, dt, 0, std::min(hs, nx + 1) - 1);
+    compute_fluxes_x(state_forcing, flux, dt, std::max(hs, nx - hs + 1), nx);
+    fluxes_to_tendencies_x(flux, tend);
+  } else if (dir == DIR_X) {
     // Set the halo values for this MPI task's fluid state in the x-direction
     set_halo_values_x(state_forcing);
     // Compute the time tendencies for the fluid state in the x-direction
@@ -324,48 +1366,183 @@ void MiniWeatherSimulation::semi_discrete_step(double *state_init,
     compute_tendencies_z(state_forcing, flux, tend, dt);
   }
 
-  /////////////////////////////////////////////////
-  // TODO: THREAD ME
-  /////////////////////////////////////////////////
-  // Apply the tendencies to the fluid state
-  for (ll = 0; ll < NUM_VARS; ll++) {
+  // Apply the tendencies, plus the source terms if any forcing is active, to
+  // the fluid state. The static schedule over the nz x nx cells matches the
+  // tendency loops, which therefore end without a barrier
+  ScopedTimer timer(timers, TIMER_APPLY);
+  const real *src = source.empty() ? nullptr : dev(source.data());
+  if (diag) {
+    double mass_loc, te_loc;
+    Dyn::apply_diagnosed(grid(), Q_MAIN, dev(state_init), dev(tend), src,
+                         dev(state_out), dt, dev(hy_dens_cell.data()),
+                         dev(hy_dens_theta_cell.data()), mass_loc, te_loc);
+    record_diagnostics(mass_loc, te_loc);
+  } else {
+    Dyn::apply(grid(), Q_MAIN, dev(state_init), dev(tend), src,
+               dev(state_out), dt);
+  }
+}
+
+// The x-direction stages of a time step with --deep-halo. One exchange fills
+// hx = hs * num_stages halo columns, and each stage also computes, redundantly,
+// the cells of its neighbours that the later stages read: with rk3, 2 * hs
+// columns on each side in the first stage, hs in the second and none in the
+// last. Each cell sees the same arithmetic on the same values as with an
+// exchange per stage, so the state matches the default path bitwise
+void MiniWeatherSimulation::deep_sweep_x(real *state, real *state_tmp,
+                                         real *flux, real *tend, double dt) {
+  real *buf[2] = {state, state_tmp};
+  set_halo_values_x(state);
+  for (int s = 0; s < integrator->num_stages; s++) {
+    const RKStage &st = integrator->stages[s];
+    const int ext = (integrator->num_stages - 1 - s) * hs;
+    deep_stage_x(buf[st.init], buf[st.forcing], buf[st.out], dt / st.div, ext,
+                 flux, tend);
+  }
+}
+
+// One stage of the deep x sweep, state_out = state_init + dt *
+// rhs_x(state_forcing), on the interior cells and ext columns either side.
+// flux and tend hold rows of nx + 2 * (hx - hs) cells, the width of the first
+// stage, whatever ext is
+void MiniWeatherSimulation::deep_stage_x(real *state_init,
+                                         real *state_forcing,
+                                         real *state_out, double dt, int ext,
+                                         real *flux, real *tend) {
+  int i, k, ll, c, inds, indt, indf;
+  double f[NUM_VARS], hv_coef;
+  const int off = hx - hs, nw = nx + 2 * off;
+  const bool diag = (diag_dir == DIR_X && state_out == state.data());
+  {
+    ScopedTimer timer(timers, TIMER_TEND_X);
+    // Compute the hyperviscosity coefficient
+    hv_coef = -hyperviscosity * dx / (16 * dt);
+    // The signal speeds are only sampled at this rank's own interfaces
+    double speed = 0.;
+    double *track = sample_speed(state_forcing) ? &speed : nullptr;
+#pragma omp for collapse(2) private(ll, f)
+    for (k = 0; k < nz; k++) {
+      for (i = -ext; i <= nx + ext; i++) {
+        bool own =
+            i >= 0 && i <= nx && !(i < hs && i_beg == 0 && inflow_row(k));
+        interface_flux_x(state_forcing, k, i, hv_coef, f,
+                         own ? track : nullptr);
+        for (ll = 0; ll < NUM_VARS; ll++) {
+          flux[ll * nz * (nw + 1) + k * (nw + 1) + i + off] = f[ll];
+        }
+      }
+    }
+    // The x halos keep the periodic values, which the redundant cells need, so
+    // the inflow interfaces (global 0..hs-1) of the injection case are
+    // computed again on a copy of their stencils with the inflow that
+    // halo_exchange_x_end would have set on the first rank. They go to
+    // inflow_flux[side] and are used only by the cells right of global
+    // interface 0: the first rank's own cells 0..hs-1 (side 0) and the ghost
+    // cells standing for them right of the last rank (side 1). The cells left
+    // of it keep the periodic flux, as on the last rank
+    const bool injection = data_spec_int == DATA_SPEC_INJECTION;
+    const bool inflow[2] = {injection && i_beg == 0,
+                            injection && i_beg + nx == nx_glob};
+    for (int side = 0; side < 2; side++) {
+      if (!inflow[side]) {
+        continue;
+      }
+      const int c0 = side ? nx - hs : -hs; // First column of the stencils
+      real *fi = &inflow_flux[side * NUM_VARS * nz * hs];
+#pragma omp for private(i, ll, c, f)
+      for (k = 0; k < nz; k++) {
+        if (!inflow_row(k)) {
+          continue;
+        }
+        real cells[NUM_VARS][3 * hs - 1]; // Columns c0 .. c0 + 3 * hs - 2
+        for (ll = 0; ll < NUM_VARS; ll++) {
+          for (c = 0; c < 3 * hs - 1; c++) {
+            cells[ll][c] =
+                state_forcing[ll * plane + (k + hs) * pitch + c0 + c + hx];
+          }
+        }
+        for (c = 0; c < hs; c++) {
+          double r = cells[ID_DENS][c] + hy_dens_cell[k + hs];
+          cells[ID_UMOM][c] = r * 50.;
+          cells[ID_RHOT][c] = r * 298. - hy_dens_theta_cell[k + hs];
+        }
+        for (i = 0; i < hs; i++) {
+          double vals[NUM_VARS], d3_vals[NUM_VARS];
+          for (ll = 0; ll < NUM_VARS; ll++) {
+            reconstruct(&cells[ll][i], 1, vals[ll], d3_vals[ll]);
+          }
+          flux_x(vals, d3_vals, hy_dens_cell[k + hs],
+                 hy_dens_theta_cell[k + hs], hv_coef, f,
+                 side ? nullptr : track);
+          for (ll = 0; ll < NUM_VARS; ll++) {
+            fi[ll * nz * hs + k * hs + i] = f[ll];
+          }
+        }
+      }
+    }
+    if (track) {
+      record_wave_speed(DIR_X, speed);
+    }
+
+    // Tendencies on the cells that the apply loop below updates, with its
+    // schedule
+#pragma omp for collapse(2) schedule(static) nowait
     for (k = 0; k < nz; k++) {
-      for (i = 0; i < nx; i++) {
-        if (data_spec_int == DATA_SPEC_GRAVITY_WAVES) {
-          x = (i_beg + i + 0.5) * dx;
-          z = (k_beg + k + 0.5) * dz;
-          // Using sample_ellipse_cosine requires "acc routine" in OpenACC and
-          // "declare target" in OpenMP offload Neither of these are
-          // particularly well supported. So I'm manually inlining here wpert =
-          // sample_ellipse_cosine( x,z , 0.01 , xlen/8,1000., 500.,500. );
-          {
-            x0 = xlen / 8;
-            z0 = 1000;
-            xrad = 500;
-            zrad = 500;
-            amp = 0.01;
-            // Compute distance from bubble center
-            dist = sqrt(((x - x0) / xrad) * ((x - x0) / xrad) +
-                        ((z - z0) / zrad) * ((z - z0) / zrad)) *
-                   pi / 2.;
-            // If the distance from bubble center is less than the radius,
-            // create a cos**2 profile
-            if (dist <= pi / 2.) {
-              wpert = amp * pow(cos(dist), 2.);
-            } else {
-              wpert = 0.;
-            }
+      for (i = -ext; i < nx + ext; i++) {
+        // Local index of global interface 0 left of this cell, if the cell
+        // is one of the hs updated from inflow_flux
+        int side = -1, j = 0;
+        if (inflow[0] && i >= 0 && i < hs && inflow_row(k)) {
+          side = 0;
+          j = i;
+        } else if (inflow[1] && i >= nx && i < nx + hs && inflow_row(k)) {
+          side = 1;
+          j = i - nx;
+        }
+        for (ll = 0; ll < NUM_VARS; ll++) {
+          indt = ll * nz * nw + k * nw + i + off;
+          indf = ll * nz * (nw + 1) + k * (nw + 1) + i + off;
+          double fl = flux[indf], fr = flux[indf + 1];
+          if (side >= 0) {
+            const real *fi =
+                &inflow_flux[side * NUM_VARS * nz * hs + ll * nz * hs + k * hs];
+            fl = fi[j];
+            fr = j + 1 < hs ? fi[j + 1] : fr;
           }
-          indw = ID_WMOM * nz * nx + k * nx + i;
-          tend[indw] += wpert * hy_dens_cell[hs + k];
+          tend[indt] = -(fr - fl) / dx;
         }
-        inds = ll * (nz + 2 * hs) * (nx + 2 * hs) + (k + hs) * (nx + 2 * hs) +
-               i + hs;
-        indt = ll * nz * nx + k * nx + i;
-        state_out[inds] = state_init[inds] + dt * tend[indt];
       }
     }
   }
+
+  ScopedTimer timer(timers, TIMER_APPLY);
+  const real *src = source_x.empty() ? nullptr : source_x.data();
+  double mass_loc = 0., te_loc = 0.;
+#pragma omp for collapse(2) schedule(static) private(ll, inds, indt)
+  for (k = 0; k < nz; k++) {
+    for (i = -ext; i < nx + ext; i++) {
+      for (ll = 0; ll < NUM_VARS; ll++) {
+        inds = ll * plane + (k + hs) * pitch + i + hx;
+        indt = ll * nz * nw + k * nw + i + off;
+        state_out[inds] = src ? state_init[inds] + dt * (tend[indt] + src[indt])
+                              : state_init[inds] + dt * tend[indt];
+      }
+      if (diag) {
+        cell_mass_energy(state_out, k, i, mass_loc, te_loc);
+      }
+    }
+  }
+  if (diag) {
+    record_diagnostics(mass_loc, te_loc);
+  }
+}
+
+// Whether interior row k lies in the inflow jet of the injection case, which
+// enters through the left boundary of the first rank in x
+bool MiniWeatherSimulation::inflow_row(int k) const {
+  double z = (k_beg + k + 0.5) * dz;
+  return data_spec_int == DATA_SPEC_INJECTION &&
+         fabs(z - 3 * zlen / 4) <= zlen / 16;
 }
 
 // Compute the time tendencies of the fluid state using forcing in the
@@ -373,72 +1550,58 @@ void MiniWeatherSimulation::semi_discrete_step(double *state_init,
 // require MPI First, compute the flux vector at each cell interface in the
 // x-direction (including hyperviscosity) Then, compute the tendencies using
 // those fluxes
-void MiniWeatherSimulation::compute_tendencies_x(double *state, double *flux,
-                                                 double *tend, double dt) {
-  int i, k, ll, s, inds, indf1, indf2, indt;
-  double r, u, w, t, p, stencil[4], d3_vals[NUM_VARS], vals[NUM_VARS], hv_coef;
+void MiniWeatherSimulation::compute_tendencies_x(real *state, real *flux,
+                                                 real *tend, double dt) {
+  compute_fluxes_x(state, flux, dt, 0, nx);
+  fluxes_to_tendencies_x(flux, tend);
+}
+
+// Compute the x-direction flux vector (including hyperviscosity) at the cell
+// interfaces i_lo..i_hi (inclusive). Interface i reads the padded columns
+// i..i+sten_size-1, so interfaces hs..nx-hs touch no halo cells and can be
+// computed before the halo exchange completes
+void MiniWeatherSimulation::compute_fluxes_x(real *state, real *flux,
+                                             double dt, int i_lo, int i_hi) {
+  ScopedTimer timer(timers, TIMER_TEND_X);
+  int k;
+  double hv_coef;
   // Compute the hyperviscosity coefficient
-  hv_coef = -hv_beta * dx / (16 * dt);
-  /////////////////////////////////////////////////
-  // TODO: THREAD ME
-  /////////////////////////////////////////////////
-  // Compute fluxes in the x-direction for each cell
-#pragma omp parallel for collapse(2) default(shared) private(                  \
-    ll, s, r, u, w, t, p, stencil, d3_vals, vals, inds)
-  for (k = 0; k < nz; k++) {
-    for (i = 0; i < nx + 1; i++) {
-      // Use fourth-order interpolation from four cell averages to compute the
-      // value at the interface in question
-      for (ll = 0; ll < NUM_VARS; ll++) {
-        for (s = 0; s < sten_size; s++) {
-          inds = ll * (nz + 2 * hs) * (nx + 2 * hs) + (k + hs) * (nx + 2 * hs) +
-                 i + s;
-          stencil[s] = state[inds];
-        }
-        // Fourth-order-accurate interpolation of the state
-        vals[ll] = -stencil[0] / 12 + 7 * stencil[1] / 12 +
-                   7 * stencil[2] / 12 - stencil[3] / 12;
-        // First-order-accurate interpolation of the third spatial derivative of
-        // the state (for artificial viscosity)
-        d3_vals[ll] =
-            -stencil[0] + 3 * stencil[1] - 3 * stencil[2] + stencil[3];
-      }
-
-      // Compute density, u-wind, w-wind, potential temperature, and pressure
-      // (r,u,w,t,p respectively)
-      r = vals[ID_DENS] + hy_dens_cell[k + hs];
-      u = vals[ID_UMOM] / r;
-      w = vals[ID_WMOM] / r;
-      t = (vals[ID_RHOT] + hy_dens_theta_cell[k + hs]) / r;
-      p = C0 * pow((r * t), gamm);
-
-      // Compute the flux vector
-      flux[ID_DENS * (nz + 1) * (nx + 1) + k * (nx + 1) + i] =
-          r * u - hv_coef * d3_vals[ID_DENS];
-      flux[ID_UMOM * (nz + 1) * (nx + 1) + k * (nx + 1) + i] =
-          r * u * u + p - hv_coef * d3_vals[ID_UMOM];
-      flux[ID_WMOM * (nz + 1) * (nx + 1) + k * (nx + 1) + i] =
-          r * u * w - hv_coef * d3_vals[ID_WMOM];
-      flux[ID_RHOT * (nz + 1) * (nx + 1) + k * (nx + 1) + i] =
-          r * u * t - hv_coef * d3_vals[ID_RHOT];
-    }
-  }
-
-  /////////////////////////////////////////////////
-  // TODO: THREAD ME
-  /////////////////////////////////////////////////
-  // Use the fluxes to compute tendencies for each cell
-#pragma omp parallel for collapse(3) default(shared) private(indt, indf1, indf2)
-  for (ll = 0; ll < NUM_VARS; ll++) {
+  hv_coef = -hyperviscosity * dx / (16 * dt);
+  if (simd_isa != SIMD_NONE) {
+#pragma omp for
     for (k = 0; k < nz; k++) {
-      for (i = 0; i < nx; i++) {
-        indt = ll * nz * nx + k * nx + i;
-        indf1 = ll * (nz + 1) * (nx + 1) + k * (nx + 1) + i;
-        indf2 = ll * (nz + 1) * (nx + 1) + k * (nx + 1) + i + 1;
-        tend[indt] = -(flux[indf2] - flux[indf1]) / dx;
-      }
+      fluxes_x_row(state, flux, hv_coef, k, i_lo, i_hi + 1);
     }
+    return;
   }
+  // Compute fluxes in the x-direction for each cell
+  const bool track = sample_speed(state);
+  double speed = Dyn::fluxes_x(grid(), Q_MAIN, dev(state), dev(flux),
+                               dev(hy_dens_cell.data()),
+                               dev(hy_dens_theta_cell.data()), hv_coef, i_lo,
+                               i_hi, track);
+  if (track) {
+    record_wave_speed(DIR_X, speed);
+  }
+}
+
+// Compute the x-direction flux vector f (including hyperviscosity) at interface
+// i of interior row k, from a fourth-order interpolation of the four cell
+// averages straddling it
+inline void MiniWeatherSimulation::interface_flux_x(const real *state, int k,
+                                                    int i, double hv_coef,
+                                                    double *f, double *speed) {
+  Dyn::interface_flux_x(grid(), state, hy_dens_cell.data(),
+                        hy_dens_theta_cell.data(), k, i, hv_coef, f, speed);
+}
+
+// Use the x-direction fluxes to compute tendencies for each cell. Each thread
+// takes the same cells as in the apply loop that follows, so no barrier is
+// needed before it
+void MiniWeatherSimulation::fluxes_to_tendencies_x(real *flux,
+                                                   real *tend) {
+  ScopedTimer timer(timers, TIMER_TEND_X);
+  Dyn::tendencies_x(grid(), Q_MAIN, dev(flux), dev(tend));
 }
 
 // Compute the time tendencies of the fluid state using forcing in the
@@ -446,257 +1609,1262 @@ void MiniWeatherSimulation::compute_tendencies_x(double *state, double *flux,
 // require MPI First, compute the flux vector at each cell interface in the
 // z-direction (including hyperviscosity) Then, compute the tendencies using
 // those fluxes
-void MiniWeatherSimulation::compute_tendencies_z(double *state, double *flux,
-                                                 double *tend, double dt) {
-  int i, k, ll, s, inds, indf1, indf2, indt;
-  double r, u, w, t, p, stencil[4], d3_vals[NUM_VARS], vals[NUM_VARS], hv_coef;
+void MiniWeatherSimulation::compute_tendencies_z(real *state, real *flux,
+                                                 real *tend, double dt) {
+  ScopedTimer timer(timers, TIMER_TEND_Z);
+  int k;
+  double hv_coef;
+  if (tile_k > 0) {
+    compute_tendencies_z_tiled(state, flux, tend, dt);
+    return;
+  }
   // Compute the hyperviscosity coefficient
-  hv_coef = -hv_beta * dz / (16 * dt);
-  /////////////////////////////////////////////////
-  // TODO: THREAD ME
-  /////////////////////////////////////////////////
-  // Compute fluxes in the x-direction for each cell
-#pragma omp parallel for collapse(2) default(shared) private(                  \
-    ll, s, inds, stencil, vals, d3_vals, r, u, w, t, p)
-  for (k = 0; k < nz + 1; k++) {
-    for (i = 0; i < nx; i++) {
-      // Use fourth-order interpolation from four cell averages to compute the
-      // value at the interface in question
-      for (ll = 0; ll < NUM_VARS; ll++) {
-        for (s = 0; s < sten_size; s++) {
-          inds = ll * (nz + 2 * hs) * (nx + 2 * hs) + (k + s) * (nx + 2 * hs) +
-                 i + hs;
-          stencil[s] = state[inds];
+  hv_coef = -hyperviscosity * dz / (16 * dt);
+  // Compute fluxes in the z-direction for each cell
+  if (simd_isa != SIMD_NONE) {
+#pragma omp for
+    for (k = 0; k < nz + 1; k++) {
+      fluxes_z_row(state, flux, hv_coef, k, 0, nx);
+    }
+  } else {
+    // The model top and bottom are only walls on the ranks that own them
+    const bool track = sample_speed(state);
+    double speed = Dyn::fluxes_z(
+        grid(), Q_MAIN, dev(state), dev(flux), dev(hy_dens_int.data()),
+        dev(hy_dens_theta_int.data()), dev(hy_pressure_int.data()), hv_coef,
+        k_beg == 0, k_beg + nz == nz_glob, track);
+    if (track) {
+      record_wave_speed(DIR_Z, speed);
+    }
+  }
+
+  // Use the fluxes to compute tendencies for each cell, on the same cells per
+  // thread as the apply loop that follows
+  Dyn::tendencies_z(grid(), Q_MAIN, dev(state), dev(flux), dev(tend));
+}
+
+// Cache-blocked compute_tendencies_z. The interfaces are cut into tile_k x
+// tile_i blocks that each thread sweeps bottom to top, so the four stencil rows
+// of all NUM_VARS planes stay in cache from one interface row to the next
+// instead of being streamed in again for every row. The tendency pass walks
+// the same blocks with the same static schedule, so each thread reads back the
+// flux rows it wrote. The arithmetic matches the untiled path exactly
+void MiniWeatherSimulation::compute_tendencies_z_tiled(real *state,
+                                                       real *flux,
+                                                       real *tend,
+                                                       double dt) {
+  int i, k, ll, t, k0, i0, k1, i1, inds, indf1, indf2, indt;
+  double f[NUM_VARS], hv_coef;
+  // Tiles cover the nz + 1 interface rows; the tendency pass uses the first nz
+  int ntk = (nz + tile_k) / tile_k;
+  int nti = (nx + tile_i - 1) / tile_i;
+  // Compute the hyperviscosity coefficient
+  hv_coef = -hyperviscosity * dz / (16 * dt);
+  // Compute fluxes in the z-direction for each cell
+  double speed = 0.;
+  double *track = sample_speed(state) ? &speed : nullptr;
+#pragma omp for schedule(static) private(i, k, ll, k0, i0, k1, i1, f)
+  for (t = 0; t < ntk * nti; t++) {
+    k0 = (t / nti) * tile_k;
+    i0 = (t % nti) * tile_i;
+    k1 = std::min(k0 + tile_k, nz + 1);
+    i1 = std::min(i0 + tile_i, nx);
+    for (k = k0; k < k1; k++) {
+      if (simd_isa != SIMD_NONE) {
+        fluxes_z_row(state, flux, hv_coef, k, i0, i1);
+        continue;
+      }
+      for (i = i0; i < i1; i++) {
+        interface_flux_z(state, k, i, hv_coef, f, track);
+        for (ll = 0; ll < NUM_VARS; ll++) {
+          flux[ll * (nz + 1) * (nx + 1) + k * (nx + 1) + i] = f[ll];
         }
-        // Fourth-order-accurate interpolation of the state
-        vals[ll] = -stencil[0] / 12 + 7 * stencil[1] / 12 +
-                   7 * stencil[2] / 12 - stencil[3] / 12;
-        // First-order-accurate interpolation of the third spatial derivative of
-        // the state
-        d3_vals[ll] =
-            -stencil[0] + 3 * stencil[1] - 3 * stencil[2] + stencil[3];
-      }
-
-      // Compute density, u-wind, w-wind, potential temperature, and pressure
-      // (r,u,w,t,p respectively)
-      r = vals[ID_DENS] + hy_dens_int[k];
-      u = vals[ID_UMOM] / r;
-      w = vals[ID_WMOM] / r;
-      t = (vals[ID_RHOT] + hy_dens_theta_int[k]) / r;
-      p = C0 * pow((r * t), gamm) - hy_pressure_int[k];
-      // Enforce vertical boundary condition and exact mass conservation
-      if (k == 0 || k == nz) {
-        w = 0;
-        d3_vals[ID_DENS] = 0;
-      }
-
-      // Compute the flux vector with hyperviscosity
-      flux[ID_DENS * (nz + 1) * (nx + 1) + k * (nx + 1) + i] =
-          r * w - hv_coef * d3_vals[ID_DENS];
-      flux[ID_UMOM * (nz + 1) * (nx + 1) + k * (nx + 1) + i] =
-          r * w * u - hv_coef * d3_vals[ID_UMOM];
-      flux[ID_WMOM * (nz + 1) * (nx + 1) + k * (nx + 1) + i] =
-          r * w * w + p - hv_coef * d3_vals[ID_WMOM];
-      flux[ID_RHOT * (nz + 1) * (nx + 1) + k * (nx + 1) + i] =
-          r * w * t - hv_coef * d3_vals[ID_RHOT];
-    }
-  }
-
-  /////////////////////////////////////////////////
-  // TODO: THREAD ME
-  /////////////////////////////////////////////////
+      }
+    }
+  }
+  if (track) {
+    record_wave_speed(DIR_Z, speed);
+  }
+
   // Use the fluxes to compute tendencies for each cell
-#pragma omp parallel for collapse(3) default(shared) private(indt, indf1,      \
-                                                             indf2, inds)
-  for (ll = 0; ll < NUM_VARS; ll++) {
-    for (k = 0; k < nz; k++) {
-      for (i = 0; i < nx; i++) {
-        indt = ll * nz * nx + k * nx + i;
-        indf1 = ll * (nz + 1) * (nx + 1) + (k) * (nx + 1) + i;
-        indf2 = ll * (nz + 1) * (nx + 1) + (k + 1) * (nx + 1) + i;
-        tend[indt] = -(flux[indf2] - flux[indf1]) / dz;
-        if (ll == ID_WMOM) {
-          inds = ID_DENS * (nz + 2 * hs) * (nx + 2 * hs) +
-                 (k + hs) * (nx + 2 * hs) + i + hs;
-          tend[indt] = tend[indt] - state[inds] * grav;
+#pragma omp for schedule(static)                                             \
+    private(i, k, ll, k0, i0, k1, i1, indt, indf1, indf2, inds)
+  for (t = 0; t < ntk * nti; t++) {
+    k0 = (t / nti) * tile_k;
+    i0 = (t % nti) * tile_i;
+    k1 = std::min(k0 + tile_k, nz);
+    i1 = std::min(i0 + tile_i, nx);
+    for (ll = 0; ll < NUM_VARS; ll++) {
+      for (k = k0; k < k1; k++) {
+        for (i = i0; i < i1; i++) {
+          indt = ll * nz * nx + k * nx + i;
+          indf1 = ll * (nz + 1) * (nx + 1) + (k) * (nx + 1) + i;
+          indf2 = ll * (nz + 1) * (nx + 1) + (k + 1) * (nx + 1) + i;
+          tend[indt] = -(flux[indf2] - flux[indf1]) / dz;
+          if (ll == ID_WMOM) {
+            inds = ID_DENS * plane + (k + hs) * pitch + i + hx;
+            tend[indt] = tend[indt] - state[inds] * grav;
+          }
         }
       }
     }
   }
 }
 
-// Set this MPI task's halo values in the x-direction. This routine will require
-// MPI
-void MiniWeatherSimulation::set_halo_values_x(double *state) {
-  int k, ll, ind_r, ind_u, ind_t, i, s, ierr;
-  double z;
+// Wall-clock seconds per compute_tendencies_z call with a tk x ti tile (tk = 0
+// for the untiled loop), best of reps after one warm-up call and the slowest
+// over all ranks. Only flux and tend are written, so this is safe during init
+double MiniWeatherSimulation::time_tendencies_z(int tk, int ti, int reps) {
+  int tk_save = tile_k, ti_save = tile_i;
+  double t0, best = 1.e30, best_glob;
+  tile_k = tk;
+  tile_i = ti;
+#pragma omp parallel
+  compute_tendencies_z(state.data(), flux.data(), tend.data(), dt);
+  for (int r = 0; r < reps; r++) {
+    t0 = MPI_Wtime();
+#pragma omp parallel
+    compute_tendencies_z(state.data(), flux.data(), tend.data(), dt);
+    best = std::min(best, MPI_Wtime() - t0);
+  }
+  tile_k = tk_save;
+  tile_i = ti_save;
+  MPI_Allreduce(&best, &best_glob, 1, MPI_DOUBLE, MPI_MAX, comm);
+  return best_glob;
+}
 
-  if (nranks == 1) { // 如果只有一进程，则不需要 MPI 通信
+// Modelled state bytes read from beyond the per-core L2 for each interface of
+// the z flux pass, when a thread sweeps tk interface rows of width columns. If
+// the sten_size-row window of every variable fits in L2, each value is read
+// from memory once per sweep plus the sten_size - 1 rows above the block;
+// otherwise every stencil read misses. tk = 0 means the untiled loop, where a
+// thread owns whole rows and the boundary rows are negligible
+double MiniWeatherSimulation::z_state_bytes_per_cell(int tk, int width) {
+  long l2 = sysconf(_SC_LEVEL2_CACHE_SIZE);
+  double window = (double)sten_size * NUM_VARS * width * sizeof(real);
+  if (l2 <= 0) {
+    l2 = 1024 * 1024;
+  }
+  if (window > l2) {
+    return (double)sten_size * NUM_VARS * sizeof(real);
+  }
+  if (tk == 0) {
+    return (double)NUM_VARS * sizeof(real);
+  }
+  return (double)NUM_VARS * sizeof(real) * (tk + sten_size - 1) / tk;
+}
 
-    for (ll = 0; ll < NUM_VARS; ll++) {
-      for (k = 0; k < nz; k++) {
-        state[ll * (nz + 2 * hs) * (nx + 2 * hs) + (k + hs) * (nx + 2 * hs) +
-              0] = state[ll * (nz + 2 * hs) * (nx + 2 * hs) +
-                         (k + hs) * (nx + 2 * hs) + nx + hs - 2];
-        state[ll * (nz + 2 * hs) * (nx + 2 * hs) + (k + hs) * (nx + 2 * hs) +
-              1] = state[ll * (nz + 2 * hs) * (nx + 2 * hs) +
-                         (k + hs) * (nx + 2 * hs) + nx + hs - 1];
-        state[ll * (nz + 2 * hs) * (nx + 2 * hs) + (k + hs) * (nx + 2 * hs) +
-              nx + hs] = state[ll * (nz + 2 * hs) * (nx + 2 * hs) +
-                               (k + hs) * (nx + 2 * hs) + hs];
-        state[ll * (nz + 2 * hs) * (nx + 2 * hs) + (k + hs) * (nx + 2 * hs) +
-              nx + hs + 1] = state[ll * (nz + 2 * hs) * (nx + 2 * hs) +
-                                   (k + hs) * (nx + 2 * hs) + hs + 1];
+// Choose the compute_tendencies_z tile (--tile auto) by timing a set of
+// candidates, including the untiled loop, then report the modelled state
+// traffic and the measured cost per cell of the chosen tile against the
+// untiled loop
+void MiniWeatherSimulation::tune_tiles_z() {
+  const int tks[] = {4, 8, 16, 32};
+  const int tis[] = {64, 128, 256, 512, 1024};
+  const int reps = 3;
+  double t, t_untiled, t_best;
+  double cells = (double)(nz + 1) * nx;
+
+  t_untiled = time_tendencies_z(0, 0, reps);
+  if (tile_auto) {
+    tile_k = 0;
+    tile_i = 0;
+    t_best = t_untiled;
+    for (int tk : tks) {
+      for (int ti : tis) {
+        ti = std::min(ti, nx);
+        t = time_tendencies_z(tk, ti, reps);
+        if (t < t_best) {
+          t_best = t;
+          tile_k = tk;
+          tile_i = ti;
+        }
+        if (ti == nx) {
+          break;
+        }
       }
     }
+  } else {
+    t_best = time_tendencies_z(tile_k, tile_i, reps);
+  }
+  if (world_main) {
+    if (tile_k > 0) {
+      printf("z tile (k x i): %d x %d\n", tile_k, tile_i);
+    } else {
+      printf("z tile (k x i): untiled\n");
+    }
+    printf("z flux state reads, modelled (B/cell): untiled %.1lf, tiled "
+           "%.1lf\n",
+           z_state_bytes_per_cell(0, nx),
+           z_state_bytes_per_cell(tile_k, tile_k > 0 ? tile_i : nx));
+    printf("compute_tendencies_z, measured (ns/cell): untiled %.3lf, tiled "
+           "%.3lf\n",
+           t_untiled / cells * 1.e9, t_best / cells * 1.e9);
+  }
+}
 
+// Compute the z-direction flux vector f (including hyperviscosity) at interface
+// k of interior column i, enforcing the wall condition on the physical top and
+// bottom interfaces
+inline void MiniWeatherSimulation::interface_flux_z(const real *state, int k,
+                                                    int i, double hv_coef,
+                                                    double *f, double *speed) {
+  // The model top and bottom are only walls on the ranks that own them
+  Dyn::interface_flux_z(
+      grid(), state, hy_dens_int.data(), hy_dens_theta_int.data(),
+      hy_pressure_int.data(), k, i, hv_coef,
+      (k == 0 && k_beg == 0) || (k == nz && k_beg + nz == nz_glob), f, speed);
+}
+
+// Raise this thread's fastest signal speed in direction dir to speed
+void MiniWeatherSimulation::record_wave_speed(int dir, double speed) {
+  double &slot = wave_speed[8 * thread_num() + (dir == DIR_Z)];
+  slot = std::max(slot, speed);
+}
+
+// --adaptive-dt, after each time step: wait for the previous step's signal
+// speeds, which were reduced behind this step, and take the next time step
+// from them at the adaptive_cfl Courant number. Then post the reduce of the
+// speeds this step measured, for the step after next
+void MiniWeatherSimulation::adapt_dt() {
+  MPI_Wait(&wave_speed_req, MPI_STATUS_IGNORE);
+  if (wave_speed_glob[0] > 0 && wave_speed_glob[1] > 0) {
+    dt = adaptive_cfl *
+         dmin(dx / wave_speed_glob[0], dz / wave_speed_glob[1]);
+  }
+  wave_speed_loc[0] = wave_speed_loc[1] = 0.;
+  for (size_t t = 0; t < wave_speed.size(); t += 8) {
+    wave_speed_loc[0] = std::max(wave_speed_loc[0], wave_speed[t]);
+    wave_speed_loc[1] = std::max(wave_speed_loc[1], wave_speed[t + 1]);
+    wave_speed[t] = wave_speed[t + 1] = 0.;
+  }
+  // Ensemble members step together (see split_ensemble)
+  MPI_Iallreduce(wave_speed_loc, wave_speed_glob, 2, MPI_DOUBLE, MPI_MAX,
+                 n_members > 0 ? MPI_COMM_WORLD : comm, &wave_speed_req);
+}
+
+// x-direction fluxes at interfaces i_lo..i_hi-1 of interior row k, vectorised
+// along i. The same math as interface_flux_x with the stencils unrolled into
+// unit-stride loads and pow replaced by simd_pow
+SIMD_INLINE void MiniWeatherSimulation::simd_fluxes_x_row(const real *state,
+                                                         real *flux,
+                                                         double hv_coef, int k,
+                                                         int i_lo, int i_hi) {
+  const real *qr = &state[ID_DENS * plane + (k + hs) * pitch + hx - hs];
+  const real *qu = &state[ID_UMOM * plane + (k + hs) * pitch + hx - hs];
+  const real *qw = &state[ID_WMOM * plane + (k + hs) * pitch + hx - hs];
+  const real *qt = &state[ID_RHOT * plane + (k + hs) * pitch + hx - hs];
+  real *fr = &flux[ID_DENS * (nz + 1) * (nx + 1) + k * (nx + 1)];
+  real *fu = &flux[ID_UMOM * (nz + 1) * (nx + 1) + k * (nx + 1)];
+  real *fw = &flux[ID_WMOM * (nz + 1) * (nx + 1) + k * (nx + 1)];
+  real *ft = &flux[ID_RHOT * (nz + 1) * (nx + 1) + k * (nx + 1)];
+  const double hr = hy_dens_cell[k + hs], ht = hy_dens_theta_cell[k + hs];
+  const double c0 = C0, g = gamm;
+#pragma omp simd
+  for (int i = i_lo; i < i_hi; i++) {
+    double r, u, w, t, p;
+    r = simd_interp4(qr + i, 1) + hr;
+    u = simd_interp4(qu + i, 1) / r;
+    w = simd_interp4(qw + i, 1) / r;
+    t = (simd_interp4(qt + i, 1) + ht) / r;
+    p = c0 * simd_pow(r * t, g);
+    fr[i] = r * u - hv_coef * simd_d3(qr + i, 1);
+    fu[i] = r * u * u + p - hv_coef * simd_d3(qu + i, 1);
+    fw[i] = r * u * w - hv_coef * simd_d3(qw + i, 1);
+    ft[i] = r * u * t - hv_coef * simd_d3(qt + i, 1);
+  }
+}
+
+// z-direction fluxes at interface row k, columns i_lo..i_hi-1, vectorised along
+// i; the vector counterpart of interface_flux_z
+SIMD_INLINE void MiniWeatherSimulation::simd_fluxes_z_row(const real *state,
+                                                         real *flux,
+                                                         double hv_coef, int k,
+                                                         int i_lo, int i_hi) {
+  const real *qr = &state[ID_DENS * plane + k * pitch + hx];
+  const real *qu = &state[ID_UMOM * plane + k * pitch + hx];
+  const real *qw = &state[ID_WMOM * plane + k * pitch + hx];
+  const real *qt = &state[ID_RHOT * plane + k * pitch + hx];
+  real *fr = &flux[ID_DENS * (nz + 1) * (nx + 1) + k * (nx + 1)];
+  real *fu = &flux[ID_UMOM * (nz + 1) * (nx + 1) + k * (nx + 1)];
+  real *fw = &flux[ID_WMOM * (nz + 1) * (nx + 1) + k * (nx + 1)];
+  real *ft = &flux[ID_RHOT * (nz + 1) * (nx + 1) + k * (nx + 1)];
+  const double hr = hy_dens_int[k], ht = hy_dens_theta_int[k];
+  const double hp = hy_pressure_int[k], c0 = C0, g = gamm;
+  const int ps = pitch;
+  // Vertical boundary condition and exact mass conservation at the walls
+  const double wall =
+      ((k == 0 && k_beg == 0) || (k == nz && k_beg + nz == nz_glob)) ? 0. : 1.;
+#pragma omp simd
+  for (int i = i_lo; i < i_hi; i++) {
+    double r, u, w, t, p;
+    r = simd_interp4(qr + i, ps) + hr;
+    u = simd_interp4(qu + i, ps) / r;
+    w = simd_interp4(qw + i, ps) / r * wall;
+    t = (simd_interp4(qt + i, ps) + ht) / r;
+    p = c0 * simd_pow(r * t, g) - hp;
+    fr[i] = r * w - hv_coef * simd_d3(qr + i, ps) * wall;
+    fu[i] = r * w * u - hv_coef * simd_d3(qu + i, ps);
+    fw[i] = r * w * w + p - hv_coef * simd_d3(qw + i, ps);
+    ft[i] = r * w * t - hv_coef * simd_d3(qt + i, ps);
+  }
+}
+
+// Run the x or z SIMD row kernel compiled for the selected ISA
+void MiniWeatherSimulation::fluxes_x_row(const real *state, real *flux,
+                                         double hv_coef, int k, int i_lo,
+                                         int i_hi) {
+  switch (simd_isa) {
+#ifdef SIMD_X86
+  case SIMD_AVX512:
+    fluxes_x_row_avx512(state, flux, hv_coef, k, i_lo, i_hi);
+    break;
+  case SIMD_AVX2:
+    fluxes_x_row_avx2(state, flux, hv_coef, k, i_lo, i_hi);
+    break;
+#endif
+  default:
+    simd_fluxes_x_row(state, flux, hv_coef, k, i_lo, i_hi);
+  }
+}
+
+void MiniWeatherSimulation::fluxes_z_row(const real *state, real *flux,
+                                         double hv_coef, int k, int i_lo,
+                                         int i_hi) {
+  switch (simd_isa) {
+#ifdef SIMD_X86
+  case SIMD_AVX512:
+    fluxes_z_row_avx512(state, flux, hv_coef, k, i_lo, i_hi);
+    break;
+  case SIMD_AVX2:
+    fluxes_z_row_avx2(state, flux, hv_coef, k, i_lo, i_hi);
+    break;
+#endif
+  default:
+    simd_fluxes_z_row(state, flux, hv_coef, k, i_lo, i_hi);
+  }
+}
+
+#ifdef SIMD_X86
+SIMD_TARGET("avx2,fma")
+void MiniWeatherSimulation::fluxes_x_row_avx2(const real *state,
+                                              real *flux, double hv_coef,
+                                              int k, int i_lo, int i_hi) {
+  simd_fluxes_x_row(state, flux, hv_coef, k, i_lo, i_hi);
+}
+
+SIMD_TARGET("avx2,fma")
+void MiniWeatherSimulation::fluxes_z_row_avx2(const real *state,
+                                              real *flux, double hv_coef,
+                                              int k, int i_lo, int i_hi) {
+  simd_fluxes_z_row(state, flux, hv_coef, k, i_lo, i_hi);
+}
+
+SIMD_TARGET("avx512f,avx512dq,fma,prefer-vector-width=512")
+void MiniWeatherSimulation::fluxes_x_row_avx512(const real *state,
+                                                real *flux, double hv_coef,
+                                                int k, int i_lo, int i_hi) {
+  simd_fluxes_x_row(state, flux, hv_coef, k, i_lo, i_hi);
+}
+
+SIMD_TARGET("avx512f,avx512dq,fma,prefer-vector-width=512")
+void MiniWeatherSimulation::fluxes_z_row_avx512(const real *state,
+                                                real *flux, double hv_coef,
+                                                int k, int i_lo, int i_hi) {
+  simd_fluxes_z_row(state, flux, hv_coef, k, i_lo, i_hi);
+}
+#endif
+
+// Widest SIMD flux kernel this CPU can run
+int MiniWeatherSimulation::best_simd_isa() {
+#ifdef SIMD_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512dq")) {
+    return SIMD_AVX512;
+  }
+  if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+    return SIMD_AVX2;
+  }
+#endif
+  return SIMD_BASE;
+}
+
+// The gravity-wave vertical momentum forcing wpert at cell (i,k); i may lie in
+// the x halos
+inline double MiniWeatherSimulation::gravity_wave_forcing(int i, int k) {
+  double x, z, dist;
+  const double x0 = xlen / 8, z0 = 1000, xrad = 500, zrad = 500, amp = 0.01;
+  // Periodic in x, for the halo columns of the deep x sweep
+  x = ((i_beg + i + nx_glob) % nx_glob + 0.5) * dx;
+  z = (k_beg + k + 0.5) * dz;
+  // Compute distance from bubble center
+  dist = sqrt(((x - x0) / xrad) * ((x - x0) / xrad) +
+              ((z - z0) / zrad) * ((z - z0) / zrad)) *
+         pi / 2.;
+  // If the distance from bubble center is less than the radius, create a cos**2
+  // profile
+  if (dist <= pi / 2.) {
+    return amp * pow(cos(dist), 2.);
   } else {
-    // MPI 是分布式计算
-    // 我们在设置halo值时，需要MPI通信，获取相邻进程的边界值
-    // 此后，在 mpi 计算域内，执行的就是本地计算
-    MPI_Request request[4];
-    MPI_Status status[4];
+    return 0.;
+  }
+}
 
-    // Pack the send buffers：打包发送相邻进程的边界值
-    //  这里使用的是非阻塞发送，因为使用了halo值，发送和接收可以同时进行
-    for (ll = 0; ll < NUM_VARS; ll++) {
-      for (k = 0; k < nz; k++) {
-        for (s = 0; s < hs; s++) {
-          sendbuf_l[ll * nz * hs + k * hs + s] =
-              state[ll * (nz + 2 * hs) * (nx + 2 * hs) +
-                    (k + hs) * (nx + 2 * hs) + hs + s];
-          sendbuf_r[ll * nz * hs + k * hs + s] =
-              state[ll * (nz + 2 * hs) * (nx + 2 * hs) +
-                    (k + hs) * (nx + 2 * hs) + nx + s];
+// Source-term hook: add the time-invariant forcing rate(i, k) of variable ll at
+// every interior cell (i,k) to the source terms. They are evaluated once here
+// and applied by a single add per cell and stage, so a new forcing needs no
+// branch of its own in the time step. The first call allocates the source
+// array and zeroes it with the apply loop's schedule (see zero_fields)
+template <class Rate>
+void MiniWeatherSimulation::add_source(int ll, Rate rate) {
+  bool fresh = source.empty();
+  if (fresh) {
+    source.resize(nx * nz * NUM_VARS);
+  }
+#pragma omp parallel for collapse(2) schedule(static)
+  for (int k = 0; k < nz; k++) {
+    for (int i = 0; i < nx; i++) {
+      if (fresh) {
+        for (int l = 0; l < NUM_VARS; l++) {
+          source[l * nz * nx + k * nx + i] = 0.;
+        }
+      }
+      source[ll * nz * nx + k * nx + i] += rate(i, k);
+    }
+  }
+  if (hx > hs) {
+    const int off = hx - hs, nw = nx + 2 * off;
+    if (fresh) {
+      source_x.assign(nw * nz * NUM_VARS, 0.);
+    }
+#pragma omp parallel for collapse(2) schedule(static)
+    for (int k = 0; k < nz; k++) {
+      for (int i = -off; i < nx + off; i++) {
+        source_x[ll * nz * nw + k * nw + i + off] += rate(i, k);
+      }
+    }
+  }
+}
+
+#ifdef _SPECIALIZE
+// One RK stage with the halos already set: the fluxes, tendencies and update
+// of the default (unfused, scalar, untiled) path, with the data spec DS and,
+// when NX > 0, this rank's NX x NZ block and unpadded strides as compile-time
+// constants. The loop trip counts and index arithmetic then fold, and the
+// source-term add is compiled in only for the one case that has a forcing.
+// Results match the generic path bitwise
+template <int DS, int NX, int NZ>
+void MiniWeatherSimulation::stage_specialized(real *state_init,
+                                              real *state_forcing,
+                                              real *state_out, double dt,
+                                              int dir, real *flux,
+                                              real *tend) {
+  const int nx = NX > 0 ? NX : this->nx;
+  const int nz = NZ > 0 ? NZ : this->nz;
+  const int hx = NX > 0 ? hs : this->hx;
+  const int pitch = NX > 0 ? NX + 2 * hs : this->pitch;
+  const int plane = NX > 0 ? (NZ + 2 * hs) * (NX + 2 * hs) : this->plane;
+  constexpr bool forced = (DS == DATA_SPEC_GRAVITY_WAVES); // See init()
+
+  if (dir == DIR_X) {
+    ScopedTimer timer(timers, TIMER_TEND_X);
+    const double hv_coef = -hyperviscosity * dx / (16 * dt);
+#pragma omp for collapse(2)
+    for (int k = 0; k < nz; k++) {
+      for (int i = 0; i < nx + 1; i++) {
+        double vals[NUM_VARS], d3_vals[NUM_VARS], f[NUM_VARS];
+        for (int ll = 0; ll < NUM_VARS; ll++) {
+          reconstruct(
+              &state_forcing[ll * plane + (k + hs) * pitch + i + hx - hs], 1,
+              vals[ll], d3_vals[ll]);
+        }
+        flux_x(vals, d3_vals, hy_dens_cell[k + hs], hy_dens_theta_cell[k + hs],
+               hv_coef, f);
+        for (int ll = 0; ll < NUM_VARS; ll++) {
+          flux[ll * (nz + 1) * (nx + 1) + k * (nx + 1) + i] = f[ll];
+        }
+      }
+    }
+#pragma omp for collapse(2) schedule(static) nowait
+    for (int k = 0; k < nz; k++) {
+      for (int i = 0; i < nx; i++) {
+        for (int ll = 0; ll < NUM_VARS; ll++) {
+          int indf = ll * (nz + 1) * (nx + 1) + k * (nx + 1) + i;
+          tend[ll * nz * nx + k * nx + i] = -(flux[indf + 1] - flux[indf]) / dx;
+        }
+      }
+    }
+  } else {
+    ScopedTimer timer(timers, TIMER_TEND_Z);
+    const double hv_coef = -hyperviscosity * dz / (16 * dt);
+#pragma omp for collapse(2)
+    for (int k = 0; k < nz + 1; k++) {
+      for (int i = 0; i < nx; i++) {
+        double vals[NUM_VARS], d3_vals[NUM_VARS], f[NUM_VARS];
+        for (int ll = 0; ll < NUM_VARS; ll++) {
+          reconstruct(&state_forcing[ll * plane + k * pitch + i + hx], pitch,
+                      vals[ll], d3_vals[ll]);
+        }
+        flux_z(vals, d3_vals, hy_dens_int[k], hy_dens_theta_int[k],
+               hy_pressure_int[k], hv_coef,
+               (k == 0 && k_beg == 0) || (k == nz && k_beg + nz == nz_glob),
+               f);
+        for (int ll = 0; ll < NUM_VARS; ll++) {
+          flux[ll * (nz + 1) * (nx + 1) + k * (nx + 1) + i] = f[ll];
+        }
+      }
+    }
+#pragma omp for collapse(2) schedule(static) nowait
+    for (int k = 0; k < nz; k++) {
+      for (int i = 0; i < nx; i++) {
+        for (int ll = 0; ll < NUM_VARS; ll++) {
+          int indt = ll * nz * nx + k * nx + i;
+          int indf = ll * (nz + 1) * (nx + 1) + k * (nx + 1) + i;
+          tend[indt] = -(flux[indf + nx + 1] - flux[indf]) / dz;
+          if (ll == ID_WMOM) {
+            tend[indt] = tend[indt] -
+                         state_forcing[ID_DENS * plane + (k + hs) * pitch + i +
+                                       hx] *
+                             grav;
+          }
+        }
+      }
+    }
+  }
+
+  ScopedTimer timer(timers, TIMER_APPLY);
+#pragma omp for collapse(2) schedule(static)
+  for (int k = 0; k < nz; k++) {
+    for (int i = 0; i < nx; i++) {
+      for (int ll = 0; ll < NUM_VARS; ll++) {
+        int inds = ll * plane + (k + hs) * pitch + i + hx;
+        int indt = ll * nz * nx + k * nx + i;
+        if (forced) {
+          state_out[inds] =
+              state_init[inds] + dt * (tend[indt] + source[indt]);
+        } else {
+          state_out[inds] = state_init[inds] + dt * tend[indt];
         }
       }
     }
+  }
+}
 
-    // Fire off the sends and prepost receives
-    ierr = MPI_Isend(sendbuf_l.data(), hs * nz * NUM_VARS, MPI_DOUBLE,
-                     left_rank, 1, MPI_COMM_WORLD, &request[0]);
-    ierr = MPI_Isend(sendbuf_r.data(), hs * nz * NUM_VARS, MPI_DOUBLE,
-                     right_rank, 2, MPI_COMM_WORLD, &request[1]);
-    ierr = MPI_Irecv(recvbuf_l.data(), hs * nz * NUM_VARS, MPI_DOUBLE,
-                     left_rank, 2, MPI_COMM_WORLD, &request[2]);
-    ierr = MPI_Irecv(recvbuf_r.data(), hs * nz * NUM_VARS, MPI_DOUBLE,
-                     right_rank, 1, MPI_COMM_WORLD, &request[3]);
+// The specialised stage of data spec DS, on the compiled grid when fixed_grid
+template <int DS>
+MiniWeatherSimulation::StageFn
+MiniWeatherSimulation::stage_for(bool fixed_grid) {
+#if defined(_SPEC_NX) && defined(_SPEC_NZ)
+  if (fixed_grid) {
+    return &MiniWeatherSimulation::stage_specialized<DS, _SPEC_NX, _SPEC_NZ>;
+  }
+#endif
+  return &MiniWeatherSimulation::stage_specialized<DS, 0, 0>;
+}
 
-    // Wait for all communications to finish
-    ierr = MPI_Waitall(4, request, status);
+// Runtime dispatcher of the specialised build. The data spec selects one of
+// the instantiated stages, on the compiled _SPEC_NX x _SPEC_NZ block if this
+// rank's block and strides match it. Modes the specialised stage does not
+// implement (--fused, --overlap, --simd, --tile) and --generic-kernels keep
+// the generic code
+void MiniWeatherSimulation::choose_stage() {
+  bool fixed_grid = false;
+  int nfixed = 0;
+#if defined(_SPEC_NX) && defined(_SPEC_NZ)
+  fixed_grid = (nx == _SPEC_NX && nz == _SPEC_NZ && pitch == nx + 2 * hs);
+#endif
+  stage_fn = nullptr;
+  if (!(generic_kernels || fused || overlap || simd_isa != SIMD_NONE ||
+        tile_k > 0 || adaptive_dt)) {
+    switch (data_spec_int) {
+    case DATA_SPEC_COLLISION:
+      stage_fn = stage_for<DATA_SPEC_COLLISION>(fixed_grid);
+      break;
+    case DATA_SPEC_THERMAL:
+      stage_fn = stage_for<DATA_SPEC_THERMAL>(fixed_grid);
+      break;
+    case DATA_SPEC_GRAVITY_WAVES:
+      stage_fn = stage_for<DATA_SPEC_GRAVITY_WAVES>(fixed_grid);
+      break;
+    case DATA_SPEC_DENSITY_CURRENT:
+      stage_fn = stage_for<DATA_SPEC_DENSITY_CURRENT>(fixed_grid);
+      break;
+    case DATA_SPEC_INJECTION:
+      stage_fn = stage_for<DATA_SPEC_INJECTION>(fixed_grid);
+      break;
+    }
+  }
+  int fixed_here = (stage_fn != nullptr && fixed_grid);
+  MPI_Reduce(&fixed_here, &nfixed, 1, MPI_INT, MPI_SUM, 0, comm);
+  if (world_main) {
+    if (stage_fn == nullptr) {
+      printf("Stages: generic\n");
+    } else {
+      printf("Stages: specialised for data spec %d, compiled grid on %d of "
+             "%d ranks\n",
+             data_spec_int, nfixed, nranks);
+    }
+  }
+}
+#endif
 
-    // Unpack the receive buffers
+// Fused x-direction stage: state_out = state_init + dt * rhs_x(state_forcing)
+// in one pass over each row, without the flux and tend arrays. The flux at the
+// left interface of a cell is carried in registers from the previous cell.
+// state_out may alias state_forcing (the second RK stage), and a cell's old
+// value is still read by the flux one interface to its right, so each update
+// is held back by one cell before it is stored
+void MiniWeatherSimulation::fused_step_x(real *state_init,
+                                         real *state_forcing,
+                                         real *state_out, double dt) {
+  ScopedTimer timer(timers, TIMER_TEND_X);
+  int i, k, ll, inds;
+  double hv_coef, tend;
+  double fl[NUM_VARS], fr[NUM_VARS], pending[NUM_VARS];
+  const real *src = source.empty() ? nullptr : source.data();
+  // Compute the hyperviscosity coefficient
+  hv_coef = -hyperviscosity * dx / (16 * dt);
+#pragma omp for private(i, ll, inds, tend, fl, fr, pending)
+  for (k = 0; k < nz; k++) {
+    interface_flux_x(state_forcing, k, 0, hv_coef, fl);
+    for (i = 0; i < nx; i++) {
+      interface_flux_x(state_forcing, k, i + 1, hv_coef, fr);
+      // Cell i-1 has now been read for the last time
+      if (i > 0) {
+        for (ll = 0; ll < NUM_VARS; ll++) {
+          inds = ll * plane + (k + hs) * pitch + i - 1 + hx;
+          state_out[inds] = pending[ll];
+        }
+      }
+      for (ll = 0; ll < NUM_VARS; ll++) {
+        tend = -(fr[ll] - fl[ll]) / dx;
+        if (src) {
+          tend += src[ll * nz * nx + k * nx + i];
+        }
+        inds = ll * plane + (k + hs) * pitch + i + hx;
+        pending[ll] = state_init[inds] + dt * tend;
+        fl[ll] = fr[ll];
+      }
+    }
     for (ll = 0; ll < NUM_VARS; ll++) {
-      for (k = 0; k < nz; k++) {
-        for (s = 0; s < hs; s++) {
-          state[ll * (nz + 2 * hs) * (nx + 2 * hs) + (k + hs) * (nx + 2 * hs) +
-                s] = recvbuf_l[ll * nz * hs + k * hs + s];
-          state[ll * (nz + 2 * hs) * (nx + 2 * hs) + (k + hs) * (nx + 2 * hs) +
-                nx + hs + s] = recvbuf_r[ll * nz * hs + k * hs + s];
+      inds = ll * plane + (k + hs) * pitch + nx - 1 + hx;
+      state_out[inds] = pending[ll];
+    }
+  }
+}
+
+// Fused z-direction stage (with _FUSED_Z or --low-mem). Threads own strips of
+// fused_blk columns and sweep them bottom to top, carrying the fluxes of the
+// lower interfaces in a small row buffer. As in fused_step_x, each row update
+// is stored one row late so an aliased state_forcing is never read after
+// being overwritten; splitting by columns keeps that true across threads
+void MiniWeatherSimulation::fused_step_z(real *state_init,
+                                         real *state_forcing,
+                                         real *state_out, double dt) {
+  ScopedTimer timer(timers, TIMER_TEND_Z);
+  int i0, i, k, ll, inds, nb;
+  double hv_coef, tend;
+  const real *src = source.empty() ? nullptr : source.data();
+  // Compute the hyperviscosity coefficient
+  hv_coef = -hyperviscosity * dz / (16 * dt);
+#pragma omp for private(i, k, ll, inds, nb, tend)
+  for (i0 = 0; i0 < nx; i0 += fused_blk) {
+    double fb[fused_blk][NUM_VARS], ft[NUM_VARS], tnd[NUM_VARS];
+    double pending[fused_blk][NUM_VARS];
+    nb = std::min(fused_blk, nx - i0);
+    for (i = 0; i < nb; i++) {
+      interface_flux_z(state_forcing, 0, i0 + i, hv_coef, fb[i]);
+    }
+    for (k = 0; k < nz; k++) {
+      for (i = 0; i < nb; i++) {
+        interface_flux_z(state_forcing, k + 1, i0 + i, hv_coef, ft);
+        for (ll = 0; ll < NUM_VARS; ll++) {
+          tend = -(ft[ll] - fb[i][ll]) / dz;
+          if (ll == ID_WMOM) {
+            inds = ID_DENS * plane + (k + hs) * pitch + i0 + i + hx;
+            tend = tend - state_forcing[inds] * grav;
+          }
+          if (src) {
+            tend += src[ll * nz * nx + k * nx + i0 + i];
+          }
+          tnd[ll] = tend;
+          fb[i][ll] = ft[ll];
+        }
+        // Row k-1 of this strip has now been read for the last time
+        if (k > 0) {
+          for (ll = 0; ll < NUM_VARS; ll++) {
+            inds = ll * plane + (k - 1 + hs) * pitch + i0 + i + hx;
+            state_out[inds] = pending[i][ll];
+          }
+        }
+        for (ll = 0; ll < NUM_VARS; ll++) {
+          inds = ll * plane + (k + hs) * pitch + i0 + i + hx;
+          pending[i][ll] = state_init[inds] + dt * tnd[ll];
         }
       }
     }
+    for (i = 0; i < nb; i++) {
+      for (ll = 0; ll < NUM_VARS; ll++) {
+        inds = ll * plane + (nz - 1 + hs) * pitch + i0 + i + hx;
+        state_out[inds] = pending[i][ll];
+      }
+    }
   }
+}
 
-  // 如果数据源是注入，则需要设置halo值
-  if (data_spec_int == DATA_SPEC_INJECTION) {
-    if (myrank == 0) {
-      // 如果我是主进程，则需要设置halo值
-      for (k = 0; k < nz; k++) {
-        for (i = 0; i < hs; i++) {
-          z = (k_beg + k + 0.5) * dz;
-          if (fabs(z - 3 * zlen / 4) <= zlen / 16) {
-            ind_r = ID_DENS * (nz + 2 * hs) * (nx + 2 * hs) +
-                    (k + hs) * (nx + 2 * hs) + i;
-            ind_u = ID_UMOM * (nz + 2 * hs) * (nx + 2 * hs) +
-                    (k + hs) * (nx + 2 * hs) + i;
-            ind_t = ID_RHOT * (nz + 2 * hs) * (nx + 2 * hs) +
-                    (k + hs) * (nx + 2 * hs) + i;
-            state[ind_u] = (state[ind_r] + hy_dens_cell[k + hs]) * 50.;
-            state[ind_t] = (state[ind_r] + hy_dens_cell[k + hs]) * 298. -
-                           hy_dens_theta_cell[k + hs];
+// Set this MPI task's halo values in the x-direction. This routine will require
+// MPI
+void MiniWeatherSimulation::set_halo_values_x(real *state) {
+  halo_exchange_x_begin(state);
+  halo_exchange_x_end(state);
+}
+
+// First half of the x halo exchange: pack the send buffers and post the
+// non-blocking sends and receives. Nothing in state is modified, so interior
+// work may proceed until halo_exchange_x_end is called. The master thread posts
+// the messages and does not wait for the rest of the team afterwards
+void MiniWeatherSimulation::halo_exchange_x_begin(real *state) {
+  ScopedTimer timer(timers, TIMER_HALO_PACK);
+  int ierr;
+
+  if (px == 1) {
+    // Periodic copies are purely local and are done in halo_exchange_x_end
+    return;
+  }
+
+  if (shm_win != MPI_WIN_NULL) {
+    // Tell the on-node neighbours that this buffer's interior is complete
+#pragma omp master
+    {
+      int n = 0;
+      ierr = MPI_Win_sync(shm_win);
+      for (int side = 0; side < 2; side++) {
+        int nbr = side ? right_rank : left_rank;
+        if (shm_nbr[side].buf[0]) {
+          ierr = MPI_Isend(nullptr, 0, MPI_BYTE, nbr, 5, cart_comm,
+                           &shm_req[n++]);
+          ierr = MPI_Irecv(nullptr, 0, MPI_BYTE, nbr, 5, cart_comm,
+                           &shm_req[n++]);
+        }
+      }
+      for (; n < 4; n++) {
+        shm_req[n] = MPI_REQUEST_NULL;
+      }
+    }
+  }
+
+  if (persistent_halo) {
+    // The persistent requests already describe the halo columns of this
+    // buffer, so just restart them
+#pragma omp master
+    {
+      halo_req_active =
+          halo_persist_req[state == this->state.data() ? 0 : 1];
+      ierr = MPI_Startall(4, halo_req_active);
+    }
+    return;
+  }
+
+  // MPI 是分布式计算
+  // 我们在设置halo值时，需要MPI通信，获取相邻进程的边界值
+  // 此后，在 mpi 计算域内，执行的就是本地计算
+
+  // A device runs the exchange on Q_HALO: once the last kernels on Q_MAIN
+  // have written state, and the previous unpack has drained the receive
+  // buffers
+  Backend::wait(Q_HALO);
+  Backend::join(Q_MAIN, Q_HALO);
+
+  // Prepost receives. With GPU-aware MPI the messages land in device memory;
+  // otherwise they go to the host copies of the buffers
+  const int n = hx * nz * NUM_VARS;
+#pragma omp master
+  {
+    halo_req_active = halo_req;
+    ierr = MPI_Irecv(mpi_buf(recvbuf_l.data()), n, MPI_TYPE, msg_left_rank, 2,
+                     cart_comm, &halo_req[2]);
+    ierr = MPI_Irecv(mpi_buf(recvbuf_r.data()), n, MPI_TYPE, msg_right_rank,
+                     1, cart_comm, &halo_req[3]);
+  }
+
+  // Pack the send buffers：打包发送相邻进程的边界值
+  //  这里使用的是非阻塞发送，因为使用了halo值，发送和接收可以同时进行
+  // (only the sides that are messaged)
+  const bool msg_l = msg_left_rank != MPI_PROC_NULL;
+  const bool msg_r = msg_right_rank != MPI_PROC_NULL;
+  Dyn::pack_x(grid(), Q_HALO, dev(state),
+              msg_l ? dev(sendbuf_l.data()) : nullptr,
+              msg_r ? dev(sendbuf_r.data()) : nullptr);
+  if (!gpu_aware_mpi) {
+    Backend::update_host(sendbuf_l.data(), n, Q_HALO);
+    Backend::update_host(sendbuf_r.data(), n, Q_HALO);
+  }
+
+  // Fire off the sends. A device has only queued the pack, so its sends wait
+  // for it in halo_exchange_x_end, after the interior fluxes are queued
+  if (!Backend::device) {
+    post_halo_sends_x();
+  }
+}
+
+// The x halo sends, from the packed buffers
+void MiniWeatherSimulation::post_halo_sends_x() {
+  const int n = hx * nz * NUM_VARS;
+  int ierr;
+#pragma omp master
+  {
+    ierr = MPI_Isend(mpi_buf(sendbuf_l.data()), n, MPI_TYPE, msg_left_rank, 1,
+                     cart_comm, &halo_req[0]);
+    ierr = MPI_Isend(mpi_buf(sendbuf_r.data()), n, MPI_TYPE, msg_right_rank,
+                     2, cart_comm, &halo_req[1]);
+  }
+}
+
+// Second half of the x halo exchange: wait for the messages posted by
+// halo_exchange_x_begin, unpack them into the halo columns of state, and apply
+// the injection inflow condition
+void MiniWeatherSimulation::halo_exchange_x_end(real *state) {
+  ScopedTimer timer(timers, TIMER_HALO_PACK);
+  int ierr;
+
+  if (px == 1) { // 如果 x 方向只有一进程，则不需要 MPI 通信
+
+    // With the exchange on Q_HALO, like the messaged halos
+    Backend::wait(Q_HALO);
+    Backend::join(Q_MAIN, Q_HALO);
+    Dyn::periodic_x(grid(), Q_HALO, dev(state));
+
+  } else {
+    MPI_Status status[4];
+    if (Backend::device) {
+      // The pack, and its copy to the host, must be done before the sends
+      Backend::wait(Q_HALO);
+      post_halo_sends_x();
+    }
+
+    const bool shm = shm_win != MPI_WIN_NULL;
+    // Wait for all communications to finish, and for the on-node neighbours
+    // to complete their interiors
+#pragma omp master
+    {
+      ScopedTimer wait_timer(timers, TIMER_HALO_WAIT);
+      double t0 = MPI_Wtime();
+      ierr = MPI_Waitall(4, halo_req_active, status);
+      if (shm) {
+        ierr = MPI_Waitall(4, shm_req, MPI_STATUSES_IGNORE);
+        ierr = MPI_Win_sync(shm_win);
+      }
+      halo_wait_time += MPI_Wtime() - t0;
+    }
+#pragma omp barrier
+
+    // Unpack the receive buffers (persistent requests received in place), and
+    // copy the halos facing on-node neighbours from their edge columns
+    const bool unpack = halo_req_active == halo_req;
+    const int b = state == this->state.data() ? 0 : 1;
+    const ShmNeighbour &nl = shm_nbr[0], &nr = shm_nbr[1];
+    if (unpack || shm) {
+      HaloColumns<real> l = {nullptr, nz * hx, hx, 0}, r = l;
+      if (nl.buf[b]) {
+        l = {nl.buf[b], nl.plane, nl.pitch, hs * nl.pitch + nl.nx};
+      } else if (unpack) {
+        l.p = dev(recvbuf_l.data());
+      }
+      if (nr.buf[b]) {
+        r = {nr.buf[b], nr.plane, nr.pitch, hs * nr.pitch + hx};
+      } else if (unpack) {
+        r.p = dev(recvbuf_r.data());
+      }
+      if (unpack && !gpu_aware_mpi) {
+        Backend::update_device(recvbuf_l.data(), hx * nz * NUM_VARS, Q_HALO);
+        Backend::update_device(recvbuf_r.data(), hx * nz * NUM_VARS, Q_HALO);
+      }
+      Dyn::unpack_x(grid(), Q_HALO, dev(state), l, r);
+    }
+
+    if (shm) {
+      // Hold back this rank's next writes until the neighbours have read
+      // its edge columns in turn
+#pragma omp master
+      {
+        ScopedTimer wait_timer(timers, TIMER_HALO_WAIT);
+        double t0 = MPI_Wtime();
+        int n = 0;
+        for (int side = 0; side < 2; side++) {
+          int nbr = side ? right_rank : left_rank;
+          if (shm_nbr[side].buf[0]) {
+            ierr = MPI_Isend(nullptr, 0, MPI_BYTE, nbr, 6, cart_comm,
+                             &shm_req[n++]);
+            ierr = MPI_Irecv(nullptr, 0, MPI_BYTE, nbr, 6, cart_comm,
+                             &shm_req[n++]);
           }
         }
+        ierr = MPI_Waitall(n, shm_req, MPI_STATUSES_IGNORE);
+        halo_wait_time += MPI_Wtime() - t0;
       }
+#pragma omp barrier
+    }
+  }
+
+  // 如果数据源是注入，则需要设置halo值
+  // (with --deep-halo the halo keeps the periodic values that the redundant
+  // cells of the sweep need, and deep_fluxes_x applies the inflow instead)
+  if (data_spec_int == DATA_SPEC_INJECTION && hx == hs) {
+    if (i_beg == 0) {
+      // 如果我位于左边界，则需要设置halo值
+      Dyn::inflow_x(grid(), Q_HALO, dev(state), dev(hy_dens_cell.data()),
+                    dev(hy_dens_theta_cell.data()), k_beg);
+    }
+  }
+
+  // Later kernels on Q_MAIN read the halos
+  Backend::join(Q_HALO, Q_MAIN);
+}
+
+// Set this MPI task's halo values in the z-direction. Interior ranks of the
+// process grid exchange hs rows with the ranks above and below; the physical
+// top and bottom boundary conditions are applied only on the edge ranks
+void MiniWeatherSimulation::set_halo_values_z(real *state) {
+  ScopedTimer timer(timers, TIMER_HALO_PACK);
+  int ierr;
+  const bool at_bottom = (bottom_rank == MPI_PROC_NULL);
+  const bool at_top = (top_rank == MPI_PROC_NULL);
+
+  if (pz > 1) {
+    MPI_Request request[4];
+    MPI_Status status[4];
+    const int n = hs * nx * NUM_VARS;
+
+    // Pack the bottom and top interior rows, and stage them on the host
+    // unless MPI reads device memory
+    Dyn::pack_z(grid(), Q_MAIN, dev(state), dev(sendbuf_b.data()),
+                dev(sendbuf_t.data()));
+    if (!gpu_aware_mpi) {
+      Backend::update_host(sendbuf_b.data(), n, Q_MAIN);
+      Backend::update_host(sendbuf_t.data(), n, Q_MAIN);
+    }
+    Backend::wait(Q_MAIN);
+
+    // Exchange with the neighbours below and above. Sends to and receives from
+    // MPI_PROC_NULL complete immediately on the edge ranks
+#pragma omp master
+    {
+      ierr = MPI_Isend(mpi_buf(sendbuf_b.data()), n, MPI_TYPE, bottom_rank, 3,
+                       cart_comm, &request[0]);
+      ierr = MPI_Isend(mpi_buf(sendbuf_t.data()), n, MPI_TYPE, top_rank, 4,
+                       cart_comm, &request[1]);
+      ierr = MPI_Irecv(mpi_buf(recvbuf_b.data()), n, MPI_TYPE, bottom_rank, 4,
+                       cart_comm, &request[2]);
+      ierr = MPI_Irecv(mpi_buf(recvbuf_t.data()), n, MPI_TYPE, top_rank, 3,
+                       cart_comm, &request[3]);
+      ScopedTimer wait_timer(timers, TIMER_HALO_WAIT);
+      double t0 = MPI_Wtime();
+      ierr = MPI_Waitall(4, request, status);
+      halo_wait_time += MPI_Wtime() - t0;
+    }
+#pragma omp barrier
+
+    // Unpack the receive buffers into the halo rows
+    if (!gpu_aware_mpi) {
+      Backend::update_device(recvbuf_b.data(), n, Q_MAIN);
+      Backend::update_device(recvbuf_t.data(), n, Q_MAIN);
+    }
+    Dyn::unpack_z(grid(), Q_MAIN, dev(state),
+                  at_bottom ? nullptr : dev(recvbuf_b.data()),
+                  at_top ? nullptr : dev(recvbuf_t.data()));
+  }
+
+  Dyn::walls_z(grid(), Q_MAIN, dev(state), dev(hy_dens_cell.data()),
+               at_bottom, at_top);
+}
+
+// Row pitch and allocation of the model arrays of this rank's nx x nz block
+void MiniWeatherSimulation::allocate_fields() {
+  // Row pitch of the state arrays. With --pad-pitch rows are rounded up to a
+  // whole number of 64-byte lines, then grown a line at a time while the row or
+  // plane stride lands near a multiple of 4 KiB, where the stencil loads from
+  // different rows or variables would alias in the L1 and the store buffer
+  pitch = nx + 2 * hx;
+  if (pad_pitch) {
+    auto aliases = [](long bytes) {
+      long r = bytes % 4096;
+      return bytes >= 4096 && (r < 256 || r > 4096 - 256);
+    };
+    pitch = (pitch + 7) / 8 * 8;
+    while (aliases(pitch * 8L) || aliases((nz + 2L * hs) * pitch * 8L)) {
+      pitch += 8;
+    }
+  }
+  plane = (nz + 2 * hs) * pitch;
+
+  // Allocate the model data
+  if (shm_halo && px > 1) {
+    allocate_shared_state();
+  }
+  state.resize(plane * NUM_VARS);
+  state_tmp.resize(plane * NUM_VARS);
+  // The fused kernels compute fluxes on the fly and never touch flux or tend,
+  // but unless z is fused too its stage still goes through them
+  if (!fused_z) {
+    flux.resize((nx + 1) * (nz + 1) * NUM_VARS);
+    tend.resize(nx * nz * NUM_VARS);
+  }
+  if (hx > hs) {
+    // The first stage of the deep x sweep covers 2 * (hx - hs) more columns
+    const int nw = nx + 2 * (hx - hs);
+    flux.resize(std::max(flux.size(), (size_t)(nw + 1) * nz * NUM_VARS));
+    tend.resize(std::max(tend.size(), (size_t)nw * nz * NUM_VARS));
+    if (data_spec_int == DATA_SPEC_INJECTION) {
+      inflow_flux.resize(2 * hs * nz * NUM_VARS);
+    }
+  }
+  zero_fields();
+  hy_dens_cell.resize(nz + 2 * hs);
+  hy_dens_theta_cell.resize(nz + 2 * hs);
+  hy_dens_int.resize(nz + 1);
+  hy_dens_theta_int.resize(nz + 1);
+  hy_pressure_int.resize(nz + 1);
+  // With a single process column (row) the x (z) halos are local copies, and
+  // the persistent x requests message the state columns directly, so
+  // --low-mem leaves out the message buffers those cases never touch
+  if (!low_mem ||
+      (px > 1 && (!persistent_halo || halo_bench_iters > 0))) {
+    sendbuf_l.resize(hx * nz * NUM_VARS);
+    sendbuf_r.resize(hx * nz * NUM_VARS);
+    recvbuf_l.resize(hx * nz * NUM_VARS);
+    recvbuf_r.resize(hx * nz * NUM_VARS);
+  }
+  if (!low_mem || pz > 1) {
+    sendbuf_b.resize(hs * nx * NUM_VARS);
+    sendbuf_t.resize(hs * nx * NUM_VARS);
+    recvbuf_b.resize(hs * nx * NUM_VARS);
+    recvbuf_t.resize(hs * nx * NUM_VARS);
+  }
+  wave_speed.assign(8 * max_threads(), 0.);
+  diag_sums.assign(8 * max_threads(), 0.);
+}
+
+// The initial state (or the restart) and the hydrostatic background and source
+// terms of this rank's block
+void MiniWeatherSimulation::init_fields() {
+  source.clear();
+  source_x.clear();
+  if (!restart_file.empty()) {
+    // Resume from the snapshot instead of integrating the initial condition
+    read_checkpoint_state();
+  }
+  // Pick the test case once; everything below is specialised for it
+  switch (data_spec_int) {
+  case DATA_SPEC_COLLISION:
+    init_case<CollisionCase>();
+    break;
+  case DATA_SPEC_THERMAL:
+    init_case<ThermalCase>();
+    break;
+  case DATA_SPEC_GRAVITY_WAVES:
+    init_case<GravityWavesCase>();
+    break;
+  case DATA_SPEC_DENSITY_CURRENT:
+    init_case<DensityCurrentCase>();
+    break;
+  case DATA_SPEC_INJECTION:
+    init_case<InjectionCase>();
+    break;
+  default:
+    if (mainproc) {
+      printf("Error: unknown data spec %d\n", data_spec_int);
     }
+    MPI_Abort(MPI_COMM_WORLD, -1);
+  }
+
+  // Forcings of the test cases, applied as source terms
+  if (data_spec_int == DATA_SPEC_GRAVITY_WAVES) {
+    // The apply loop used to add this forcing on each of its variable passes
+    // up to and including ID_WMOM; the source keeps that effective strength
+    add_source(ID_WMOM, [&](int i, int k) {
+      return (ID_WMOM + 1) * gravity_wave_forcing(i, k) * hy_dens_cell[hs + k];
+    });
   }
 }
 
-// Set this MPI task's halo values in the z-direction. This does not require MPI
-// because there is no MPI decomposition in the vertical direction
-void MiniWeatherSimulation::set_halo_values_z(double *state) {
-  int i, ll;
-  const double mnt_width = xlen / 8;
-  double x, xloc, mnt_deriv;
-  /////////////////////////////////////////////////
-  // TODO: THREAD ME
-  /////////////////////////////////////////////////
-  for (ll = 0; ll < NUM_VARS; ll++) {
-    for (i = 0; i < nx + 2 * hs; i++) {
-      if (ll == ID_WMOM) {
-        state[ll * (nz + 2 * hs) * (nx + 2 * hs) + (0) * (nx + 2 * hs) + i] =
-            0.;
-        state[ll * (nz + 2 * hs) * (nx + 2 * hs) + (1) * (nx + 2 * hs) + i] =
-            0.;
-        state[ll * (nz + 2 * hs) * (nx + 2 * hs) + (nz + hs) * (nx + 2 * hs) +
-              i] = 0.;
-        state[ll * (nz + 2 * hs) * (nx + 2 * hs) +
-              (nz + hs + 1) * (nx + 2 * hs) + i] = 0.;
-      } else if (ll == ID_UMOM) {
-        state[ll * (nz + 2 * hs) * (nx + 2 * hs) + (0) * (nx + 2 * hs) + i] =
-            state[ll * (nz + 2 * hs) * (nx + 2 * hs) + (hs) * (nx + 2 * hs) +
-                  i] /
-            hy_dens_cell[hs] * hy_dens_cell[0];
-        state[ll * (nz + 2 * hs) * (nx + 2 * hs) + (1) * (nx + 2 * hs) + i] =
-            state[ll * (nz + 2 * hs) * (nx + 2 * hs) + (hs) * (nx + 2 * hs) +
-                  i] /
-            hy_dens_cell[hs] * hy_dens_cell[1];
-        state[ll * (nz + 2 * hs) * (nx + 2 * hs) + (nz + hs) * (nx + 2 * hs) +
-              i] = state[ll * (nz + 2 * hs) * (nx + 2 * hs) +
-                         (nz + hs - 1) * (nx + 2 * hs) + i] /
-                   hy_dens_cell[nz + hs - 1] * hy_dens_cell[nz + hs];
-        state[ll * (nz + 2 * hs) * (nx + 2 * hs) +
-              (nz + hs + 1) * (nx + 2 * hs) + i] =
-            state[ll * (nz + 2 * hs) * (nx + 2 * hs) +
-                  (nz + hs - 1) * (nx + 2 * hs) + i] /
-            hy_dens_cell[nz + hs - 1] * hy_dens_cell[nz + hs + 1];
-      } else {
-        state[ll * (nz + 2 * hs) * (nx + 2 * hs) + (0) * (nx + 2 * hs) + i] =
-            state[ll * (nz + 2 * hs) * (nx + 2 * hs) + (hs) * (nx + 2 * hs) +
-                  i];
-        state[ll * (nz + 2 * hs) * (nx + 2 * hs) + (1) * (nx + 2 * hs) + i] =
-            state[ll * (nz + 2 * hs) * (nx + 2 * hs) + (hs) * (nx + 2 * hs) +
-                  i];
-        state[ll * (nz + 2 * hs) * (nx + 2 * hs) + (nz + hs) * (nx + 2 * hs) +
-              i] = state[ll * (nz + 2 * hs) * (nx + 2 * hs) +
-                         (nz + hs - 1) * (nx + 2 * hs) + i];
-        state[ll * (nz + 2 * hs) * (nx + 2 * hs) +
-              (nz + hs + 1) * (nx + 2 * hs) + i] =
-            state[ll * (nz + 2 * hs) * (nx + 2 * hs) +
-                  (nz + hs - 1) * (nx + 2 * hs) + i];
+// Split the nx_glob columns among the px process columns in proportion to
+// weights, keeping at least hx columns on each for the halo exchange
+void MiniWeatherSimulation::split_x(const std::vector<double> &weights) {
+  if ((int)weights.size() != px || nx_glob < px * hx) {
+    if (world_main) {
+      printf("Error: --balance-weights needs one weight per process column "
+             "(%d), and nx_glob at least %d\n",
+             px, px * hx);
+    }
+    MPI_Abort(MPI_COMM_WORLD, -1);
+  }
+  double total = 0., sum = 0.;
+  for (double w : weights) {
+    total += w;
+  }
+  std::vector<int> edge(px + 1, 0);
+  for (int c = 1; c < px; c++) {
+    sum += weights[c - 1];
+    edge[c] = std::min(std::max((int)round(nx_glob * sum / total),
+                                edge[c - 1] + hx),
+                       nx_glob - (px - c) * hx);
+  }
+  edge[px] = nx_glob;
+  i_beg = edge[x_coord];
+  nx = edge[x_coord + 1] - i_beg;
+}
+
+// Time balance_steps steps on the current split and split the columns again in
+// proportion to the cells per second achieved by each process column, which
+// goes at the pace of its slowest rank. Time blocked in the halo exchanges is
+// left out: it is the wait for slower neighbours. This picks up slower nodes
+// as well as extra work on some ranks, such as the inflow halo of
+// DATA_SPEC_INJECTION on the ranks at x = 0. The fields are rebuilt on the new
+// split, or restored if it is kept
+void MiniWeatherSimulation::balance_x() {
+  field_vector saved = state;
+  bool saved_persistent = persistent_halo;
+  int saved_switch = direction_switch;
+  persistent_halo = false; // Its requests are only built after this
+  perform_timestep(state.data(), state_tmp.data(), flux.data(), tend.data(),
+                   dt); // Warm-up
+  MPI_Barrier(comm);
+  double wait0 = halo_wait_time, t0 = MPI_Wtime();
+  for (int s = 0; s < balance_steps; s++) {
+    perform_timestep(state.data(), state_tmp.data(), flux.data(), tend.data(),
+                     dt);
+  }
+  double busy = MPI_Wtime() - t0 - (halo_wait_time - wait0);
+  persistent_halo = saved_persistent;
+  direction_switch = saved_switch;
+  halo_wait_time = 0.;
+  overlap_time = 0.;
+
+  // Busy time and width of every process column
+  std::vector<double> loc(2 * px, 0.), col(2 * px);
+  loc[x_coord] = busy;
+  loc[px + x_coord] = nx;
+  MPI_Allreduce(loc.data(), col.data(), 2 * px, MPI_DOUBLE, MPI_MAX, comm);
+  std::vector<double> rate(px);
+  double t_max = 0., t_sum = 0.;
+  for (int c = 0; c < px; c++) {
+    rate[c] = col[px + c] / std::max(col[c], 1e-9);
+    t_max = std::max(t_max, col[c]);
+    t_sum += col[c];
+  }
+  balance_before = t_max / (t_sum / px);
+
+  // The busy times the new split should give, from the measured rates
+  int old_beg = i_beg, old_nx = nx;
+  split_x(rate);
+  loc.assign(px, 0.);
+  loc[x_coord] = nx;
+  MPI_Allreduce(MPI_IN_PLACE, loc.data(), px, MPI_DOUBLE, MPI_MAX, comm);
+  double p_max = 0., p_sum = 0.;
+  int w_min = nx_glob, w_max = 0;
+  for (int c = 0; c < px; c++) {
+    p_max = std::max(p_max, loc[c] / rate[c]);
+    p_sum += loc[c] / rate[c];
+    w_min = std::min(w_min, (int)loc[c]);
+    w_max = std::max(w_max, (int)loc[c]);
+  }
+  // Keep the even split unless the slowest column gains over 2%
+  bool resplit = p_max < 0.98 * t_max;
+  if (world_main) {
+    printf("Load balance: busy time max/mean %.3lf over %d process columns "
+           "of the even split",
+           balance_before, px);
+    if (resplit) {
+      printf("; columns now %d to %d cells wide, predicted max/mean %.3lf\n",
+             w_min, w_max, p_max / (p_sum / px));
+    } else {
+      printf("; kept\n");
+    }
+  }
+  if (!resplit) {
+    i_beg = old_beg;
+    nx = old_nx;
+    state = saved;
+    state_tmp = saved;
+    return;
+  }
+  startup_lap(STARTUP_SETUP); // The timed steps
+  // Fresh arrays, so that --first-touch places the new pages
+  state = field_vector();
+  state_tmp = field_vector();
+  flux = field_vector();
+  tend = field_vector();
+  allocate_fields();
+  init_fields();
+}
+
+// With --balance or --balance-weights, report how evenly the ranks shared the
+// work of the run: the max/mean over ranks of the loop time not spent waiting
+// for halos or writing output
+void MiniWeatherSimulation::report_balance(double loop_time) {
+  if (!balance && balance_weights.empty()) {
+    return;
+  }
+  double busy = loop_time - halo_wait_time - output_time, mx, sum;
+  MPI_Reduce(&busy, &mx, 1, MPI_DOUBLE, MPI_MAX, 0, comm);
+  MPI_Reduce(&busy, &sum, 1, MPI_DOUBLE, MPI_SUM, 0, comm);
+  if (world_main) {
+    printf("Load imbalance (max/mean busy time over ranks): %.3lf",
+           mx / (sum / nranks));
+    if (balance) {
+      printf(" (even split at start-up, per process column: %.3lf)",
+             balance_before);
+    }
+    printf("\n");
+  }
+}
+
+// Choose the px x pz process grid. Every factorization of nranks is scored by
+// the number of cells a rank exchanges per halo update (a direction with a
+// single rank costs nothing: x is periodic and copied locally, z applies the
+// wall condition), and the cheapest shape wins. Ties keep the x-slab layout.
+// --pz overrides the search
+void MiniWeatherSimulation::choose_process_grid() {
+  if (pz_req > 0) {
+    if (nranks % pz_req != 0) {
+      if (myrank == 0) {
+        printf("Error: --pz %d does not divide the %d MPI ranks\n", pz_req,
+               nranks);
       }
+      MPI_Abort(MPI_COMM_WORLD, -1);
+    }
+    pz = pz_req;
+    px = nranks / pz;
+    return;
+  }
+  double best_cost = -1;
+  for (int pz_try = 1; pz_try <= nranks; pz_try++) {
+    if (nranks % pz_try != 0) {
+      continue;
+    }
+    int px_try = nranks / pz_try;
+    // Every rank needs enough cells to fill its neighbours' halos
+    if (nx_glob / px_try < hx || nz_glob / pz_try < hs) {
+      continue;
     }
+    double nx_loc = ((double)nx_glob) / px_try;
+    double nz_loc = ((double)nz_glob) / pz_try;
+    double cost = (px_try > 1 ? 2 * hs * nz_loc : 0.) +
+                  (pz_try > 1 ? 2 * hs * nx_loc : 0.);
+    if (best_cost < 0 || cost < best_cost) {
+      best_cost = cost;
+      px = px_try;
+      pz = pz_try;
+    }
+  }
+  if (best_cost < 0) {
+    px = nranks;
+    pz = 1;
   }
 }
 
-// 声明与调用需一致：int *argc, char ***argv
-void MiniWeatherSimulation::init(int *argc, char ***argv) {
-  int i, k, ii, kk, ll, ierr, inds, i_end;
-  double x, z, r, u, w, t, hr, ht, nper;
-
-  // Initialize config from macros
-  nx_glob = _NX;
-  nz_glob = _NZ;
-  sim_time = _SIM_TIME;
-  output_freq = _OUT_FREQ;
-  data_spec_int = _DATA_SPEC;
-
-  // Simple command line argument parsing (需要解引用指针)
-  // 注意：mpi版本一般使用 MPI_Init(&argc, &argv)，所以这里传入指针是符合 MPI
-  // 标准习惯的 解析时需要 (*argc) 和 (*argv)
-  int local_argc = *argc;
-  char **local_argv = *argv;
-
+// Parse the command line options, or those of an ensemble member's line
+void MiniWeatherSimulation::parse_options(int local_argc, char **local_argv) {
   for (int i = 1; i < local_argc; i++) {
     std::string arg = local_argv[i];
     if (arg == "--nx" && i + 1 < local_argc) {
@@ -709,6 +2877,182 @@ void MiniWeatherSimulation::init(int *argc, char ***argv) {
       output_freq = atof(local_argv[++i]);
     } else if (arg == "--data" && i + 1 < local_argc) {
       data_spec_int = atoi(local_argv[++i]);
+    } else if (arg == "--amp" && i + 1 < local_argc) {
+      amp = atof(local_argv[++i]);
+    } else if (arg == "--hv-beta" && i + 1 < local_argc) {
+      hyperviscosity = atof(local_argv[++i]);
+    } else if (arg == "--ensemble" && i + 1 < local_argc) {
+      ensemble_file = local_argv[++i];
+    } else if (arg == "--overlap") {
+      overlap = true;
+    } else if (arg == "--pz" && i + 1 < local_argc) {
+      pz_req = atoi(local_argv[++i]);
+    } else if (arg == "--balance") {
+      balance = true;
+    } else if (arg == "--balance-steps" && i + 1 < local_argc) {
+      balance = true;
+      balance_steps = std::max(atoi(local_argv[++i]), 1);
+    } else if (arg == "--balance-weights" && i + 1 < local_argc) {
+      std::stringstream list(local_argv[++i]);
+      std::string w;
+      balance_weights.clear();
+      while (std::getline(list, w, ',')) {
+        balance_weights.push_back(atof(w.c_str()));
+        if (balance_weights.back() <= 0.) {
+          printf("Error: --balance-weights expects positive weights\n");
+          exit(-1);
+        }
+      }
+    } else if (arg == "--fused") {
+      fused = true;
+    } else if (arg == "--low-mem") {
+      low_mem = fused = mem_report = true;
+    } else if (arg == "--mem-report") {
+      mem_report = true;
+    } else if (arg == "--mem-gb" && i + 1 < local_argc) {
+      mem_gb = atof(local_argv[++i]);
+      mem_report = true;
+    } else if (arg == "--device-mem-gb" && i + 1 < local_argc) {
+      device_mem_gb = atof(local_argv[++i]);
+      mem_report = true;
+    } else if (arg == "--persistent-halo") {
+      persistent_halo = true;
+    } else if (arg == "--shm-halo") {
+      shm_halo = true;
+    } else if (arg == "--deep-halo") {
+      deep_halo = true;
+    } else if (arg == "--halo-bench" && i + 1 < local_argc) {
+      halo_bench_iters = atoi(local_argv[++i]);
+    } else if (arg == "--simd" && i + 1 < local_argc) {
+      arg = local_argv[++i];
+      if (arg == "auto") {
+        // The 512-bit kernels measured slower than AVX2 on AVX-512 parts (the
+        // wider units clock lower), so they are only used when asked for
+        simd_isa = std::min(best_simd_isa(), SIMD_AVX2);
+      } else if (arg == "avx512") {
+        simd_isa = SIMD_AVX512;
+      } else if (arg == "avx2") {
+        simd_isa = SIMD_AVX2;
+      } else if (arg == "base") {
+        simd_isa = SIMD_BASE;
+      } else if (arg != "off") {
+        printf("Error: unknown --simd kernel %s\n", arg.c_str());
+        exit(-1);
+      }
+      if (simd_isa > best_simd_isa()) {
+        printf("Error: this CPU cannot run the --simd %s kernels\n",
+               arg.c_str());
+        exit(-1);
+      }
+    } else if (arg == "--checkpoint-every" && i + 1 < local_argc) {
+      checkpoint_every = atof(local_argv[++i]);
+    } else if (arg == "--checkpoint-file" && i + 1 < local_argc) {
+      checkpoint_file = local_argv[++i];
+    } else if (arg == "--restart" && i + 1 < local_argc) {
+      restart_file = local_argv[++i];
+    } else if (arg == "--timers" && i + 1 < local_argc) {
+      timers.enabled = true;
+      timers_file = local_argv[++i];
+    } else if (arg == "--diag-every" && i + 1 < local_argc) {
+      diag_every = atoi(local_argv[++i]);
+    } else if (arg == "--diag-file" && i + 1 < local_argc) {
+      diag_file = local_argv[++i];
+    } else if (arg == "--out-vars" && i + 1 < local_argc) {
+      const char *names[4] = {"dens", "uwnd", "wwnd", "theta"};
+      std::stringstream list(local_argv[++i]);
+      std::string name;
+      for (int v = 0; v < 4; v++) {
+        out_var[v] = false;
+      }
+      while (std::getline(list, name, ',')) {
+        int v = 0;
+        while (v < 4 && name != names[v]) {
+          v++;
+        }
+        if (v == 4) {
+          printf("Error: unknown output variable %s\n", name.c_str());
+          exit(-1);
+        }
+        out_var[v] = true;
+      }
+    } else if ((arg == "--out-stride" || arg == "--out-block") &&
+               i + 1 < local_argc) {
+      out_mean = (arg == "--out-block");
+      out_factor = atoi(local_argv[++i]);
+      if (out_factor < 1) {
+        printf("Error: %s expects a positive factor\n", arg.c_str());
+        exit(-1);
+      }
+    } else if (arg == "--out-float") {
+      out_float = true;
+    } else if (arg == "--insitu" && i + 1 < local_argc) {
+      insitu_list = local_argv[++i];
+    } else if (arg == "--insitu-every" && i + 1 < local_argc) {
+      insitu_every = atoi(local_argv[++i]);
+    } else if (arg == "--insitu-var" && i + 1 < local_argc) {
+      arg = local_argv[++i];
+      insitu_var = 0;
+      while (insitu_var < NUM_INSITU_FIELDS &&
+             arg != insitu_field_names[insitu_var]) {
+        insitu_var++;
+      }
+      if (insitu_var == NUM_INSITU_FIELDS) {
+        printf("Error: unknown --insitu-var %s\n", arg.c_str());
+        exit(-1);
+      }
+    } else if (arg == "--insitu-bins" && i + 1 < local_argc) {
+      insitu_bins = atoi(local_argv[++i]);
+    } else if (arg == "--insitu-slice" && i + 1 < local_argc) {
+      arg = local_argv[++i];
+      if (sscanf(arg.c_str(), "%c=%d", &insitu_slice_dir, &insitu_slice_at) !=
+              2 ||
+          (insitu_slice_dir != 'x' && insitu_slice_dir != 'z')) {
+        printf("Error: --insitu-slice expects z=K or x=I, got %s\n",
+               arg.c_str());
+        exit(-1);
+      }
+    } else if (arg == "--insitu-width" && i + 1 < local_argc) {
+      insitu_width = atoi(local_argv[++i]);
+    } else if (arg == "--async-output") {
+      async_output = true;
+    } else if (arg == "--pad-pitch") {
+      pad_pitch = true;
+    } else if (arg == "--adaptive-dt") {
+      adaptive_dt = true;
+    } else if (arg == "--integrator" && i + 1 < local_argc) {
+      arg = local_argv[++i];
+      integrator = nullptr;
+      for (const Integrator &in : integrators) {
+        if (arg == in.name) {
+          integrator = &in;
+        }
+      }
+      if (!integrator) {
+        printf("Error: unknown --integrator %s\n", arg.c_str());
+        exit(-1);
+      }
+    } else if (arg == "--cfl" && i + 1 < local_argc) {
+      fixed_cfl = atof(local_argv[++i]);
+    } else if (arg == "--adaptive-cfl" && i + 1 < local_argc) {
+      adaptive_dt = true;
+      adaptive_cfl = atof(local_argv[++i]);
+    } else if (arg == "--first-touch") {
+      first_touch = true;
+    } else if (arg == "--numa-report") {
+      numa_report = true;
+#ifdef _SPECIALIZE
+    } else if (arg == "--generic-kernels") {
+      generic_kernels = true;
+#endif
+    } else if (arg == "--tile" && i + 1 < local_argc) {
+      arg = local_argv[++i];
+      if (arg == "auto") {
+        tile_auto = true;
+      } else if (sscanf(arg.c_str(), "%dx%d", &tile_k, &tile_i) != 2 ||
+                 tile_k <= 0 || tile_i <= 0) {
+        printf("Error: --tile expects KxI or auto, got %s\n", arg.c_str());
+        exit(-1);
+      }
     } else if (arg == "--help" || arg == "-h") {
       if (myrank == 0) {
         printf("Usage: ./miniWeather_mpi [options]\n");
@@ -721,28 +3065,367 @@ void MiniWeatherSimulation::init(int *argc, char ***argv) {
                (double)_OUT_FREQ);
         printf("  --data <int>    Data specification (default: %d)\n",
                _DATA_SPEC);
+        printf("  --amp <float>   Scale the initial perturbation (default: "
+               "1)\n");
+        printf("  --hv-beta <float>  Hyperviscosity coefficient (default: "
+               "%lf)\n",
+               hv_beta);
+        printf("  --ensemble <path>  Run one member per line of <path> on its "
+               "own share of the ranks\n");
+        printf("  --overlap       Overlap x halo exchange with interior "
+               "fluxes\n");
+        printf("  --pz <int>      MPI ranks in z (default: chosen to minimise "
+               "halo volume)\n");
+        printf("  --balance       Split x by the throughput of each process "
+               "column, timed at start-up\n");
+        printf("  --balance-steps <int>  Steps timed by --balance (default: "
+               "10)\n");
+        printf("  --balance-weights <list>  Split x in these proportions, one "
+               "per process column\n");
+        printf("  --fused         Single-pass flux/tendency/update kernels\n");
+        printf("  --low-mem       Fused x and z kernels without flux/tend "
+               "arrays, and a memory table\n");
+        printf("  --mem-report    Print the memory used per rank at "
+               "startup\n");
+        printf("  --mem-gb <float>  Host memory (GiB) the table sizes the "
+               "largest one-rank grid for (default: 0, this node's)\n");
+        printf("  --device-mem-gb <float>  Device memory (GiB) of the same "
+               "estimate in GPU builds (default: 80)\n");
+        printf("  --persistent-halo  Persistent MPI requests for the x halo\n");
+        printf("  --shm-halo      Read the x halos of on-node neighbours from "
+               "an MPI-3 shared window\n");
+        printf("  --deep-halo     Exchange hs x halo columns per RK stage once "
+               "per x sweep\n");
+        printf("  --halo-bench <int> Benchmark x halo paths for <int> "
+               "exchanges and exit\n");
+        printf("  --tile <KxI|auto>  Cache-block compute_tendencies_z in "
+               "K x I tiles\n");
+        printf("  --pad-pitch     Pad state rows to avoid 4K aliasing\n");
+        printf("  --integrator <rk3|rk4>  Runge-Kutta scheme of each "
+               "direction (default: rk3)\n");
+        printf("  --cfl <float>   Courant number of the time step, against "
+               "max_speed (default:");
+        for (int n = 0; n < NUM_INTEGRATORS; n++) {
+          printf(" %.2lf for %s%s", cfl * integrators[n].cfl_scale,
+                 integrators[n].name, n + 1 < NUM_INTEGRATORS ? "," : ")\n");
+        }
+        printf("  --adaptive-dt   Take each time step from the measured "
+               "signal speed\n");
+        printf("  --adaptive-cfl <float>  Same, at this Courant number "
+               "(default:");
+        for (int n = 0; n < NUM_INTEGRATORS; n++) {
+          printf(" %.2lf for %s%s",
+                 default_adaptive_cfl * integrators[n].cfl_scale,
+                 integrators[n].name, n + 1 < NUM_INTEGRATORS ? "," : ")\n");
+        }
+        printf("  --first-touch   Zero the model arrays in parallel so pages "
+               "land on the computing thread's NUMA node\n");
+        printf("  --numa-report   Print thread-to-core binding and NUMA page "
+               "placement\n");
+#ifdef _SPECIALIZE
+        printf("  --generic-kernels  Run the generic rather than the "
+               "specialised stages\n");
+#endif
+        printf("  --out-vars <list>  Output only these of dens,uwnd,wwnd,theta"
+               "\n");
+        printf("  --out-stride <int>  Output every <int>-th cell in x and z\n");
+        printf("  --out-block <int>   Output means of <int> x <int> cell "
+               "blocks\n");
+        printf("  --out-float     Store the output fields as float\n");
+        printf("  --insitu <list>  In-situ analysis by any of stats,slice,"
+               "image\n");
+        printf("  --insitu-every <int>  Steps between in-situ calls (default: "
+               "100)\n");
+        printf("  --insitu-var <name>   Field of the histogram, slice and "
+               "image (default: theta)\n");
+        printf("  --insitu-bins <int>   Histogram bins (default: 16)\n");
+        printf("  --insitu-slice <z=K|x=I>  Row or column of the slice "
+               "(default: the middle row)\n");
+        printf("  --insitu-width <int>  Widest image in pixels (default: "
+               "512)\n");
+        printf("  --async-output  Write output frames behind the time "
+               "stepping\n");
+        printf("  --simd <auto|avx512|avx2|base|off>  Vectorised flux "
+               "kernels (not used by --fused)\n");
+        printf("  --checkpoint-every <float>  Model seconds between "
+               "checkpoints\n");
+        printf("  --checkpoint-file <path>    Checkpoint file (default: "
+               "checkpoint.bin)\n");
+        printf("  --timers <path>  Time each phase; write a JSON (or .csv) "
+               "report\n");
+        printf("  --diag-every <int>  Log mass and energy every <int> steps "
+               "without an extra pass\n");
+        printf("  --diag-file <path>  Diagnostics log (default: "
+               "diagnostics.csv)\n");
+        printf("  --restart <path>  Resume from a checkpoint; its grid and "
+               "data spec override --nx/--nz/--data\n");
       }
       MPI_Finalize();
       exit(0);
     }
   }
+}
+
+// Split MPI_COMM_WORLD into one contiguous group of ranks per member of the
+// ensemble file and give this rank its member's options. A member is a line
+// of options in the command-line syntax; blank lines and lines starting with #
+// are skipped. Members share the grid, run time, output frequency, integrator
+// and time step settings of the command line, and an adaptive step is
+// set by the fastest signal over all members, so they take identical time
+// steps and can write their frames into one output.nc along a member
+// dimension: output() is collective over MPI_COMM_WORLD
+void MiniWeatherSimulation::split_ensemble() {
+  std::string text, line, word;
+  std::vector<std::string> lines;
+  int len = 0;
+
+  if (world_main) {
+    std::ifstream in(ensemble_file);
+    if (!in) {
+      printf("Error: cannot read ensemble file %s\n", ensemble_file.c_str());
+      MPI_Abort(MPI_COMM_WORLD, -1);
+    }
+    std::stringstream ss;
+    ss << in.rdbuf();
+    text = ss.str();
+    len = text.size();
+  }
+  MPI_Bcast(&len, 1, MPI_INT, 0, MPI_COMM_WORLD);
+  text.resize(len);
+  MPI_Bcast(&text[0], len, MPI_CHAR, 0, MPI_COMM_WORLD);
+  std::istringstream in(text);
+  while (std::getline(in, line)) {
+    size_t p = line.find_first_not_of(" \t\r");
+    if (p != std::string::npos && line[p] != '#') {
+      lines.push_back(line);
+    }
+  }
+  n_members = lines.size();
+  if (n_members == 0 || n_members > nranks) {
+    if (world_main) {
+      printf("Error: %s has %d members for %d ranks; each member needs at "
+             "least one rank\n",
+             ensemble_file.c_str(), n_members, nranks);
+    }
+    MPI_Abort(MPI_COMM_WORLD, -1);
+  }
+  if (world_main) {
+    printf("Ensemble: %d members of %s, %d to %d ranks each\n", n_members,
+           ensemble_file.c_str(), nranks / n_members,
+           (nranks + n_members - 1) / n_members);
+  }
+  member = myrank * n_members / nranks;
+  MPI_Comm_split(MPI_COMM_WORLD, member, myrank, &comm);
+  MPI_Comm_size(comm, &nranks);
+  MPI_Comm_rank(comm, &myrank);
+
+  // The member's options, parsed on top of the command line ones
+  std::vector<std::string> words(1, ensemble_file);
+  std::istringstream ws(lines[member]);
+  while (ws >> word) {
+    words.push_back(word);
+  }
+  std::vector<char *> member_argv;
+  for (auto &w : words) {
+    member_argv.push_back(&w[0]);
+  }
+  int nx0 = nx_glob, nz0 = nz_glob;
+  double time0 = sim_time, freq0 = output_freq;
+  bool adaptive0 = adaptive_dt;
+  double adaptive_cfl0 = adaptive_cfl, cfl0 = fixed_cfl;
+  const Integrator *integrator0 = integrator;
+  parse_options(member_argv.size(), member_argv.data());
+  if (nx_glob != nx0 || nz_glob != nz0 || sim_time != time0 ||
+      output_freq != freq0 || integrator != integrator0 ||
+      fixed_cfl != cfl0 || adaptive_dt != adaptive0 ||
+      adaptive_cfl != adaptive_cfl0 || (fused && overlap) ||
+      (adaptive_dt && (fused || simd_isa != SIMD_NONE)) ||
+      (deep_halo && (fused || overlap || simd_isa != SIMD_NONE))) {
+    if (myrank == 0) {
+      printf("Error: ensemble member %d: --nx, --nz, --time, --freq, "
+             "--integrator, --cfl, --adaptive-dt and --adaptive-cfl are "
+             "shared by all members, "
+             "--fused excludes --overlap and --adaptive-dt, and --deep-halo "
+             "excludes --fused, --overlap and --simd\n",
+             member);
+    }
+    MPI_Abort(MPI_COMM_WORLD, -1);
+  }
+
+  // Per-member checkpoint and timer files: name.bin becomes name.m<member>.bin
+  auto tagged = [&](std::string &path) {
+    size_t dot = path.rfind('.'), slash = path.rfind('/');
+    if (dot == std::string::npos ||
+        (slash != std::string::npos && dot < slash)) {
+      dot = path.size();
+    }
+    path.insert(dot, ".m" + std::to_string(member));
+  };
+  tagged(checkpoint_file);
+  if (!restart_file.empty()) {
+    tagged(restart_file);
+  }
+  if (!timers_file.empty()) {
+    tagged(timers_file);
+  }
+  tagged(diag_file);
+  tagged(insitu_stats_file);
+  tagged(insitu_slice_file);
+  tagged(insitu_image_suffix);
+}
+
+// 声明与调用需一致：int *argc, char ***argv
+void MiniWeatherSimulation::init(int *argc, char ***argv) {
+  int ierr, i_end, k_end;
+  double nper;
+  int dims[2], periods[2], coords[2];
+
+  startup_mark = std::chrono::steady_clock::now();
+
+  // Initialize config from macros
+  nx_glob = _NX;
+  nz_glob = _NZ;
+  sim_time = _SIM_TIME;
+  output_freq = _OUT_FREQ;
+  data_spec_int = _DATA_SPEC;
+
+  // Simple command line argument parsing (需要解引用指针)
+  // 注意：mpi版本一般使用 MPI_Init(&argc, &argv)，所以这里传入指针是符合 MPI
+  // 标准习惯的 解析时需要 (*argc) 和 (*argv)
+  parse_options(*argc, *argv);
   dx = xlen / nx_glob;
   dz = zlen / nz_glob;
+  if (Backend::device &&
+      (fused || low_mem || simd_isa != SIMD_NONE || tile_k > 0 || tile_auto ||
+       deep_halo || persistent_halo || shm_halo || halo_bench_iters > 0 ||
+       balance)) {
+    // These paths keep their own host loops or host-side MPI buffers
+    printf("Error: the %s build does not support --fused, --low-mem, --simd, "
+           "--tile, --deep-halo, --persistent-halo, --shm-halo, --halo-bench "
+           "or --balance\n",
+           Backend::name);
+    exit(-1);
+  }
+  if (fused && overlap) {
+    printf("Error: --fused (or --low-mem) and --overlap cannot be combined\n");
+    exit(-1);
+  }
+  if (adaptive_dt && (fused || simd_isa != SIMD_NONE)) {
+    // Only the scalar flux kernels measure the signal speeds
+    printf("Error: --adaptive-dt cannot be combined with --fused, --low-mem or "
+           "--simd\n");
+    exit(-1);
+  }
+  if (deep_halo && (fused || overlap || simd_isa != SIMD_NONE)) {
+    // The deep x sweep has its own scalar flux loop
+    printf("Error: --deep-halo cannot be combined with --fused, --low-mem, "
+           "--overlap or --simd\n");
+    exit(-1);
+  }
+  if (mem_gb < 0. || device_mem_gb <= 0.) {
+    printf("Error: --mem-gb expects a size or 0, --device-mem-gb a positive "
+           "size\n");
+    exit(-1);
+  }
 
-  ierr = MPI_Init(argc, argv);
+  // Only the master thread of the time step's parallel region calls MPI
+  int provided, required = MPI_THREAD_FUNNELED;
+#ifdef _PNETCDF
+  if (async_output) {
+    // The I/O thread calls into MPI-IO while the main thread exchanges halos
+    required = MPI_THREAD_MULTIPLE;
+  }
+#endif
+  // miniWeather_bench starts MPI once for all the grids it builds
+  int initialized;
+  MPI_Initialized(&initialized);
+  owns_mpi = !initialized;
+  if (owns_mpi) {
+    ierr = MPI_Init_thread(argc, argv, required, &provided);
+  } else {
+    MPI_Query_thread(&provided);
+  }
   // 初始化 MPI 环境
   ierr = MPI_Comm_size(MPI_COMM_WORLD, &nranks);
   ierr = MPI_Comm_rank(MPI_COMM_WORLD, &myrank);
-  nper = ((double)nx_glob) / nranks;
-  i_beg = round(nper * (myrank));
-  i_end = round(nper * ((myrank) + 1)) - 1;
-  nx = i_end - i_beg + 1;
-  left_rank = myrank - 1;
-  if (left_rank == -1)
-    left_rank = nranks - 1;
-  right_rank = myrank + 1;
-  if (right_rank == nranks)
-    right_rank = 0;
+  world_main = (myrank == 0);
+  if (!ensemble_file.empty()) {
+    split_ensemble();
+  }
+#ifdef _FUSED_Z
+  fused_z = fused;
+#else
+  fused_z = low_mem;
+#endif
+  // The integrator sets the width of the deep halos and the default Courant
+  // numbers
+  if (deep_halo) {
+    hx = hs * integrator->num_stages;
+  }
+  if (fixed_cfl <= 0.) {
+    fixed_cfl = cfl * integrator->cfl_scale;
+  }
+  if (adaptive_cfl <= 0.) {
+    adaptive_cfl = default_adaptive_cfl * integrator->cfl_scale;
+  }
+#ifdef _PNETCDF
+  out_threaded = async_output && (provided == MPI_THREAD_MULTIPLE);
+#endif
+
+  // A restart takes the grid and the case from the checkpoint
+  CheckpointHeader hdr;
+  if (!restart_file.empty()) {
+    read_checkpoint_header(hdr);
+    dx = xlen / nx_glob;
+    dz = zlen / nz_glob;
+  }
+
+  // Lay the ranks out on a pz x px Cartesian grid, periodic in x only. Rank
+  // order is kept (no reordering) so x neighbours stay adjacent in rank space
+  choose_process_grid();
+  dims[0] = pz;
+  dims[1] = px;
+  periods[0] = 0;
+  periods[1] = 1;
+  ierr = MPI_Cart_create(comm, 2, dims, periods, 0, &cart_comm);
+  ierr = MPI_Cart_coords(cart_comm, myrank, 2, coords);
+  ierr = MPI_Cart_shift(cart_comm, 1, 1, &left_rank, &right_rank);
+  msg_left_rank = left_rank;
+  msg_right_rank = right_rank;
+  ierr = MPI_Cart_shift(cart_comm, 0, 1, &bottom_rank, &top_rank);
+
+  x_coord = coords[1];
+  bind_device();
+  gpu_aware_mpi = query_gpu_aware_mpi();
+  // Ranks on the host cores of a device build take col_weight of the columns
+  // of a device rank; a process column goes at the pace of its slowest rank
+  std::vector<double> col_weights(px, HUGE_VAL);
+  col_weights[x_coord] = col_weight;
+  ierr = MPI_Allreduce(MPI_IN_PLACE, col_weights.data(), px, MPI_DOUBLE,
+                       MPI_MIN, cart_comm);
+  if (!balance_weights.empty()) {
+    split_x(balance_weights);
+  } else if (*std::min_element(col_weights.begin(), col_weights.end()) < 1.) {
+    split_x(col_weights);
+  } else {
+    nper = ((double)nx_glob) / px;
+    i_beg = round(nper * (coords[1]));
+    i_end = round(nper * ((coords[1]) + 1)) - 1;
+    nx = i_end - i_beg + 1;
+  }
+  nper = ((double)nz_glob) / pz;
+  k_beg = round(nper * (coords[0]));
+  k_end = round(nper * ((coords[0]) + 1)) - 1;
+  nz = k_end - k_beg + 1;
+  if (hx > hs && nx_glob < px * hx) {
+    // Each rank fills the deep halos of its neighbours from its own columns
+    if (world_main) {
+      printf("Error: --deep-halo needs at least %d columns per process "
+             "column\n",
+             hx);
+    }
+    MPI_Abort(MPI_COMM_WORLD, -1);
+  }
 
   ////////////////////////////////////////////////////////////////////////////////
   ////////////////////////////////////////////////////////////////////////////////
@@ -750,399 +3433,1046 @@ void MiniWeatherSimulation::init(int *argc, char ***argv) {
   ////////////////////////////////////////////////////////////////////////////////
   ////////////////////////////////////////////////////////////////////////////////
 
-  // Vertical direction isn't MPI-ized, so the rank's local values = the global
-  // values
-  k_beg = 0;
-  nz = nz_glob;
   mainproc = (myrank == 0);
+  startup_lap(STARTUP_MPI);
 
-  // Allocate the model data
-  state.resize((nx + 2 * hs) * (nz + 2 * hs) * NUM_VARS);
-  state_tmp.resize((nx + 2 * hs) * (nz + 2 * hs) * NUM_VARS);
-  flux.resize((nx + 1) * (nz + 1) * NUM_VARS);
-  tend.resize(nx * nz * NUM_VARS);
-  hy_dens_cell.resize(nz + 2 * hs);
-  hy_dens_theta_cell.resize(nz + 2 * hs);
-  hy_dens_int.resize(nz + 1);
-  hy_dens_theta_int.resize(nz + 1);
-  hy_pressure_int.resize(nz + 1);
-  sendbuf_l.resize(hs * nz * NUM_VARS);
-  sendbuf_r.resize(hs * nz * NUM_VARS);
-  recvbuf_l.resize(hs * nz * NUM_VARS);
-  recvbuf_r.resize(hs * nz * NUM_VARS);
+  allocate_fields();
+  startup_lap(STARTUP_ALLOC);
 
   // Define the maximum stable time step based on an assumed maximum wind speed
-  dt = dmin(dx, dz) / max_speed * cfl;
+  dt = dmin(dx, dz) / max_speed * fixed_cfl;
+  dt_fixed = dt;
   // Set initial elapsed model time and output_counter to zero
   etime = 0.;
   output_counter = 0.;
+  if (!restart_file.empty()) {
+    etime = hdr.etime;
+    output_counter = hdr.output_counter;
+    checkpoint_counter = hdr.checkpoint_counter;
+    num_out = hdr.num_out;
+    direction_switch = hdr.direction_switch;
+    mass0 = hdr.mass0;
+    te0 = hdr.te0;
+    if (adaptive_dt && hdr.dt > 0) {
+      dt = hdr.dt;
+      wave_speed_glob[0] = hdr.wave_speed[0];
+      wave_speed_glob[1] = hdr.wave_speed[1];
+    }
+  }
 
   // If I'm the main process in MPI, display some grid information
-  if (mainproc) {
+  if (world_main) {
     printf("nx_glob, nz_glob: %d %d\n", nx_glob, nz_glob);
+    printf("px, pz: %d %d\n", px, pz);
     printf("dx,dz: %lf %lf\n", dx, dz);
     printf("dt: %lf\n", dt);
+    if (!restart_file.empty()) {
+      printf("Restarting from %s at t = %lf\n", restart_file.c_str(), etime);
+    }
+    if (integrator != &integrators[0]) {
+      printf("Integrator: %s, %d stages per direction, Courant number %.2lf\n",
+             integrator->name, integrator->num_stages, fixed_cfl);
+    }
+    if (simd_isa != SIMD_NONE) {
+      const char *isa_names[] = {"off", "base", "avx2", "avx512"};
+      printf("SIMD flux kernels: %s\n", isa_names[simd_isa]);
+    }
   }
   // Want to make sure this info is displayed before further output
-  ierr = MPI_Barrier(MPI_COMM_WORLD);
-
-  //////////////////////////////////////////////////////////////////////////
-  // Initialize the cell-averaged fluid state via Gauss-Legendre quadrature
-  //////////////////////////////////////////////////////////////////////////
-  for (k = 0; k < nz + 2 * hs; k++) {
-    for (i = 0; i < nx + 2 * hs; i++) {
-      // Initialize the state to zero
-      for (ll = 0; ll < NUM_VARS; ll++) {
-        inds = ll * (nz + 2 * hs) * (nx + 2 * hs) + k * (nx + 2 * hs) + i;
-        state[inds] = 0.;
-      }
-      // Use Gauss-Legendre quadrature to initialize a hydrostatic balance +
-      // temperature perturbation
-      for (kk = 0; kk < nqpoints; kk++) {
-        for (ii = 0; ii < nqpoints; ii++) {
-          // Compute the x,z location within the global domain based on cell and
-          // quadrature index
-          x = (i_beg + i - hs + 0.5) * dx + (qpoints[ii] - 0.5) * dx;
-          z = (k_beg + k - hs + 0.5) * dz + (qpoints[kk] - 0.5) * dz;
-
-          // Set the fluid state based on the user's specification
-          if (data_spec_int == DATA_SPEC_COLLISION) {
-            collision(x, z, r, u, w, t, hr, ht);
-          }
-          if (data_spec_int == DATA_SPEC_THERMAL) {
-            thermal(x, z, r, u, w, t, hr, ht);
-          }
-          if (data_spec_int == DATA_SPEC_GRAVITY_WAVES) {
-            gravity_waves(x, z, r, u, w, t, hr, ht);
-          }
-          if (data_spec_int == DATA_SPEC_DENSITY_CURRENT) {
-            density_current(x, z, r, u, w, t, hr, ht);
+  ierr = MPI_Barrier(comm);
+
+  startup_lap(STARTUP_MPI);
+
+  init_fields();
+  startup_lap(STARTUP_BACKGROUND);
+  if (balance) {
+    balance_x();
+  }
+  if (Backend::device) {
+    map_fields();
+  }
+
+  if (persistent_halo || halo_bench_iters > 0) {
+    init_persistent_halo_x();
+  }
+  if (overlap && px > 1) {
+    time_blocking_halo_x();
+  }
+  compare_halo_paths();
+#ifdef _PNETCDF
+  if (output_freq >= 0) {
+    setup_output_grid();
+  }
+  if (async_output && output_freq >= 0) {
+    output_async_open();
+    if (world_main) {
+      printf("Async output: %s\n",
+             out_threaded ? "I/O thread" : "non-blocking puts");
+    }
+  }
+#endif
+  // The fused z kernel does not use flux or tend, so there is nothing to tile
+  if ((tile_k > 0 || tile_auto) && !flux.empty()) {
+    tune_tiles_z();
+  }
+#ifdef _SPECIALIZE
+  choose_stage();
+#endif
+  setup_insitu();
+  startup_lap(STARTUP_SETUP);
+  report_startup();
+  if (mem_report) {
+    report_memory();
+  }
+  if (numa_report) {
+    report_numa_placement();
+  }
+}
+
+// Initial state (on a cold start) and hydrostatic background of test case Case
+template <class Case> void MiniWeatherSimulation::init_case() {
+  if (restart_file.empty()) {
+    init_state<Case>();
+  }
+  startup_lap(STARTUP_STATE);
+  init_background<Case>();
+}
+
+// Initialize the cell-averaged fluid state, halos included, via Gauss-Legendre
+// quadrature. The background depends only on z, so it is evaluated once for
+// each of the nqpoints quadrature heights of a row rather than at every point
+template <class Case> void MiniWeatherSimulation::init_state() {
+  std::vector<double> hr_q((nz + 2 * hs) * nqpoints);
+  std::vector<double> ht_q((nz + 2 * hs) * nqpoints);
+  for (int k = 0; k < nz + 2 * hs; k++) {
+    for (int kk = 0; kk < nqpoints; kk++) {
+      double z = (k_beg + k - hs + 0.5) * dz + (qpoints[kk] - 0.5) * dz;
+      Case::background(z, hr_q[k * nqpoints + kk], ht_q[k * nqpoints + kk]);
+    }
+  }
+#pragma omp parallel for collapse(2) schedule(static)
+  for (int k = 0; k < nz + 2 * hs; k++) {
+    for (int i = 0; i < nx + 2 * hx; i++) {
+      // Accumulated in the storage type, as when summing into state directly
+      real q[NUM_VARS] = {0., 0., 0., 0.};
+      for (int kk = 0; kk < nqpoints; kk++) {
+        const double hr = hr_q[k * nqpoints + kk];
+        const double ht = ht_q[k * nqpoints + kk];
+        for (int ii = 0; ii < nqpoints; ii++) {
+          // Compute the x,z location within the global domain based on cell
+          // and quadrature index
+          double x = (i_beg + i - hx + 0.5) * dx + (qpoints[ii] - 0.5) * dx;
+          double z = (k_beg + k - hs + 0.5) * dz + (qpoints[kk] - 0.5) * dz;
+          double r, u, w, t;
+          Case::perturbation(x, z, r, u, w, t);
+          r = r * amp;
+          u = u * amp;
+          w = w * amp;
+          t = t * amp;
+          q[ID_DENS] = q[ID_DENS] + r * qweights[ii] * qweights[kk];
+          q[ID_UMOM] =
+              q[ID_UMOM] + (r + hr) * u * qweights[ii] * qweights[kk];
+          q[ID_WMOM] =
+              q[ID_WMOM] + (r + hr) * w * qweights[ii] * qweights[kk];
+          q[ID_RHOT] = q[ID_RHOT] + ((r + hr) * (t + ht) - hr * ht) *
+                                        qweights[ii] * qweights[kk];
+        }
+      }
+      for (int ll = 0; ll < NUM_VARS; ll++) {
+        int inds = ll * plane + k * pitch + i;
+        state[inds] = q[ll];
+        state_tmp[inds] = q[ll];
+      }
+    }
+  }
+}
+
+// Hydrostatic background state over vertical cell averages and at the
+// vertical cell interfaces
+template <class Case> void MiniWeatherSimulation::init_background() {
+  double z, hr, ht;
+  for (int k = 0; k < nz + 2 * hs; k++) {
+    hy_dens_cell[k] = 0.;
+    hy_dens_theta_cell[k] = 0.;
+    for (int kk = 0; kk < nqpoints; kk++) {
+      z = (k_beg + k - hs + 0.5) * dz;
+      Case::background(z, hr, ht);
+      hy_dens_cell[k] = hy_dens_cell[k] + hr * qweights[kk];
+      hy_dens_theta_cell[k] = hy_dens_theta_cell[k] + hr * ht * qweights[kk];
+    }
+  }
+  for (int k = 0; k < nz + 1; k++) {
+    z = (k_beg + k) * dz;
+    Case::background(z, hr, ht);
+    hy_dens_int[k] = hr;
+    hy_dens_theta_int[k] = hr * ht;
+    hy_pressure_int[k] = C0 * pow((hr * ht), gamm);
+  }
+}
+
+// Charge the wall time since the previous lap to start-up phase phase
+void MiniWeatherSimulation::startup_lap(int phase) {
+  auto now = std::chrono::steady_clock::now();
+  startup_time[phase] += std::chrono::duration<double>(now - startup_mark).count();
+  startup_mark = now;
+}
+
+// Print the slowest rank's time in each phase of init()
+void MiniWeatherSimulation::report_startup() {
+  double mx[NUM_STARTUP_PHASES], total = 0.;
+  MPI_Reduce(startup_time, mx, NUM_STARTUP_PHASES, MPI_DOUBLE, MPI_MAX, 0,
+             comm);
+  if (!world_main) {
+    return;
+  }
+  printf("Startup time (max over ranks, sec):");
+  for (int p = 0; p < NUM_STARTUP_PHASES; p++) {
+    printf(" %s %.3lf", startup_names[p], mx[p]);
+    total += mx[p];
+  }
+  printf(", total %.3lf\n", total);
+}
+
+// Memory of the model arrays, largest over the ranks, and the grid of this
+// aspect ratio that would fit in mem_gb GiB of host memory on one rank (this
+// node's physical memory by default). The GPU builds keep every array on the
+// host and map those marked dev onto the device, so they also give the device
+// total and the grid that would fit in device_mem_gb GiB of it.
+// The estimate scales the arrays that hold a value per cell and leaves out the
+// halo rows and columns and the arrays sized by one dimension, which are
+// negligible on such grids. Transient copies (the --balance snapshot) and the
+// in-situ consumers are not counted
+void MiniWeatherSimulation::report_memory() {
+  struct Entry {
+    const char *name;
+    double bytes, per_cell; // Bytes on this rank, bytes per interior cell
+    bool dev;               // Mapped onto the device by map_fields
+  };
+  const double rb = sizeof(real), field = NUM_VARS * rb;
+  auto sizes = [](std::initializer_list<size_t> n) {
+    size_t sum = 0;
+    for (size_t v : n) {
+      sum += v;
+    }
+    return (double)sum;
+  };
+  std::vector<Entry> rows = {
+      {"state", state.size() * rb, field, true},
+      {"state_tmp", state_tmp.size() * rb, field, true},
+      {"flux", flux.size() * rb, flux.empty() ? 0. : field, true},
+      {"tend", tend.size() * rb, tend.empty() ? 0. : field, true},
+      {"source", source.size() * rb, source.empty() ? 0. : field, true},
+      {"source_x", source_x.size() * rb, source_x.empty() ? 0. : field,
+       false},
+      {"x halo buffers",
+       sizes({sendbuf_l.size(), sendbuf_r.size(), recvbuf_l.size(),
+              recvbuf_r.size()}) *
+           rb,
+       0., true},
+      {"z halo buffers",
+       sizes({sendbuf_b.size(), sendbuf_t.size(), recvbuf_b.size(),
+              recvbuf_t.size()}) *
+           rb,
+       0., true},
+      {"background",
+       sizes({hy_dens_cell.size(), hy_dens_theta_cell.size(),
+              hy_dens_int.size(), hy_dens_theta_int.size(),
+              hy_pressure_int.size()}) *
+           sizeof(double),
+       0., true},
+      {"speeds, slots",
+       sizes({wave_speed.size(), diag_sums.size()}) * sizeof(double), 0.,
+       false},
+      // The flux and update rows of a strip, on each thread's stack
+      {"fused z scratch",
+       fused_z ? 2. * fused_blk * NUM_VARS * sizeof(double) * max_threads()
+               : 0.,
+       0., false}};
+#ifdef _PNETCDF
+  if (output_freq >= 0) {
+    // One frame of the output fields, allocated for each write, or the two
+    // staging buffers of --async-output
+    const double frame = (double)out_nvars * out_nz * out_nx * sizeof(double);
+    const double per_cell =
+        out_nvars * sizeof(double) / (double)(out_factor * out_factor);
+    rows.push_back({"output frame", async_output ? 2 * frame : frame,
+                    async_output ? 2 * per_cell : per_cell, false});
+  }
+#endif
+  std::vector<double> loc, mx(rows.size() + 3);
+  double total = 0., per_cell = 0., dev_total = 0., dev_per_cell = 0.;
+  for (auto &r : rows) {
+    loc.push_back(r.bytes);
+    total += r.bytes;
+    per_cell += r.per_cell;
+    if (r.dev) {
+      dev_total += r.bytes;
+      dev_per_cell += r.per_cell;
+    }
+  }
+  loc.push_back(total);
+  loc.push_back(dev_total);
+  double rss = 0.;
+#ifdef __linux__
+  struct rusage usage;
+  if (getrusage(RUSAGE_SELF, &usage) == 0) {
+    rss = usage.ru_maxrss * 1024.; // KiB
+  }
+#endif
+  loc.push_back(rss);
+  MPI_Reduce(loc.data(), mx.data(), (int)loc.size(), MPI_DOUBLE, MPI_MAX, 0,
+             comm);
+  if (!world_main) {
+    return;
+  }
+  const double mib = 1024. * 1024.;
+  printf("Memory per rank (max over ranks, MiB):\n");
+  for (size_t r = 0; r < rows.size(); r++) {
+    if (mx[r] > 0.) {
+      printf("  %-18s %12.3lf\n", rows[r].name, mx[r] / mib);
+    }
+  }
+  printf("  %-18s %12.3lf  (%.0lf bytes per cell)\n", "total",
+         mx[rows.size()] / mib, per_cell);
+  if (Backend::device) {
+    printf("  %-18s %12.3lf  (%.0lf bytes per cell)\n", "on the device",
+           mx[rows.size() + 1] / mib, dev_per_cell);
+  }
+  if (mx[rows.size() + 2] > 0.) {
+    printf("  %-18s %12.3lf  (peak resident set, MPI included)\n",
+           "resident", mx[rows.size() + 2] / mib);
+  }
+  double host_gb = mem_gb;
+#ifdef _SC_PHYS_PAGES
+  if (host_gb == 0.) {
+    const double pages = sysconf(_SC_PHYS_PAGES), page = sysconf(_SC_PAGESIZE);
+    host_gb = pages > 0. && page > 0. ? pages * page / (1024. * mib) : 0.;
+  }
+#endif
+  auto largest = [&](const char *kind, double gb, double bytes) {
+    const double nz_max = sqrt(gb * 1024. * mib / bytes * nz_glob / nx_glob);
+    printf("Largest grid of this shape in %.0lf GiB of %s memory on one "
+           "rank: nx_glob x nz_glob = %.0lf x %.0lf\n",
+           gb, kind, floor(nz_max * nx_glob / nz_glob), floor(nz_max));
+  };
+  if (host_gb > 0.) {
+    largest("host", host_gb, per_cell);
+  }
+  if (Backend::device) {
+    largest("device", device_mem_gb, dev_per_cell);
+  }
+}
+
+// Zero state, state_tmp, flux and tend, which FieldAllocator leaves unwritten.
+// With --first-touch the zeroing is shared out by the same static schedules as
+// the loops that later update each array, so under the kernel's first-touch
+// policy every page lands on the NUMA node of the thread that works on it.
+// Otherwise the master thread writes, and places, everything
+void MiniWeatherSimulation::zero_fields() {
+  if (!first_touch) {
+    std::fill(state.begin(), state.end(), 0.);
+    std::fill(state_tmp.begin(), state_tmp.end(), 0.);
+    std::fill(flux.begin(), flux.end(), 0.);
+    std::fill(tend.begin(), tend.end(), 0.);
+    return;
+  }
+#pragma omp parallel default(shared)
+  {
+    // Interior cells, as the apply loop in semi_discrete_step
+#pragma omp for collapse(2) schedule(static) nowait
+    for (int k = 0; k < nz; k++) {
+      for (int i = 0; i < nx; i++) {
+        for (int ll = 0; ll < NUM_VARS; ll++) {
+          int inds = ll * plane + (k + hs) * pitch + i + hx;
+          state[inds] = 0.;
+          state_tmp[inds] = 0.;
+        }
+      }
+    }
+    // Halo rows and columns and the row padding
+#pragma omp for schedule(static) nowait
+    for (int k = 0; k < nz + 2 * hs; k++) {
+      for (int i = 0; i < pitch; i++) {
+        if (k >= hs && k < nz + hs && i >= hx && i < nx + hx) {
+          continue;
+        }
+        for (int ll = 0; ll < NUM_VARS; ll++) {
+          state[ll * plane + k * pitch + i] = 0.;
+          state_tmp[ll * plane + k * pitch + i] = 0.;
+        }
+      }
+    }
+    if (!flux.empty()) {
+      // Interfaces in row order as the flux loops, cells as the tendency loops
+#pragma omp for collapse(2) schedule(static) nowait
+      for (int k = 0; k < nz + 1; k++) {
+        for (int i = 0; i < nx + 1; i++) {
+          for (int ll = 0; ll < NUM_VARS; ll++) {
+            flux[ll * (nz + 1) * (nx + 1) + k * (nx + 1) + i] = 0.;
           }
-          if (data_spec_int == DATA_SPEC_INJECTION) {
-            injection(x, z, r, u, w, t, hr, ht);
+        }
+      }
+#pragma omp for collapse(2) schedule(static) nowait
+      for (int k = 0; k < nz; k++) {
+        for (int i = 0; i < nx; i++) {
+          for (int ll = 0; ll < NUM_VARS; ll++) {
+            tend[ll * nz * nx + k * nx + i] = 0.;
           }
+        }
+      }
+    }
+  }
+}
+
+// MPI datatypes of a checkpoint: this rank's nz x nx block of every variable
+// within the global interior in the file, and the interior of the state array
+// (without halos or row padding) in memory
+void MiniWeatherSimulation::checkpoint_datatypes(MPI_Datatype &filetype,
+                                                 MPI_Datatype &memtype) {
+  int sizes[3], subsizes[3], starts[3];
+
+  subsizes[0] = NUM_VARS;
+  subsizes[1] = nz;
+  subsizes[2] = nx;
+  sizes[0] = NUM_VARS;
+  sizes[1] = nz_glob;
+  sizes[2] = nx_glob;
+  starts[0] = 0;
+  starts[1] = k_beg;
+  starts[2] = i_beg;
+  MPI_Type_create_subarray(3, sizes, subsizes, starts, MPI_ORDER_C, MPI_TYPE,
+                           &filetype);
+  MPI_Type_commit(&filetype);
+  sizes[1] = nz + 2 * hs;
+  sizes[2] = pitch;
+  starts[1] = hs;
+  starts[2] = hx;
+  MPI_Type_create_subarray(3, sizes, subsizes, starts, MPI_ORDER_C, MPI_TYPE,
+                           &memtype);
+  MPI_Type_commit(&memtype);
+}
+
+// Write a checkpoint with collective MPI-IO: a header from the main process,
+// then every rank's interior block. The file is written under a temporary name
+// and renamed once complete, so a job killed mid-write keeps the previous one
+void MiniWeatherSimulation::write_checkpoint() {
+  MPI_File fh;
+  MPI_Datatype filetype, memtype;
+  CheckpointHeader hdr;
+  std::string tmp = checkpoint_file + ".tmp";
+  double t0 = MPI_Wtime();
+
+  // The speeds still being reduced set the step after next, so a restart
+  // needs them. Pending diagnostics are logged before the restart point
+  MPI_Wait(&wave_speed_req, MPI_STATUS_IGNORE);
+  log_diagnostics();
+  fetch_state(state.data());
+  if (MPI_File_open(comm, tmp.c_str(),
+                    MPI_MODE_CREATE | MPI_MODE_WRONLY, MPI_INFO_NULL,
+                    &fh) != MPI_SUCCESS) {
+    printf("Error: cannot write checkpoint %s\n", tmp.c_str());
+    MPI_Abort(MPI_COMM_WORLD, -1);
+  }
+  MPI_File_set_size(fh, 0);
+  if (mainproc) {
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, checkpoint_magic, sizeof(hdr.magic));
+    hdr.nx_glob = nx_glob;
+    hdr.nz_glob = nz_glob;
+    hdr.data_spec_int = data_spec_int;
+    hdr.real_size = sizeof(real);
+    hdr.num_out = num_out;
+    hdr.direction_switch = direction_switch;
+    hdr.etime = etime;
+    hdr.output_counter = output_counter;
+    hdr.checkpoint_counter = checkpoint_counter;
+    hdr.mass0 = mass0;
+    hdr.te0 = te0;
+    hdr.dt = dt;
+    hdr.wave_speed[0] = wave_speed_glob[0];
+    hdr.wave_speed[1] = wave_speed_glob[1];
+    MPI_File_write_at(fh, 0, &hdr, sizeof(hdr), MPI_BYTE, MPI_STATUS_IGNORE);
+  }
+  checkpoint_datatypes(filetype, memtype);
+  MPI_File_set_view(fh, checkpoint_data_offset, MPI_TYPE, filetype, "native",
+                    MPI_INFO_NULL);
+  MPI_File_write_all(fh, state.data(), 1, memtype, MPI_STATUS_IGNORE);
+  MPI_File_close(&fh);
+  MPI_Type_free(&filetype);
+  MPI_Type_free(&memtype);
+  if (mainproc) {
+    if (rename(tmp.c_str(), checkpoint_file.c_str()) != 0) {
+      printf("Error: cannot rename %s to %s\n", tmp.c_str(),
+             checkpoint_file.c_str());
+      MPI_Abort(MPI_COMM_WORLD, -1);
+    }
+    printf("*** CHECKPOINT *** t = %lf (%lf sec)\n", etime,
+           MPI_Wtime() - t0);
+  }
+}
+
+// Read and check the header of restart_file on every rank, and take the grid
+// size and data spec from it
+void MiniWeatherSimulation::read_checkpoint_header(CheckpointHeader &hdr) {
+  MPI_File fh;
+
+  if (MPI_File_open(comm, restart_file.c_str(), MPI_MODE_RDONLY,
+                    MPI_INFO_NULL, &fh) != MPI_SUCCESS) {
+    if (myrank == 0) {
+      printf("Error: cannot open checkpoint %s\n", restart_file.c_str());
+    }
+    MPI_Abort(MPI_COMM_WORLD, -1);
+  }
+  MPI_File_read_at_all(fh, 0, &hdr, sizeof(hdr), MPI_BYTE, MPI_STATUS_IGNORE);
+  MPI_File_close(&fh);
+  if (memcmp(hdr.magic, checkpoint_magic, sizeof(hdr.magic)) != 0 ||
+      hdr.real_size != (int)sizeof(real)) {
+    if (myrank == 0) {
+      printf("Error: %s is not a checkpoint of this build (%d-byte reals)\n",
+             restart_file.c_str(), (int)sizeof(real));
+    }
+    MPI_Abort(MPI_COMM_WORLD, -1);
+  }
+  nx_glob = hdr.nx_glob;
+  nz_glob = hdr.nz_glob;
+  data_spec_int = hdr.data_spec_int;
+}
+
+// Read this rank's interior block of restart_file into state and state_tmp.
+// The halos are left for the first set_halo_values calls to fill
+void MiniWeatherSimulation::read_checkpoint_state() {
+  MPI_File fh;
+  MPI_Datatype filetype, memtype;
+
+  MPI_File_open(comm, restart_file.c_str(), MPI_MODE_RDONLY,
+                MPI_INFO_NULL, &fh);
+  checkpoint_datatypes(filetype, memtype);
+  MPI_File_set_view(fh, checkpoint_data_offset, MPI_TYPE, filetype, "native",
+                    MPI_INFO_NULL);
+  MPI_File_read_all(fh, state.data(), 1, memtype, MPI_STATUS_IGNORE);
+  MPI_File_close(&fh);
+  MPI_Type_free(&filetype);
+  MPI_Type_free(&memtype);
+  state_tmp = state;
+}
+
+// Build the x halo datatype and the persistent requests for both state
+// buffers. halo_x_type selects hx columns of every interior row of every
+// variable plane; it is anchored at column 0, so each of the four messages
+// uses it from a different column offset into the array
+void MiniWeatherSimulation::init_persistent_halo_x() {
+  int sizes[3], subsizes[3], starts[3], ierr;
+  real *bufs[2];
+
+  if (px == 1) {
+    return;
+  }
+  sizes[0] = NUM_VARS;
+  sizes[1] = nz + 2 * hs;
+  sizes[2] = pitch;
+  subsizes[0] = NUM_VARS;
+  subsizes[1] = nz;
+  subsizes[2] = hx;
+  starts[0] = 0;
+  starts[1] = hs;
+  starts[2] = 0;
+  ierr = MPI_Type_create_subarray(3, sizes, subsizes, starts, MPI_ORDER_C,
+                                  MPI_TYPE, &halo_x_type);
+  ierr = MPI_Type_commit(&halo_x_type);
+
+  bufs[0] = state.data();
+  bufs[1] = state_tmp.data();
+  for (int b = 0; b < 2; b++) {
+    // Same tags as the packed path: 1 travels left, 2 travels right
+    ierr = MPI_Send_init(bufs[b] + hx, 1, halo_x_type, msg_left_rank, 1,
+                         cart_comm, &halo_persist_req[b][0]);
+    ierr = MPI_Send_init(bufs[b] + nx, 1, halo_x_type, msg_right_rank, 2,
+                         cart_comm, &halo_persist_req[b][1]);
+    ierr = MPI_Recv_init(bufs[b], 1, halo_x_type, msg_left_rank, 2, cart_comm,
+                         &halo_persist_req[b][2]);
+    ierr = MPI_Recv_init(bufs[b] + nx + hx, 1, halo_x_type, msg_right_rank, 1,
+                         cart_comm, &halo_persist_req[b][3]);
+  }
+}
+
+// Elements of a state array of the given plane in the shared window, rounded
+// up to whole 64-byte lines so that state_tmp starts on one, as FieldAllocator
+// would place it
+static MPI_Aint shm_state_len(int plane) {
+  const MPI_Aint bytes = (MPI_Aint)plane * NUM_VARS * sizeof(real);
+  return (bytes + 63) / 64 * 64 / (MPI_Aint)sizeof(real);
+}
+
+// Place state and state_tmp in an MPI-3 shared window of the ranks on this
+// node (--shm-halo), each rank's part allocated apart so that its pages can
+// sit on its own NUMA node, and find the buffers of the x neighbours that
+// share it. Called from allocate_fields, which re-runs it on a new split
+void MiniWeatherSimulation::allocate_shared_state() {
+  int ierr;
+  free_shared_state();
+  ierr = MPI_Comm_split_type(cart_comm, MPI_COMM_TYPE_SHARED, 0,
+                             MPI_INFO_NULL, &node_comm);
+  const MPI_Aint len = shm_state_len(plane);
+  MPI_Info info;
+  real *base;
+  ierr = MPI_Info_create(&info);
+  ierr = MPI_Info_set(info, "alloc_shared_noncontig", "true");
+  ierr = MPI_Win_allocate_shared(2 * len * sizeof(real), sizeof(real), info,
+                                 node_comm, &base, &shm_win);
+  ierr = MPI_Info_free(&info);
+  // A passive epoch for the whole run: the halo exchanges order the accesses
+  // with MPI_Win_sync and messages
+  ierr = MPI_Win_lock_all(MPI_MODE_NOCHECK, shm_win);
+  state = field_vector(FieldAllocator<real>(base, len));
+  state_tmp = field_vector(FieldAllocator<real>(base + len, len));
+
+  // Layout of the neighbours' blocks: send ours both ways
+  int mine[3] = {nx, pitch, plane}, from[2][3];
+  ierr = MPI_Sendrecv(mine, 3, MPI_INT, right_rank, 7, from[0], 3, MPI_INT,
+                      left_rank, 7, cart_comm, MPI_STATUS_IGNORE);
+  ierr = MPI_Sendrecv(mine, 3, MPI_INT, left_rank, 8, from[1], 3, MPI_INT,
+                      right_rank, 8, cart_comm, MPI_STATUS_IGNORE);
+  MPI_Group cart_group, node_group;
+  ierr = MPI_Comm_group(cart_comm, &cart_group);
+  ierr = MPI_Comm_group(node_comm, &node_group);
+  for (int side = 0; side < 2; side++) {
+    int nbr = side ? right_rank : left_rank, node_rank, disp;
+    ierr = MPI_Group_translate_ranks(cart_group, 1, &nbr, node_group,
+                                     &node_rank);
+    ShmNeighbour &n = shm_nbr[side];
+    n = ShmNeighbour();
+    if (node_rank != MPI_UNDEFINED) {
+      MPI_Aint size;
+      real *nbase;
+      ierr = MPI_Win_shared_query(shm_win, node_rank, &size, &disp, &nbase);
+      n.nx = from[side][0];
+      n.pitch = from[side][1];
+      n.plane = from[side][2];
+      n.buf[0] = nbase;
+      n.buf[1] = nbase + shm_state_len(n.plane);
+    }
+  }
+  ierr = MPI_Group_free(&cart_group);
+  ierr = MPI_Group_free(&node_group);
+  msg_left_rank = shm_nbr[0].buf[0] ? MPI_PROC_NULL : left_rank;
+  msg_right_rank = shm_nbr[1].buf[0] ? MPI_PROC_NULL : right_rank;
+
+  int sides = (shm_nbr[0].buf[0] != nullptr) + (shm_nbr[1].buf[0] != nullptr);
+  int sides_glob, node_size;
+  ierr = MPI_Comm_size(node_comm, &node_size);
+  ierr = MPI_Reduce(&sides, &sides_glob, 1, MPI_INT, MPI_SUM, 0, comm);
+  if (world_main) {
+    printf("Shared-memory x halos: %d of %d sides on-node (%d ranks on this "
+           "node)\n",
+           sides_glob, 2 * nranks, node_size);
+  }
+}
+
+// Release the shared window. The arrays in it must be dropped beforehand or
+// never used again
+void MiniWeatherSimulation::free_shared_state() {
+  int ierr;
+  if (shm_win == MPI_WIN_NULL) {
+    return;
+  }
+  ierr = MPI_Win_unlock_all(shm_win);
+  ierr = MPI_Win_free(&shm_win);
+  ierr = MPI_Comm_free(&node_comm);
+  shm_nbr[0] = shm_nbr[1] = ShmNeighbour();
+  msg_left_rank = left_rank;
+  msg_right_rank = right_rank;
+}
+
+// Time halo_bench_iters x halo exchanges with the packed Isend/Irecv path and
+// with the persistent datatype path, alternating between state and state_tmp
+// as the RK stages do, and report the slowest rank's latency for each
+void MiniWeatherSimulation::benchmark_halo_x() {
+  double loc[2], glob[2], t0;
+  bool saved = persistent_halo;
+
+  if (px == 1) {
+    if (mainproc) {
+      printf("Halo benchmark needs more than one rank in x (px = 1)\n");
+    }
+    return;
+  }
+  for (int mode = 0; mode < 2; mode++) {
+    persistent_halo = (mode == 1);
+    // Warm up both buffers before timing
+#pragma omp parallel
+    {
+      set_halo_values_x(state.data());
+      set_halo_values_x(state_tmp.data());
+    }
+    MPI_Barrier(cart_comm);
+    t0 = MPI_Wtime();
+    // One parallel region for all the exchanges, as in the time step
+#pragma omp parallel
+    for (int it = 0; it < halo_bench_iters; it++) {
+      set_halo_values_x(it % 2 ? state_tmp.data() : state.data());
+    }
+    loc[mode] = (MPI_Wtime() - t0) / halo_bench_iters;
+  }
+  persistent_halo = saved;
+  MPI_Reduce(loc, glob, 2, MPI_DOUBLE, MPI_MAX, 0, comm);
+  if (world_main) {
+    // Each time step runs an exchange per x-direction RK stage, or a single
+    // one of hx columns with --deep-halo
+    const int per_step = hx > hs ? 1 : integrator->num_stages;
+    printf("x halo exchange latency (%d iterations, %d columns, max over "
+           "ranks%s)\n",
+           halo_bench_iters, hx,
+           shm_win != MPI_WIN_NULL ? ", on-node sides from the shared window"
+                                   : "");
+    printf("  pack + Isend/Irecv: %le sec/exchange, %le sec/step\n", glob[0],
+           per_step * glob[0]);
+    printf("  persistent subarray: %le sec/exchange, %le sec/step\n",
+           glob[1], per_step * glob[1]);
+    printf("  speedup: %lf\n", glob[0] / glob[1]);
+  }
+}
+
+#ifdef _BENCH
+// Work model of the kernels timed by miniWeather_bench, per interface or cell.
+// pow counts as one flop. The bytes are the least traffic a call can make,
+// with every array it touches streamed once: a tendency computation reads the
+// state, writes the fluxes, reads them back and writes tend
+constexpr double bench_flops_flux = 80.;   // 4 reconstructions + flux vector
+constexpr double bench_flops_tend = 8.;    // Flux difference per variable
+constexpr double bench_flops_apply = 8.;   // state_init + dt * tend
+constexpr double bench_flops_reduce = 25.; // Mass and total energy of a cell
 
-          // Store into the fluid state array
-          inds =
-              ID_DENS * (nz + 2 * hs) * (nx + 2 * hs) + k * (nx + 2 * hs) + i;
-          state[inds] = state[inds] + r * qweights[ii] * qweights[kk];
-          inds =
-              ID_UMOM * (nz + 2 * hs) * (nx + 2 * hs) + k * (nx + 2 * hs) + i;
-          state[inds] =
-              state[inds] + (r + hr) * u * qweights[ii] * qweights[kk];
-          inds =
-              ID_WMOM * (nz + 2 * hs) * (nx + 2 * hs) + k * (nx + 2 * hs) + i;
-          state[inds] =
-              state[inds] + (r + hr) * w * qweights[ii] * qweights[kk];
-          inds =
-              ID_RHOT * (nz + 2 * hs) * (nx + 2 * hs) + k * (nx + 2 * hs) + i;
-          state[inds] = state[inds] + ((r + hr) * (t + ht) - hr * ht) *
-                                          qweights[ii] * qweights[kk];
-        }
+// Time every kernel of the time step on its own, 1 + 2 + 4 + ... calls at a
+// time until a batch runs for min_time, with each team size in threads. The
+// kernels that run inside the time step's parallel region are looped inside a
+// single one here too, with the barrier that the step would put between them
+void MiniWeatherSimulation::benchmark_kernels(
+    const std::vector<int> &threads, double min_time,
+    std::vector<BenchRecord> &records) {
+  const int num_kernels = 7;
+  const char *names[num_kernels] = {
+      "compute_tendencies_x", "compute_tendencies_z", "set_halo_values_x",
+      "set_halo_values_z",    "semi_discrete_step_x", "semi_discrete_step_z",
+      "reductions"};
+  const double sr = sizeof(real), cells = (double)nx * nz;
+  const double flops_x =
+      bench_flops_flux * (nx + 1) * nz + bench_flops_tend * cells;
+  const double flops_z =
+      bench_flops_flux * nx * (nz + 1) + bench_flops_tend * cells;
+  // Bytes, then flops, of each kernel on this rank. A halo update reads and
+  // writes hs columns (or rows) on each side; the apply loop of a stage adds
+  // state_init and tend in and state_out out
+  double loc[2 * num_kernels] = {16 * sr * cells,
+                                 16 * sr * cells,
+                                 4. * hx * nz * NUM_VARS * sr,
+                                 4. * hs * (nx + 2 * hx) * NUM_VARS * sr,
+                                 28 * sr * cells,
+                                 28 * sr * cells,
+                                 4 * sr * cells,
+                                 flops_x,
+                                 flops_z,
+                                 0.,
+                                 0.,
+                                 flops_x + bench_flops_apply * cells,
+                                 flops_z + bench_flops_apply * cells,
+                                 bench_flops_reduce * cells};
+  double work[2 * num_kernels];
+  MPI_Allreduce(loc, work, 2 * num_kernels, MPI_DOUBLE, MPI_SUM, comm);
+
+  auto run = [&](int kern, long reps) {
+    double m, e;
+    MPI_Barrier(comm);
+    double t0 = MPI_Wtime();
+    if (kern == 6) {
+      for (long r = 0; r < reps; r++) {
+        reductions(m, e);
       }
-      for (ll = 0; ll < NUM_VARS; ll++) {
-        inds = ll * (nz + 2 * hs) * (nx + 2 * hs) + k * (nx + 2 * hs) + i;
-        state_tmp[inds] = state[inds];
+    } else {
+#pragma omp parallel
+      for (long r = 0; r < reps; r++) {
+        switch (kern) {
+        case 0:
+          compute_tendencies_x(state.data(), flux.data(), tend.data(), dt);
+          break;
+        case 1:
+          compute_tendencies_z(state.data(), flux.data(), tend.data(), dt);
+          break;
+        case 2:
+          set_halo_values_x(state.data());
+          break;
+        case 3:
+          set_halo_values_z(state.data());
+          break;
+        default:
+          semi_discrete_step(state.data(), state.data(), state_tmp.data(), dt,
+                             kern == 4 ? DIR_X : DIR_Z, flux.data(),
+                             tend.data());
+        }
+#pragma omp barrier
       }
     }
-  }
-  // Compute the hydrostatic background state over vertical cell averages
-  for (k = 0; k < nz + 2 * hs; k++) {
-    hy_dens_cell[k] = 0.;
-    hy_dens_theta_cell[k] = 0.;
-    for (kk = 0; kk < nqpoints; kk++) {
-      z = (k_beg + k - hs + 0.5) * dz;
-      // Set the fluid state based on the user's specification
-      if (data_spec_int == DATA_SPEC_COLLISION) {
-        collision(0., z, r, u, w, t, hr, ht);
-      }
-      if (data_spec_int == DATA_SPEC_THERMAL) {
-        thermal(0., z, r, u, w, t, hr, ht);
+    double t = MPI_Wtime() - t0, tmax;
+    MPI_Allreduce(&t, &tmax, 1, MPI_DOUBLE, MPI_MAX, comm);
+    return tmax;
+  };
+
+  for (int t : threads) {
+#ifdef _OPENMP
+    omp_set_num_threads(t);
+#endif
+    for (int kern = 0; kern < num_kernels; kern++) {
+      if (kern < 2 && flux.empty()) {
+        continue; // The fused kernels have no separate tendency pass
       }
-      if (data_spec_int == DATA_SPEC_GRAVITY_WAVES) {
-        gravity_waves(0., z, r, u, w, t, hr, ht);
+      run(kern, 1); // Warm the caches and the MPI connections
+      long reps = 1;
+      double sec = run(kern, reps);
+      while (sec < min_time) {
+        reps *= 2;
+        sec = run(kern, reps);
       }
-      if (data_spec_int == DATA_SPEC_DENSITY_CURRENT) {
-        density_current(0., z, r, u, w, t, hr, ht);
+      records.push_back({names[kern], nx_glob, nz_glob, t, sec / reps,
+                         work[kern], work[num_kernels + kern]});
+    }
+  }
+}
+#endif
+
+#ifdef _PNETCDF
+// Lay out the output grid. Output cell I covers cells I * out_factor to
+// (I + 1) * out_factor - 1 of the model grid in each direction and belongs to
+// the rank owning its first cell. A block mean also needs the rest of the
+// block, so --out-block requires every rank's block to start on a multiple
+// of the factor
+void MiniWeatherSimulation::setup_output_grid() {
+  const int f = out_factor;
+  out_nvars = 0;
+  for (int v = 0; v < 4; v++) {
+    out_nvars += out_var[v];
+  }
+  if (out_mean && (i_beg % f != 0 || k_beg % f != 0)) {
+    printf("Error: rank %d starts at cell (%d, %d), not on a multiple of "
+           "--out-block %d\n",
+           myrank, i_beg, k_beg, f);
+    MPI_Abort(MPI_COMM_WORLD, -1);
+  }
+  out_nx_glob = (nx_glob + f - 1) / f;
+  out_nz_glob = (nz_glob + f - 1) / f;
+  out_i0 = (i_beg + f - 1) / f;
+  out_k0 = (k_beg + f - 1) / f;
+  out_nx = (i_beg + nx - 1) / f - out_i0 + 1;
+  out_nz = (k_beg + nz - 1) / f - out_k0 + 1;
+}
+
+// Derived fields of the selected output variables on this rank's part of the
+// output grid, as out_nvars planes of out_nz x out_nx values. Each rank and
+// thread reduces its own cells, so only the coarse fields reach PnetCDF
+void MiniWeatherSimulation::output_fields(const real *state, double *buf) {
+  const int f = out_factor, n = out_nz * out_nx;
+#pragma omp parallel for collapse(2)
+  for (int kk = 0; kk < out_nz; kk++) {
+    for (int ii = 0; ii < out_nx; ii++) {
+      int k_lo = (out_k0 + kk) * f - k_beg, i_lo = (out_i0 + ii) * f - i_beg;
+      int k_hi = out_mean ? std::min(k_lo + f, nz) : k_lo + 1;
+      int i_hi = out_mean ? std::min(i_lo + f, nx) : i_lo + 1;
+      double vals[4], sum[4] = {0., 0., 0., 0.};
+      for (int k = k_lo; k < k_hi; k++) {
+        for (int i = i_lo; i < i_hi; i++) {
+          int ind_r = ID_DENS * plane + (k + hs) * pitch + i + hx;
+          int ind_u = ID_UMOM * plane + (k + hs) * pitch + i + hx;
+          int ind_w = ID_WMOM * plane + (k + hs) * pitch + i + hx;
+          int ind_t = ID_RHOT * plane + (k + hs) * pitch + i + hx;
+          vals[0] = state[ind_r];
+          vals[1] = state[ind_u] / (hy_dens_cell[k + hs] + state[ind_r]);
+          vals[2] = state[ind_w] / (hy_dens_cell[k + hs] + state[ind_r]);
+          vals[3] = (state[ind_t] + hy_dens_theta_cell[k + hs]) /
+                        (hy_dens_cell[k + hs] + state[ind_r]) -
+                    hy_dens_theta_cell[k + hs] / hy_dens_cell[k + hs];
+          for (int v = 0; v < 4; v++) {
+            sum[v] += vals[v];
+          }
+        }
       }
-      if (data_spec_int == DATA_SPEC_INJECTION) {
-        injection(0., z, r, u, w, t, hr, ht);
+      int cells = (k_hi - k_lo) * (i_hi - i_lo), slot = 0;
+      for (int v = 0; v < 4; v++) {
+        if (out_var[v]) {
+          // A single cell is copied as is
+          buf[slot++ * n + kk * out_nx + ii] =
+              out_mean ? sum[v] / cells : vals[v];
+        }
       }
-      hy_dens_cell[k] = hy_dens_cell[k] + hr * qweights[kk];
-      hy_dens_theta_cell[k] = hy_dens_theta_cell[k] + hr * ht * qweights[kk];
     }
   }
-  // Compute the hydrostatic background state at vertical cell interfaces
-  for (k = 0; k < nz + 1; k++) {
-    z = (k_beg + k) * dz;
-    if (data_spec_int == DATA_SPEC_COLLISION) {
-      collision(0., z, r, u, w, t, hr, ht);
-    }
-    if (data_spec_int == DATA_SPEC_THERMAL) {
-      thermal(0., z, r, u, w, t, hr, ht);
+}
+
+// Define the dimensions and variables of a new output.nc and leave define
+// mode. An ensemble adds a member dimension after t and records each member's
+// data spec, perturbation amplitude and hyperviscosity
+void MiniWeatherSimulation::output_define(int ncid, int *varids) {
+  int t_dimid, m_dimid, x_dimid, z_dimid, dimids[4], nd = 0, meta_varids[3];
+  const char *names[4] = {"dens", "uwnd", "wwnd", "theta"};
+  const char *meta_names[3] = {"member_data", "member_amp", "member_hv_beta"};
+
+  ncwrap(ncmpi_def_dim(ncid, "t", (MPI_Offset)NC_UNLIMITED, &t_dimid),
+         __LINE__);
+  if (n_members > 0) {
+    ncwrap(ncmpi_def_dim(ncid, "member", (MPI_Offset)n_members, &m_dimid),
+           __LINE__);
+  }
+  ncwrap(ncmpi_def_dim(ncid, "x", (MPI_Offset)out_nx_glob, &x_dimid),
+         __LINE__);
+  ncwrap(ncmpi_def_dim(ncid, "z", (MPI_Offset)out_nz_glob, &z_dimid),
+         __LINE__);
+  if (out_factor > 1) {
+    const char *mode = out_mean ? "block mean" : "stride";
+    ncwrap(ncmpi_put_att_int(ncid, NC_GLOBAL, "coarsening", NC_INT, 1,
+                             &out_factor),
+           __LINE__);
+    ncwrap(ncmpi_put_att_text(ncid, NC_GLOBAL, "coarsening_mode",
+                              strlen(mode), mode),
+           __LINE__);
+  }
+  dimids[nd++] = t_dimid;
+  ncwrap(ncmpi_def_var(ncid, "t", NC_DOUBLE, 1, dimids, &varids[4]), __LINE__);
+  if (n_members > 0) {
+    dimids[nd++] = m_dimid;
+    for (int v = 0; v < 3; v++) {
+      ncwrap(ncmpi_def_var(ncid, meta_names[v], v == 0 ? NC_INT : NC_DOUBLE, 1,
+                           &m_dimid, &meta_varids[v]),
+             __LINE__);
     }
-    if (data_spec_int == DATA_SPEC_GRAVITY_WAVES) {
-      gravity_waves(0., z, r, u, w, t, hr, ht);
+  }
+  dimids[nd++] = z_dimid;
+  dimids[nd++] = x_dimid;
+  for (int v = 0; v < 4; v++) {
+    varids[v] = -1;
+    if (out_var[v]) {
+      // Doubles put into a float variable are converted by PnetCDF before
+      // they are written
+      ncwrap(ncmpi_def_var(ncid, names[v], out_float ? NC_FLOAT : NC_DOUBLE,
+                           nd, dimids, &varids[v]),
+             __LINE__);
     }
-    if (data_spec_int == DATA_SPEC_DENSITY_CURRENT) {
-      density_current(0., z, r, u, w, t, hr, ht);
+  }
+  ncwrap(ncmpi_enddef(ncid), __LINE__);
+
+  if (n_members > 0) {
+    MPI_Offset st[1] = {member}, ct[1] = {1};
+    ncwrap(ncmpi_begin_indep_data(ncid), __LINE__);
+    if (mainproc) {
+      ncwrap(ncmpi_put_vara_int(ncid, meta_varids[0], st, ct, &data_spec_int),
+             __LINE__);
+      ncwrap(ncmpi_put_vara_double(ncid, meta_varids[1], st, ct, &amp),
+             __LINE__);
+      ncwrap(ncmpi_put_vara_double(ncid, meta_varids[2], st, ct,
+                                   &hyperviscosity),
+             __LINE__);
     }
-    if (data_spec_int == DATA_SPEC_INJECTION) {
-      injection(0., z, r, u, w, t, hr, ht);
+    ncwrap(ncmpi_end_indep_data(ncid), __LINE__);
+  }
+}
+
+// Look up the selected dens, uwnd, wwnd and theta variables and t of an
+// existing output.nc (-1 for the unselected ones)
+void MiniWeatherSimulation::output_inq_varids(int ncid, int *varids) {
+  const char *names[5] = {"dens", "uwnd", "wwnd", "theta", "t"};
+  for (int v = 0; v < 5; v++) {
+    varids[v] = -1;
+    if (v == 4 || out_var[v]) {
+      ncwrap(ncmpi_inq_varid(ncid, names[v], &varids[v]), __LINE__);
     }
-    hy_dens_int[k] = hr;
-    hy_dens_theta_int[k] = hr * ht;
-    hy_pressure_int[k] = C0 * pow((hr * ht), gamm);
   }
 }
 
-// This test case is initially balanced but injects fast, cold air from the left
-// boundary near the model top x and z are input coordinates at which to sample
-// r,u,w,t are output density, u-wind, w-wind, and potential temperature at that
-// location hr and ht are output background hydrostatic density and potential
-// temperature at that location
-void MiniWeatherSimulation::injection(double x, double z, double &r, double &u,
-                                      double &w, double &t, double &hr,
-                                      double &ht) {
-  hydro_const_theta(z, hr, ht);
-  r = 0.;
-  t = 0.;
-  u = 0.;
-  w = 0.;
-}
-
-// Initialize a density current (falling cold thermal that propagates along the
-// model bottom) x and z are input coordinates at which to sample r,u,w,t are
-// output density, u-wind, w-wind, and potential temperature at that location hr
-// and ht are output background hydrostatic density and potential temperature at
-// that location
-void MiniWeatherSimulation::density_current(double x, double z, double &r,
-                                            double &u, double &w, double &t,
-                                            double &hr, double &ht) {
-  hydro_const_theta(z, hr, ht);
-  r = 0.;
-  t = 0.;
-  u = 0.;
-  w = 0.;
-  t = t + sample_ellipse_cosine(x, z, -20., xlen / 2, 5000., 4000., 2000.);
-}
-
-// x and z are input coordinates at which to sample
-// r,u,w,t are output density, u-wind, w-wind, and potential temperature at that
-// location hr and ht are output background hydrostatic density and potential
-// temperature at that location
-void MiniWeatherSimulation::gravity_waves(double x, double z, double &r,
-                                          double &u, double &w, double &t,
-                                          double &hr, double &ht) {
-  hydro_const_bvfreq(z, 0.02, hr, ht);
-  r = 0.;
-  t = 0.;
-  u = 15.;
-  w = 0.;
-}
-
-// Rising thermal
-// x and z are input coordinates at which to sample
-// r,u,w,t are output density, u-wind, w-wind, and potential temperature at that
-// location hr and ht are output background hydrostatic density and potential
-// temperature at that location
-void MiniWeatherSimulation::thermal(double x, double z, double &r, double &u,
-                                    double &w, double &t, double &hr,
-                                    double &ht) {
-  hydro_const_theta(z, hr, ht);
-  r = 0.;
-  t = 0.;
-  u = 0.;
-  w = 0.;
-  t = t + sample_ellipse_cosine(x, z, 3., xlen / 2, 2000., 2000., 2000.);
-}
-
-// Colliding thermals
-// x and z are input coordinates at which to sample
-// r,u,w,t are output density, u-wind, w-wind, and potential temperature at that
-// location hr and ht are output background hydrostatic density and potential
-// temperature at that location
-void MiniWeatherSimulation::collision(double x, double z, double &r, double &u,
-                                      double &w, double &t, double &hr,
-                                      double &ht) {
-  hydro_const_theta(z, hr, ht);
-  r = 0.;
-  t = 0.;
-  u = 0.;
-  w = 0.;
-  t = t + sample_ellipse_cosine(x, z, 20., xlen / 2, 2000., 2000., 2000.);
-  t = t + sample_ellipse_cosine(x, z, -20., xlen / 2, 8000., 2000., 2000.);
-}
-
-// Establish hydrostatic balance using constant potential temperature (thermally
-// neutral atmosphere) z is the input coordinate r and t are the output
-// background hydrostatic density and potential temperature
-void MiniWeatherSimulation::hydro_const_theta(double z, double &r, double &t) {
-  const double theta0 = 300.; // Background potential temperature
-  const double exner0 = 1.;   // Surface-level Exner pressure
-  double p, exner, rt;
-  // Establish hydrostatic balance first using Exner pressure
-  t = theta0;                                // Potential Temperature at z
-  exner = exner0 - grav * z / (cp * theta0); // Exner pressure at z
-  p = p0 * pow(exner, (cp / rd));            // Pressure at z
-  rt = pow((p / C0), (1. / gamm));           // rho*theta at z
-  r = rt / t;                                // Density at z
-}
-
-// Establish hydrostatic balance using constant Brunt-Vaisala frequency
-// z is the input coordinate
-// bv_freq0 is the constant Brunt-Vaisala frequency
-// r and t are the output background hydrostatic density and potential
-// temperature
-void MiniWeatherSimulation::hydro_const_bvfreq(double z, double bv_freq0,
-                                               double &r, double &t) {
-  const double theta0 = 300.; // Background potential temperature
-  const double exner0 = 1.;   // Surface-level Exner pressure
-  double p, exner, rt;
-  t = theta0 * exp(bv_freq0 * bv_freq0 / grav * z); // Pot temp at z
-  exner = exner0 - grav * grav / (cp * bv_freq0 * bv_freq0) * (t - theta0) /
-                       (t * theta0); // Exner pressure at z
-  p = p0 * pow(exner, (cp / rd));    // Pressure at z
-  rt = pow((p / C0), (1. / gamm));   // rho*theta at z
-  r = rt / t;                        // Density at z
-}
-
-// Sample from an ellipse of a specified center, radius, and amplitude at a
-// specified location x and z are input coordinates amp,x0,z0,xrad,zrad are
-// input amplitude, center, and radius of the ellipse
-double MiniWeatherSimulation::sample_ellipse_cosine(double x, double z,
-                                                    double amp, double x0,
-                                                    double z0, double xrad,
-                                                    double zrad) {
-  double dist;
-  // Compute distance from bubble center
-  dist = sqrt(((x - x0) / xrad) * ((x - x0) / xrad) +
-              ((z - z0) / zrad) * ((z - z0) / zrad)) *
-         pi / 2.;
-  // If the distance from bubble center is less than the radius, create a cos**2
-  // profile
-  if (dist <= pi / 2.) {
-    return amp * pow(cos(dist), 2.);
-  } else {
-    return 0.;
+// Start and count of this rank's block of a frame of the (t, z, x) output
+// fields on the output grid, or (t, member, z, x) in an ensemble
+void MiniWeatherSimulation::output_block(int frame, MPI_Offset *st,
+                                         MPI_Offset *ct) {
+  int nd = 0;
+  st[nd] = frame;
+  ct[nd++] = 1;
+  if (n_members > 0) {
+    st[nd] = member;
+    ct[nd++] = 1;
   }
+  st[nd] = out_k0;
+  ct[nd++] = out_nz;
+  st[nd] = out_i0;
+  ct[nd++] = out_nx;
 }
+#endif
 
 // Output the fluid state (state) to a NetCDF file at a given elapsed model time
 // (etime) The file I/O uses parallel-netcdf, the only external library required
 // for this mini-app. If it's too cumbersome, you can comment the I/O out, but
 // you'll miss out on some potentially cool graphics
-void MiniWeatherSimulation::output(double *state, double etime) {
-  int ncid, t_dimid, x_dimid, z_dimid, dens_varid, uwnd_varid, wwnd_varid,
-      theta_varid, t_varid, dimids[3];
-  int i, k, ind_r, ind_u, ind_w, ind_t;
-  MPI_Offset st1[1], ct1[1], st3[3], ct3[3];
-  // Temporary arrays to hold density, u-wind, w-wind, and potential temperature
-  // (theta)
-  double *dens, *uwnd, *wwnd, *theta;
-  double *etimearr;
+void MiniWeatherSimulation::output(real *state, double etime) {
+  ScopedTimer timer(timers, TIMER_OUTPUT);
+  fetch_state(state);
 #ifdef _PNETCDF
-  std::vector<double> dens_vec, uwnd_vec, wwnd_vec, theta_vec, etimearr_vec;
+  int ncid, varids[5]; // dens, uwnd, wwnd, theta, t
+  MPI_Offset st1[1], ct1[1], st4[4], ct4[4];
+  // Temporary array to hold the selected ones of density, u-wind, w-wind, and
+  // potential temperature (theta)
+  double *fields;
+  double *etimearr;
+  std::vector<double> fields_vec, etimearr_vec;
 
+  if (async_output) {
+    output_async(state, etime);
+    return;
+  }
   // Inform the user
-  if (mainproc) {
+  if (world_main) {
     printf("*** OUTPUT ***\n");
   }
   // Allocate some (big) temp arrays
-  dens_vec.resize(nx * nz);
-  uwnd_vec.resize(nx * nz);
-  wwnd_vec.resize(nx * nz);
-  theta_vec.resize(nx * nz);
+  fields_vec.resize(out_nvars * out_nz * out_nx);
   etimearr_vec.resize(1);
 
-  dens = dens_vec.data();
-  uwnd = uwnd_vec.data();
-  wwnd = wwnd_vec.data();
-  theta = theta_vec.data();
+  fields = fields_vec.data();
   etimearr = etimearr_vec.data();
 
-  // If the elapsed time is zero, create the file. Otherwise, open the file
+  // If the elapsed time is zero, create the file. Otherwise, open the file.
+  // Every ensemble member writes into the same file
   if (etime == 0) {
     // Create the file
     ncwrap(ncmpi_create(MPI_COMM_WORLD, "output.nc", NC_CLOBBER, MPI_INFO_NULL,
                         &ncid),
            __LINE__);
-    // Create the dimensions
-    ncwrap(ncmpi_def_dim(ncid, "t", (MPI_Offset)NC_UNLIMITED, &t_dimid),
-           __LINE__);
-    ncwrap(ncmpi_def_dim(ncid, "x", (MPI_Offset)nx_glob, &x_dimid), __LINE__);
-    ncwrap(ncmpi_def_dim(ncid, "z", (MPI_Offset)nz_glob, &z_dimid), __LINE__);
-    // Create the variables
-    dimids[0] = t_dimid;
-    ncwrap(ncmpi_def_var(ncid, "t", NC_DOUBLE, 1, dimids, &t_varid), __LINE__);
-    dimids[0] = t_dimid;
-    dimids[1] = z_dimid;
-    dimids[2] = x_dimid;
-    ncwrap(ncmpi_def_var(ncid, "dens", NC_DOUBLE, 3, dimids, &dens_varid),
-           __LINE__);
-    ncwrap(ncmpi_def_var(ncid, "uwnd", NC_DOUBLE, 3, dimids, &uwnd_varid),
-           __LINE__);
-    ncwrap(ncmpi_def_var(ncid, "wwnd", NC_DOUBLE, 3, dimids, &wwnd_varid),
-           __LINE__);
-    ncwrap(ncmpi_def_var(ncid, "theta", NC_DOUBLE, 3, dimids, &theta_varid),
-           __LINE__);
-    // End "define" mode
-    ncwrap(ncmpi_enddef(ncid), __LINE__);
+    output_define(ncid, varids);
   } else {
     // Open the file
     ncwrap(
         ncmpi_open(MPI_COMM_WORLD, "output.nc", NC_WRITE, MPI_INFO_NULL, &ncid),
         __LINE__);
     // Get the variable IDs
-    ncwrap(ncmpi_inq_varid(ncid, "dens", &dens_varid), __LINE__);
-    ncwrap(ncmpi_inq_varid(ncid, "uwnd", &uwnd_varid), __LINE__);
-    ncwrap(ncmpi_inq_varid(ncid, "wwnd", &wwnd_varid), __LINE__);
-    ncwrap(ncmpi_inq_varid(ncid, "theta", &theta_varid), __LINE__);
-    ncwrap(ncmpi_inq_varid(ncid, "t", &t_varid), __LINE__);
+    output_inq_varids(ncid, varids);
   }
 
-  // Store perturbed values in the temp arrays for output
-  for (k = 0; k < nz; k++) {
-    for (i = 0; i < nx; i++) {
-      ind_r = ID_DENS * (nz + 2 * hs) * (nx + 2 * hs) +
-              (k + hs) * (nx + 2 * hs) + i + hs;
-      ind_u = ID_UMOM * (nz + 2 * hs) * (nx + 2 * hs) +
-              (k + hs) * (nx + 2 * hs) + i + hs;
-      ind_w = ID_WMOM * (nz + 2 * hs) * (nx + 2 * hs) +
-              (k + hs) * (nx + 2 * hs) + i + hs;
-      ind_t = ID_RHOT * (nz + 2 * hs) * (nx + 2 * hs) +
-              (k + hs) * (nx + 2 * hs) + i + hs;
-      dens[k * nx + i] = state[ind_r];
-      uwnd[k * nx + i] = state[ind_u] / (hy_dens_cell[k + hs] + state[ind_r]);
-      wwnd[k * nx + i] = state[ind_w] / (hy_dens_cell[k + hs] + state[ind_r]);
-      theta[k * nx + i] = (state[ind_t] + hy_dens_theta_cell[k + hs]) /
-                              (hy_dens_cell[k + hs] + state[ind_r]) -
-                          hy_dens_theta_cell[k + hs] / hy_dens_cell[k + hs];
-    }
-  }
+  // Store perturbed values in the temp array for output
+  output_fields(state, fields);
 
   // Write the grid data to file with all the processes writing collectively
-  st3[0] = num_out;
-  st3[1] = k_beg;
-  st3[2] = i_beg;
-  ct3[0] = 1;
-  ct3[1] = nz;
-  ct3[2] = nx;
-  ncwrap(ncmpi_put_vara_double_all(ncid, dens_varid, st3, ct3, dens), __LINE__);
-  ncwrap(ncmpi_put_vara_double_all(ncid, uwnd_varid, st3, ct3, uwnd), __LINE__);
-  ncwrap(ncmpi_put_vara_double_all(ncid, wwnd_varid, st3, ct3, wwnd), __LINE__);
-  ncwrap(ncmpi_put_vara_double_all(ncid, theta_varid, st3, ct3, theta),
-         __LINE__);
+  output_block(num_out, st4, ct4);
+  for (int v = 0; v < 4; v++) {
+    if (varids[v] >= 0) {
+      ncwrap(ncmpi_put_vara_double_all(ncid, varids[v], st4, ct4, fields),
+             __LINE__);
+      fields += out_nz * out_nx;
+    }
+  }
 
   // Only the main process needs to write the elapsed time
   // Begin "independent" write mode
   ncwrap(ncmpi_begin_indep_data(ncid), __LINE__);
   // write elapsed time to file
-  if (mainproc) {
+  if (world_main) {
     st1[0] = num_out;
     ct1[0] = 1;
     etimearr[0] = etime;
-    ncwrap(ncmpi_put_vara_double(ncid, t_varid, st1, ct1, etimearr), __LINE__);
+    ncwrap(ncmpi_put_vara_double(ncid, varids[4], st1, ct1, etimearr),
+           __LINE__);
   }
   // End "independent" write mode
   ncwrap(ncmpi_end_indep_data(ncid), __LINE__);
@@ -1154,14 +4484,148 @@ void MiniWeatherSimulation::output(double *state, double etime) {
   num_out = num_out + 1;
 
   // Deallocate the temp arrays
-  // Vectors clear themselves
+  // Vectors clear themselves, once off the device
+  unmap_fields();
 #else
-  if (mainproc) {
+  if (world_main) {
     printf("Output disabled (PNetCDF not found)\n");
   }
 #endif
 }
 
+#ifdef _PNETCDF
+// Create output.nc on io_comm for --async-output and keep it open for the rest
+// of the run, allocate the two staging buffers and start the I/O thread
+void MiniWeatherSimulation::output_async_open() {
+  MPI_Comm_dup(MPI_COMM_WORLD, &io_comm);
+  if (!restart_file.empty()) {
+    // Append to the frames written before the checkpoint
+    ncwrap(ncmpi_open(io_comm, "output.nc", NC_WRITE, MPI_INFO_NULL, &out_ncid),
+           __LINE__);
+    output_inq_varids(out_ncid, out_varids);
+  } else {
+    ncwrap(ncmpi_create(io_comm, "output.nc", NC_CLOBBER, MPI_INFO_NULL,
+                        &out_ncid),
+           __LINE__);
+    output_define(out_ncid, out_varids);
+  }
+
+  for (int b = 0; b < 2; b++) {
+    out_stage[b].resize(out_nvars * out_nz * out_nx);
+  }
+  if (out_threaded) {
+    out_thread = std::thread(&MiniWeatherSimulation::output_async_worker, this);
+  }
+}
+
+// --async-output frame: copy the derived fields into the next staging buffer
+// and hand it to the I/O thread, or post it as non-blocking puts after
+// completing the previous frame. The run loop only waits here if the buffer
+// is still being written from two frames ago
+void MiniWeatherSimulation::output_async(real *state, double etime) {
+  int b = out_next;
+  int stat[5];
+
+  if (world_main) {
+    printf("*** OUTPUT ***\n");
+  }
+  if (out_threaded) {
+    std::unique_lock<std::mutex> lock(out_mtx);
+    out_cv.wait(lock, [&] { return !out_full[b]; });
+  }
+
+  // Store perturbed values in the staging buffer
+  output_fields(state, out_stage[b].data());
+  out_etime[b] = etime;
+  out_frame[b] = num_out;
+  num_out = num_out + 1;
+  out_next = 1 - b;
+
+  if (out_threaded) {
+    {
+      std::lock_guard<std::mutex> lock(out_mtx);
+      out_full[b] = true;
+    }
+    out_cv.notify_all();
+  } else {
+    if (out_nreq > 0) {
+      ncwrap(ncmpi_wait_all(out_ncid, out_nreq, out_req, stat), __LINE__);
+    }
+    output_async_post(b);
+  }
+}
+
+// Post the non-blocking puts of staging buffer b; only the main process
+// writes the elapsed time
+void MiniWeatherSimulation::output_async_post(int b) {
+  MPI_Offset st4[4], ct4[4];
+  MPI_Offset st1[1] = {out_frame[b]};
+  MPI_Offset ct1[1] = {1};
+
+  output_block(out_frame[b], st4, ct4);
+  out_nreq = 0;
+  for (int v = 0; v < 4; v++) {
+    if (out_varids[v] >= 0) {
+      ncwrap(ncmpi_iput_vara_double(out_ncid, out_varids[v], st4, ct4,
+                                    &out_stage[b][out_nreq * out_nz * out_nx],
+                                    &out_req[out_nreq]),
+             __LINE__);
+      out_nreq++;
+    }
+  }
+  if (world_main) {
+    ncwrap(ncmpi_iput_vara_double(out_ncid, out_varids[4], st1, ct1,
+                                  &out_etime[b], &out_req[out_nreq++]),
+           __LINE__);
+  }
+}
+
+// I/O thread: write the staging buffers in the order they were filled. The
+// collective ncmpi_wait_all runs on io_comm, so it does not match against the
+// halo exchanges the main thread is doing meanwhile
+void MiniWeatherSimulation::output_async_worker() {
+  int b = 0, stat[5];
+  while (true) {
+    {
+      std::unique_lock<std::mutex> lock(out_mtx);
+      out_cv.wait(lock, [&] { return out_full[b] || out_stop; });
+      // Frames are queued in buffer order, so an empty buffer here means the
+      // queue has drained
+      if (!out_full[b]) {
+        return;
+      }
+    }
+    output_async_post(b);
+    ncwrap(ncmpi_wait_all(out_ncid, out_nreq, out_req, stat), __LINE__);
+    {
+      std::lock_guard<std::mutex> lock(out_mtx);
+      out_full[b] = false;
+    }
+    out_cv.notify_all();
+    b = 1 - b;
+  }
+}
+
+// Flush the outstanding frames and close output.nc
+void MiniWeatherSimulation::output_async_close() {
+  int stat[5];
+  if (out_threaded) {
+    {
+      std::lock_guard<std::mutex> lock(out_mtx);
+      out_stop = true;
+    }
+    out_cv.notify_all();
+    out_thread.join();
+  } else if (out_nreq > 0) {
+    ncwrap(ncmpi_wait_all(out_ncid, out_nreq, out_req, stat), __LINE__);
+    out_nreq = 0;
+  }
+  ncwrap(ncmpi_close(out_ncid), __LINE__);
+  out_ncid = -1;
+  MPI_Comm_free(&io_comm);
+}
+#endif
+
 // Error reporting routine for the PNetCDF I/O
 void MiniWeatherSimulation::ncwrap(int ierr, int line) {
 #ifdef _PNETCDF
@@ -1175,44 +4639,623 @@ void MiniWeatherSimulation::ncwrap(int ierr, int line) {
 
 void MiniWeatherSimulation::Finalize() {
   int ierr;
+#ifdef _PNETCDF
+  if (out_ncid >= 0) {
+    output_async_close();
+  }
+#endif
   // Vectors clear themselves
-  ierr = MPI_Finalize();
+  if (halo_x_type != MPI_DATATYPE_NULL) {
+    for (int b = 0; b < 2; b++) {
+      for (int r = 0; r < 4; r++) {
+        ierr = MPI_Request_free(&halo_persist_req[b][r]);
+      }
+    }
+    ierr = MPI_Type_free(&halo_x_type);
+  }
+  free_shared_state();
+  ierr = MPI_Comm_free(&cart_comm);
+  if (n_members > 0) {
+    ierr = MPI_Comm_free(&comm);
+  }
+  if (owns_mpi) {
+    ierr = MPI_Finalize();
+  }
+}
+
+// Add the mass and total energy of interior cell (k, i) of state to mass and
+// te. As in reductions(), but with the temperature from a single pow
+inline void MiniWeatherSimulation::cell_mass_energy(const real *state, int k,
+                                                    int i, double &mass,
+                                                    double &te) {
+  static const double t_coef = pow(C0 / p0, rd / cp);
+  Dyn::cell_mass_energy(grid(), state, hy_dens_cell.data(),
+                        hy_dens_theta_cell.data(), t_coef, k, i, mass, te);
+}
+
+// Add this thread's partial mass and energy sums to its slot of diag_sums
+void MiniWeatherSimulation::record_diagnostics(double mass, double te) {
+  double *slot = &diag_sums[8 * thread_num()];
+  slot[0] += mass;
+  slot[1] += te;
+}
+
+// Separate diagnostic pass over state, for the fused kernels whose apply step
+// cannot carry it
+void MiniWeatherSimulation::diagnose_state(const real *state) {
+  double mass_loc, te_loc;
+  Dyn::diagnose(grid(), Q_MAIN, dev(state), dev(hy_dens_cell.data()),
+                dev(hy_dens_theta_cell.data()), mass_loc, te_loc);
+  record_diagnostics(mass_loc, te_loc);
+}
+
+// After a diagnosed step: combine the threads' sums and post their reduction,
+// which the next step's halo exchanges progress
+void MiniWeatherSimulation::post_diagnostics() {
+  diag_loc[0] = diag_loc[1] = 0.;
+  for (size_t t = 0; t < diag_sums.size(); t += 8) {
+    diag_loc[0] += diag_sums[t];
+    diag_loc[1] += diag_sums[t + 1];
+    diag_sums[t] = diag_sums[t + 1] = 0.;
+  }
+  diag_etime = etime;
+  diag_step = num_steps;
+  MPI_Iallreduce(diag_loc, diag_glob, 2, MPI_DOUBLE, MPI_SUM, comm, &diag_req);
+}
+
+// Complete the pending diagnostic reduction, if any, and log it. A
+// non-finite mass or energy means the run has blown up, so it is stopped
+void MiniWeatherSimulation::log_diagnostics() {
+  if (diag_req == MPI_REQUEST_NULL) {
+    return;
+  }
+  {
+    ScopedTimer timer(timers, TIMER_REDUCE);
+    MPI_Wait(&diag_req, MPI_STATUS_IGNORE);
+  }
+  if (diag_log) {
+    fprintf(diag_log, "%ld,%.6lf,%.16le,%.16le,%.6le,%.6le\n", diag_step,
+            diag_etime, diag_glob[0], diag_glob[1],
+            (diag_glob[0] - mass0) / mass0, (diag_glob[1] - te0) / te0);
+    fflush(diag_log);
+  }
+  if (!std::isfinite(diag_glob[0]) || !std::isfinite(diag_glob[1])) {
+    if (mainproc) {
+      printf("Error: mass or energy is not finite at t = %lf (step %ld)\n",
+             diag_etime, diag_step);
+    }
+    MPI_Abort(MPI_COMM_WORLD, -1);
+  }
+}
+
+// Register the built-in in-situ consumers named by --insitu. A restart
+// appends to the logs of the run it continues
+void MiniWeatherSimulation::setup_insitu() {
+  std::stringstream list(insitu_list);
+  std::string name;
+  bool append = !restart_file.empty();
+  if (insitu_slice_at < 0) {
+    insitu_slice_at = (insitu_slice_dir == 'z' ? nz_glob : nx_glob) / 2;
+  }
+  while (std::getline(list, name, ',')) {
+    if (name == "stats" && insitu_bins > 0) {
+      add_insitu(std::unique_ptr<InSituConsumer>(new InSituStats(
+          insitu_stats_file, append, insitu_var, insitu_bins)));
+    } else if (name == "slice" &&
+               insitu_slice_at <
+                   (insitu_slice_dir == 'z' ? nz_glob : nx_glob)) {
+      add_insitu(std::unique_ptr<InSituConsumer>(
+          new InSituSlice(insitu_slice_file, append, insitu_var,
+                          insitu_slice_dir, insitu_slice_at)));
+    } else if (name == "image" && insitu_width > 0) {
+      add_insitu(std::unique_ptr<InSituConsumer>(new InSituImage(
+          std::string("insitu_") + insitu_field_names[insitu_var],
+          insitu_image_suffix, insitu_var, insitu_width)));
+    } else {
+      if (world_main) {
+        printf("Error: bad --insitu consumer %s, or its --insitu-bins, "
+               "--insitu-slice or --insitu-width\n",
+               name.c_str());
+      }
+      MPI_Abort(MPI_COMM_WORLD, -1);
+    }
+  }
+}
+
+// Hand every in-situ consumer a view of the state after num_steps steps. The
+// run loop is outside the time step's parallel region here, so the consumers
+// see finished interior cells
+void MiniWeatherSimulation::run_insitu() {
+  if (insitu.empty()) {
+    return;
+  }
+  ScopedTimer timer(timers, TIMER_OUTPUT);
+  fetch_state(state.data());
+  InSituView view;
+  view.state = state.data();
+  view.hy_dens_cell = hy_dens_cell.data();
+  view.hy_dens_theta_cell = hy_dens_theta_cell.data();
+  view.nx = nx;
+  view.nz = nz;
+  view.pitch = pitch;
+  view.hx = hx;
+  view.plane = plane;
+  view.i_beg = i_beg;
+  view.k_beg = k_beg;
+  view.nx_glob = nx_glob;
+  view.nz_glob = nz_glob;
+  view.dx = dx;
+  view.dz = dz;
+  view.etime = etime;
+  view.step = num_steps;
+  view.comm = comm;
+  view.rank = myrank;
+  for (auto &consumer : insitu) {
+    consumer->process(view);
+  }
 }
 
 // Compute reduced quantities for error checking without resorting to the
 // "ncdiff" tool
 void MiniWeatherSimulation::reductions(double &mass, double &te) {
-  mass = 0;
-  te = 0;
-  for (int k = 0; k < nz; k++) {
-    for (int i = 0; i < nx; i++) {
-      int ind_r = ID_DENS * (nz + 2 * hs) * (nx + 2 * hs) +
-                  (k + hs) * (nx + 2 * hs) + i + hs;
-      int ind_u = ID_UMOM * (nz + 2 * hs) * (nx + 2 * hs) +
-                  (k + hs) * (nx + 2 * hs) + i + hs;
-      int ind_w = ID_WMOM * (nz + 2 * hs) * (nx + 2 * hs) +
-                  (k + hs) * (nx + 2 * hs) + i + hs;
-      int ind_t = ID_RHOT * (nz + 2 * hs) * (nx + 2 * hs) +
-                  (k + hs) * (nx + 2 * hs) + i + hs;
-      double r = state[ind_r] + hy_dens_cell[hs + k]; // Density
-      double u = state[ind_u] / r;                    // U-wind
-      double w = state[ind_w] / r;                    // W-wind
-      double th = (state[ind_t] + hy_dens_theta_cell[hs + k]) /
-                  r;                        // Potential Temperature (theta)
-      double p = C0 * pow(r * th, gamm);    // Pressure
-      double t = th / pow(p0 / p, rd / cp); // Temperature
-      double ke = r * (u * u + w * w);      // Kinetic Energy
-      double ie = r * cv * t;               // Internal Energy
-      mass += r * dx * dz;                  // Accumulate domain mass
-      te += (ke + ie) * dx * dz;            // Accumulate domain total energy
-    }
+  double mass_loc = 0, te_loc = 0;
+#pragma omp parallel reduction(+ : mass_loc, te_loc) if (!Backend::device)
+  {
+    double m, e;
+    Dyn::mass_energy(grid(), Q_MAIN, dev(state.data()),
+                     dev(hy_dens_cell.data()), dev(hy_dens_theta_cell.data()),
+                     m, e);
+    mass_loc += m;
+    te_loc += e;
   }
   double glob[2], loc[2];
-  loc[0] = mass;
-  loc[1] = te;
+  loc[0] = mass_loc;
+  loc[1] = te_loc;
   // mpi：将本地结果loc，通过 MPI_Allreduce 函数，将所有进程的结果累加到 glob
   // 中
-  int ierr = MPI_Allreduce(loc, glob, 2, MPI_DOUBLE, MPI_SUM, MPI_COMM_WORLD);
+  int ierr;
+  {
+    ScopedTimer timer(timers, TIMER_REDUCE);
+    ierr = MPI_Allreduce(loc, glob, 2, MPI_DOUBLE, MPI_SUM, comm);
+  }
   mass = glob[0];
   te = glob[1];
 }
+
+// Print the per-phase min/avg/max over ranks and the max/avg load imbalance,
+// and write the same numbers to timers_file as JSON, or CSV for a .csv name
+void MiniWeatherSimulation::report_timers() {
+  double mn[NUM_TIMERS], mx[NUM_TIMERS], sum[NUM_TIMERS];
+  long calls[NUM_TIMERS];
+  FILE *fp;
+  bool csv;
+
+  if (!timers.enabled) {
+    return;
+  }
+  MPI_Reduce(timers.total, mn, NUM_TIMERS, MPI_DOUBLE, MPI_MIN, 0,
+             comm);
+  MPI_Reduce(timers.total, mx, NUM_TIMERS, MPI_DOUBLE, MPI_MAX, 0,
+             comm);
+  MPI_Reduce(timers.total, sum, NUM_TIMERS, MPI_DOUBLE, MPI_SUM, 0,
+             comm);
+  MPI_Reduce(timers.calls, calls, NUM_TIMERS, MPI_LONG, MPI_MAX, 0,
+             comm);
+  if (!mainproc) {
+    return;
+  }
+
+  printf("Phase timers over %d ranks (sec):\n", nranks);
+  printf("  %-18s %10s %10s %10s %8s %10s\n", "phase", "min", "avg", "max",
+         "max/avg", "calls");
+  for (int t = 0; t < NUM_TIMERS; t++) {
+    double avg = sum[t] / nranks;
+    printf("  %-18s %10.4lf %10.4lf %10.4lf %8.3lf %10ld\n", timer_names[t],
+           mn[t], avg, mx[t], avg > 0 ? mx[t] / avg : 1., calls[t]);
+  }
+
+  fp = fopen(timers_file.c_str(), "w");
+  if (fp == NULL) {
+    printf("Error: cannot write timer report %s\n", timers_file.c_str());
+    return;
+  }
+  csv = timers_file.size() >= 4 &&
+        timers_file.compare(timers_file.size() - 4, 4, ".csv") == 0;
+  if (csv) {
+    fprintf(fp, "phase,min,avg,max,calls\n");
+    for (int t = 0; t < NUM_TIMERS; t++) {
+      fprintf(fp, "%s,%.9e,%.9e,%.9e,%ld\n", timer_names[t], mn[t],
+              sum[t] / nranks, mx[t], calls[t]);
+    }
+  } else {
+    fprintf(fp, "{\n  \"nranks\": %d, \"px\": %d, \"pz\": %d,\n", nranks, px,
+            pz);
+    fprintf(fp, "  \"nx_glob\": %d, \"nz_glob\": %d, \"sim_time\": %.9e,\n",
+            nx_glob, nz_glob, sim_time);
+    fprintf(fp, "  \"phases\": {\n");
+    for (int t = 0; t < NUM_TIMERS; t++) {
+      fprintf(fp,
+              "    \"%s\": {\"min\": %.9e, \"avg\": %.9e, \"max\": %.9e, "
+              "\"calls\": %ld}%s\n",
+              timer_names[t], mn[t], sum[t] / nranks, mx[t], calls[t],
+              t + 1 < NUM_TIMERS ? "," : "");
+    }
+    fprintf(fp, "  }\n}\n");
+  }
+  fclose(fp);
+}
+
+// Time the exposed wait of the blocking x halo exchange, which waits as soon
+// as it has posted, alternating between state and state_tmp as the RK stages
+// do. An --overlap exchange cannot hide more communication than this
+void MiniWeatherSimulation::time_blocking_halo_x() {
+  const int iters = 20;
+  const double wait0 = halo_wait_time;
+#pragma omp parallel if (!Backend::device)
+  set_halo_values_x(state.data()); // Warm-up
+  Backend::wait_all();
+  MPI_Barrier(cart_comm);
+  const double wait1 = halo_wait_time;
+#pragma omp parallel if (!Backend::device)
+  for (int it = 0; it < iters; it++) {
+    set_halo_values_x(it % 2 ? state_tmp.data() : state.data());
+  }
+  Backend::wait_all();
+  blocking_wait_x = (halo_wait_time - wait1) / iters;
+  halo_wait_time = wait0;
+}
+
+// Report how long the ranks sat blocked on the x halo exchange. In --overlap
+// mode also report the blocking exchange's wait from start-up and how much
+// of it the interior fluxes hid: the reduction in exposed wait against
+// blocking exchanges, not the interior flux time itself
+void MiniWeatherSimulation::report_halo_timing() {
+  double loc[3], glob[3];
+  if (nranks == 1) {
+    return;
+  }
+  loc[0] = halo_wait_time;
+  loc[1] = overlap_time;
+  loc[2] = blocking_wait_x;
+  MPI_Reduce(loc, glob, 3, MPI_DOUBLE, MPI_MAX, 0, comm);
+  if (world_main) {
+    printf("Halo wait time (max over ranks): %lf sec\n", glob[0]);
+    if (overlap && px > 1) {
+      printf("Blocking x halo wait per exchange at start-up (max over ranks): "
+             "%le sec\n",
+             glob[2]);
+      printf("Halo wait hidden behind interior fluxes (max over ranks): %lf "
+             "sec\n",
+             glob[1]);
+    }
+  }
+}
+
+// Bind this rank to one of its node's devices: the rank within the node picks
+// device local_rank % ndev. MINIWEATHER_HOST_RANKS=n runs the last n ranks of
+// each node on the host cores instead, so the CPU sockets work alongside the
+// GPUs, and MINIWEATHER_HOST_FRACTION (default 0.1) is the share of the x
+// columns those ranks take together. Host backends run every rank on the host
+void MiniWeatherSimulation::bind_device() {
+  if (!Backend::device) {
+    return;
+  }
+  MPI_Comm local;
+  int local_rank, local_size;
+  MPI_Comm_split_type(MPI_COMM_WORLD, MPI_COMM_TYPE_SHARED, myrank,
+                      MPI_INFO_NULL, &local);
+  MPI_Comm_rank(local, &local_rank);
+  MPI_Comm_size(local, &local_size);
+  MPI_Comm_free(&local);
+  const char *env = getenv("MINIWEATHER_HOST_RANKS");
+  device = Backend::bind(local_rank, local_size, env ? atoi(env) : 0);
+
+  int is_host = (device < 0), nhost;
+  MPI_Allreduce(&is_host, &nhost, 1, MPI_INT, MPI_SUM, comm);
+  col_weight = 1.;
+  if (is_host && nhost < nranks) {
+    env = getenv("MINIWEATHER_HOST_FRACTION");
+    const double frac = env ? atof(env) : 0.1;
+    if (frac <= 0. || frac >= 1.) {
+      printf("Error: MINIWEATHER_HOST_FRACTION must lie strictly between 0 "
+             "and 1, got %s\n",
+             env);
+      MPI_Abort(MPI_COMM_WORLD, -1);
+    }
+    col_weight = frac * (nranks - nhost) / ((1. - frac) * nhost);
+  }
+}
+
+// Can MPI read and write device memory directly? MINIWEATHER_GPU_AWARE_MPI=0
+// or 1 overrides the answer, e.g. for MPI libraries without a query routine.
+// All ranks must agree, so take the minimum
+int MiniWeatherSimulation::query_gpu_aware_mpi() {
+  int aware = 0, aware_all;
+  if (!Backend::device) {
+    return 0;
+  }
+  const char *env = getenv("MINIWEATHER_GPU_AWARE_MPI");
+  if (env != NULL) {
+    aware = atoi(env) != 0;
+  } else {
+#if defined(MPIX_CUDA_AWARE_SUPPORT) && MPIX_CUDA_AWARE_SUPPORT
+    aware = MPIX_Query_cuda_support(); // Open MPI
+#elif defined(MPIX_GPU_SUPPORT_CUDA)
+    MPIX_GPU_query_support(MPIX_GPU_SUPPORT_CUDA, &aware); // MPICH 4
+#endif
+  }
+  MPI_Allreduce(&aware, &aware_all, 1, MPI_INT, MPI_MIN, comm);
+  return aware_all;
+}
+
+// Put the fields on the device for the time loop, and take them off again.
+// flux, tend and the halo buffers only ever live there
+void MiniWeatherSimulation::map_fields() {
+  Backend::enter(state.data(), state.size(), true);
+  Backend::enter(state_tmp.data(), state_tmp.size(), true);
+  Backend::enter(flux.data(), flux.size(), false);
+  Backend::enter(tend.data(), tend.size(), false);
+  if (!source.empty()) {
+    Backend::enter(source.data(), source.size(), true);
+  }
+  for (std::vector<double> *hy : {&hy_dens_cell, &hy_dens_theta_cell,
+                                  &hy_dens_int, &hy_dens_theta_int,
+                                  &hy_pressure_int}) {
+    Backend::enter(hy->data(), hy->size(), true);
+  }
+  for (std::vector<real> *buf : {&sendbuf_l, &sendbuf_r, &recvbuf_l,
+                                 &recvbuf_r, &sendbuf_b, &sendbuf_t,
+                                 &recvbuf_b, &recvbuf_t}) {
+    if (!buf->empty()) {
+      Backend::enter(buf->data(), buf->size(), false);
+    }
+  }
+  fields_mapped = true;
+}
+
+void MiniWeatherSimulation::unmap_fields() {
+  if (!fields_mapped) {
+    return;
+  }
+  Backend::wait_all();
+  Backend::exit(state.data(), state.size());
+  Backend::exit(state_tmp.data(), state_tmp.size());
+  Backend::exit(flux.data(), flux.size());
+  Backend::exit(tend.data(), tend.size());
+  if (!source.empty()) {
+    Backend::exit(source.data(), source.size());
+  }
+  for (std::vector<double> *hy : {&hy_dens_cell, &hy_dens_theta_cell,
+                                  &hy_dens_int, &hy_dens_theta_int,
+                                  &hy_pressure_int}) {
+    Backend::exit(hy->data(), hy->size());
+  }
+  for (std::vector<real> *buf : {&sendbuf_l, &sendbuf_r, &recvbuf_l,
+                                 &recvbuf_r, &sendbuf_b, &sendbuf_t,
+                                 &recvbuf_b, &recvbuf_t}) {
+    if (!buf->empty()) {
+      Backend::exit(buf->data(), buf->size());
+    }
+  }
+  fields_mapped = false;
+}
+
+// Bring state (state or state_tmp) back to the host before output, the in-situ
+// hooks or a checkpoint read it there
+void MiniWeatherSimulation::fetch_state(const real *state) {
+  if (!fields_mapped) {
+    return;
+  }
+  Backend::update_host(const_cast<real *>(state), this->state.size(), Q_MAIN);
+  Backend::wait(Q_MAIN);
+}
+
+// Time the x halo exchange through host-staged buffers and, if MPI is
+// GPU-aware, through device buffers. Prints the slowest rank's cost per time
+// step of the integrator's exchanges
+void MiniWeatherSimulation::compare_halo_paths() {
+  const int nrep = 20;
+  const int aware = gpu_aware_mpi;
+  double t[2] = {0., 0.}, tmax[2], t0;
+  if (!Backend::device || px == 1) {
+    return;
+  }
+  for (int path = 0; path <= aware; path++) {
+    gpu_aware_mpi = path;
+    set_halo_values_x(state.data());
+    Backend::wait_all();
+    MPI_Barrier(comm);
+    t0 = MPI_Wtime();
+    for (int rep = 0; rep < nrep; rep++) {
+      set_halo_values_x(state.data());
+    }
+    Backend::wait_all();
+    t[path] = (MPI_Wtime() - t0) / nrep;
+  }
+  gpu_aware_mpi = aware;
+  MPI_Allreduce(t, tmax, 2, MPI_DOUBLE, MPI_MAX, comm);
+  if (world_main) {
+    const int per_step = integrator->num_stages;
+    printf("Halo exchange per step: host-staged %lf ms", per_step * tmax[0] * 1e3);
+    if (aware) {
+      printf(", GPU-aware %lf ms (using GPU-aware MPI)\n",
+             per_step * tmax[1] * 1e3);
+    } else {
+      printf(" (MPI is not GPU-aware, using host staging)\n");
+    }
+  }
+}
+
+// One line per rank of a device build: its node, device, x columns, time
+// loop, time blocked in the x halo waits and cell updates per second of the
+// time it was not blocked. The host waits while its own device works through
+// the interior, so a short wait marks the slowest device and long waits the
+// ranks held up by it
+void MiniWeatherSimulation::report_devices(double loop_time) {
+  if (!Backend::device) {
+    return;
+  }
+  char name[MPI_MAX_PROCESSOR_NAME] = {0};
+  int len;
+  MPI_Get_processor_name(name, &len);
+  const double mine[4] = {(double)device, (double)nx, loop_time,
+                          halo_wait_time};
+  std::vector<double> all(4 * nranks);
+  std::vector<char> names(nranks * MPI_MAX_PROCESSOR_NAME);
+  MPI_Gather(mine, 4, MPI_DOUBLE, all.data(), 4, MPI_DOUBLE, 0, comm);
+  MPI_Gather(name, MPI_MAX_PROCESSOR_NAME, MPI_CHAR, names.data(),
+             MPI_MAX_PROCESSOR_NAME, MPI_CHAR, 0, comm);
+  if (!mainproc) {
+    return;
+  }
+  printf("Per-device timings over %ld steps (%s):\n", num_steps,
+         Backend::name);
+  printf("  %5s %-16s %7s %6s %10s %12s %14s\n", "rank", "node", "device",
+         "nx", "loop (s)", "halo wait (s)", "Mcell-steps/s");
+  for (int r = 0; r < nranks; r++) {
+    const double *a = &all[4 * r];
+    char dev_name[16];
+    if (a[0] < 0) {
+      snprintf(dev_name, sizeof(dev_name), "host");
+    } else {
+      snprintf(dev_name, sizeof(dev_name), "gpu %d", (int)a[0]);
+    }
+    const double rate = a[1] * nz * num_steps / (a[2] - a[3]) * 1e-6;
+    printf("  %5d %-16.16s %7s %6d %10.4lf %12.4lf %14.2lf\n", r,
+           &names[r * MPI_MAX_PROCESSOR_NAME], dev_name, (int)a[1], a[2], a[3],
+           rate);
+  }
+}
+
+// One line per ensemble member: its data spec, perturbation amplitude and
+// hyperviscosity, the conservation errors and the time loop's wall time
+void MiniWeatherSimulation::report_ensemble(double loop_time) {
+  constexpr int nfields = 6;
+  std::vector<double> loc(nfields * n_members, 0.), glob(nfields * n_members);
+  if (mainproc) {
+    double *f = &loc[nfields * member];
+    f[0] = data_spec_int;
+    f[1] = amp;
+    f[2] = hyperviscosity;
+    f[3] = (mass - mass0) / mass0;
+    f[4] = (te - te0) / te0;
+    f[5] = loop_time;
+  }
+  MPI_Reduce(loc.data(), glob.data(), nfields * n_members, MPI_DOUBLE, MPI_SUM,
+             0, MPI_COMM_WORLD);
+  if (!world_main) {
+    return;
+  }
+  printf("member  data        amp    hv_beta         d_mass           d_te"
+         "   time (sec)\n");
+  for (int m = 0; m < n_members; m++) {
+    const double *f = &glob[nfields * m];
+    printf("%6d %5d %10lf %10lf %14le %14le %12lf\n", m, (int)f[0], f[1], f[2],
+           f[3], f[4], f[5]);
+  }
+}
+
+// --numa-report: for every thread of every rank, the CPU it is running on, that
+// CPU's NUMA node and the CPUs its affinity mask allows, then for each rank
+// the share of the density-plane pages that a thread updates in the apply
+// loop which live on that thread's node. Without --first-touch all of them
+// sit on the master thread's node
+void MiniWeatherSimulation::report_numa_placement() {
+  constexpr int line_len = 160;
+  int nthreads = 1, max_threads;
+  long placed[2] = {0, 0}, placed_all[2];
+#ifdef _OPENMP
+  nthreads = omp_get_max_threads();
+#endif
+  MPI_Allreduce(&nthreads, &max_threads, 1, MPI_INT, MPI_MAX, comm);
+  std::vector<char> lines(max_threads * line_len, 0);
+  std::vector<char> all_lines(mainproc ? nranks * lines.size() : 0);
+  long local_pages = 0, queried_pages = 0;
+
+#pragma omp parallel reduction(+ : local_pages, queried_pages)
+  {
+    int t = thread_num();
+    int cpu = -1, node = -1;
+    std::string allowed;
+#ifdef __linux__
+    unsigned c, n;
+    if (syscall(SYS_getcpu, &c, &n, nullptr) == 0) {
+      cpu = c;
+      node = n;
+    }
+    cpu_set_t mask;
+    CPU_ZERO(&mask);
+    if (sched_getaffinity(0, sizeof(mask), &mask) == 0) {
+      // Compress the mask into ranges, e.g. 0-3,8
+      for (int b = 0; b < CPU_SETSIZE; b++) {
+        if (!CPU_ISSET(b, &mask)) {
+          continue;
+        }
+        int e = b;
+        while (e + 1 < CPU_SETSIZE && CPU_ISSET(e + 1, &mask)) {
+          e++;
+        }
+        allowed += (allowed.empty() ? "" : ",") + std::to_string(b);
+        if (e > b) {
+          allowed += "-" + std::to_string(e);
+        }
+        b = e;
+      }
+    }
+#endif
+    snprintf(&lines[t * line_len], line_len,
+             "  rank %4d thread %3d: cpu %4d node %2d allowed %s", myrank, t,
+             cpu, node, allowed.empty() ? "?" : allowed.c_str());
+
+    // Pages of the density plane this thread updates in the apply loop
+    std::vector<void *> pages;
+    const uintptr_t page = sysconf(_SC_PAGESIZE);
+#pragma omp for collapse(2) schedule(static)
+    for (int k = 0; k < nz; k++) {
+      for (int i = 0; i < nx; i++) {
+        uintptr_t a = (uintptr_t)&state[ID_DENS * plane + (k + hs) * pitch +
+                                        i + hx] &
+                      ~(page - 1);
+        if (pages.empty() || pages.back() != (void *)a) {
+          pages.push_back((void *)a);
+        }
+      }
+    }
+#if defined(__linux__) && defined(SYS_move_pages)
+    // move_pages with no target nodes only reports where each page lives
+    std::vector<int> status(pages.size(), -1);
+    if (node >= 0 && !pages.empty() &&
+        syscall(SYS_move_pages, 0, pages.size(), pages.data(), nullptr,
+                status.data(), 0) == 0) {
+      for (int st : status) {
+        if (st >= 0) {
+          queried_pages++;
+          local_pages += (st == node);
+        }
+      }
+    }
+#endif
+  }
+  placed[0] = local_pages;
+  placed[1] = queried_pages;
+
+  MPI_Gather(lines.data(), lines.size(), MPI_CHAR, all_lines.data(),
+             lines.size(), MPI_CHAR, 0, comm);
+  MPI_Reduce(placed, placed_all, 2, MPI_LONG, MPI_SUM, 0, comm);
+  if (!mainproc) {
+    return;
+  }
+  printf("Thread binding (%s first touch):\n",
+         first_touch ? "parallel" : "master thread");
+  for (int l = 0; l < nranks * max_threads; l++) {
+    if (all_lines[l * line_len] != 0) {
+      printf("%s\n", &all_lines[l * line_len]);
+    }
+  }
+  if (placed_all[1] > 0) {
+    printf("State pages on the updating thread's NUMA node: %.1lf%% of %ld\n",
+           100. * placed_all[0] / placed_all[1], placed_all[1]);
+  } else {
+    printf("State pages on the updating thread's NUMA node: unavailable\n");
+  }
+}